@@ -19,6 +19,24 @@ mat3 normal_cob(const vec3 normal) {
     return S;
 }
 
+vec3 oct_decode(const vec2 e) {
+    vec3 n = vec3(e, 1. - abs(e.x) - abs(e.y));
+    const float t = max(-n.z, 0.);
+    n.xy += vec2(n.x >= 0. ? -t : t, n.y >= 0. ? -t : t);
+    return normalize(n);
+}
+
+Vertex decode_vertex(const vec3 position, const CompactVertex c) {
+    Vertex v;
+    v.position = position;
+    v.normal = oct_decode(unpackSnorm2x16(c.normal));
+    const vec2 t = vec2(c.tangent & 0x7FFFu, (c.tangent >> 15) & 0x7FFFu) / 32767. * 2. - 1.;
+    v.tangent = vec4(oct_decode(t), (c.tangent >> 31) != 0u ? -1. : 1.);
+    v.uv = unpackHalf2x16(c.uv);
+    v.color = unpackUnorm4x8(c.color);
+    return v;
+}
+
 float D_GGX(const float NoH, const float a) {
     const float a2 = a * a;
     const float f = (NoH * a2 - NoH) * NoH + 1.0;
@@ -80,6 +98,16 @@ vec3 evaluate_point_light(const Light light, const float distanceSquared, const
     return luminance;
 }
 
+vec2 directionToSphericalEnvmap(vec3 dir) {
+    float phi = atan(dir.z, dir.x);
+    float theta = asin(dir.y);
+    vec2 uv;
+    uv.x = (phi + PI) * ONEOVERTWOPI;
+    uv.y = theta * ONEOVERPI + 0.5;
+
+    return uv;
+}
+
 float luminance(const vec3 v)
 {
     return dot(v, vec3(0.2126f, 0.7152f, 0.0722f));
@@ -195,3 +223,17 @@ float stepAndOutputRNGFloat(inout uint rngState)
     word = (word >> 22) ^ word;
     return float(word) / 4294967295.0f;
 }
+
+// PCG hash, used to turn (pixel, frame) into a well distributed RNG seed
+uint pcg_hash(const uint v)
+{
+    const uint state = v * 747796405u + 2891336453u;
+    const uint word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+// Initial RNG state of a pixel. Changes every frame so that consecutive frames can be accumulated
+uint init_rng(const uvec2 pixel, const uvec2 size, const uint frame)
+{
+    return pcg_hash(size.x * pixel.y + pixel.x + pcg_hash(frame));
+}
@@ -0,0 +1,369 @@
+// Scene resources and surface shading shared by the closest-hit shader and the compute backends.
+// The including shader declares tMax and the PRESAMPLE and MATERIAL_CLASS specialization constants,
+// and includes types.glsl and functions.glsl first
+
+layout(binding = 3, set = 0) uniform sampler2D presamplingHemisphere;
+layout(binding = 4, set = 0) uniform sampler3D presamplingGGX;
+
+layout(set = 1, binding = 1) uniform sampler samplers[];
+layout(set = 1, binding = 2) uniform texture2D textures[];
+
+// Every light and its alias table bin, written by LightsManager
+layout(set = 1, binding = 3, scalar) readonly buffer LightsBuffer
+{
+    LightEntry lights[];
+};
+
+layout(buffer_reference, std430, scalar) readonly buffer VertexBuffer
+{
+    Vertex vertices[];
+};
+
+layout(buffer_reference, std140, scalar) readonly buffer IndexBuffer
+{
+    uint indices[];
+};
+
+layout(buffer_reference, scalar) readonly buffer PositionBuffer
+{
+    vec3 positions[];
+};
+
+layout(buffer_reference, scalar) readonly buffer CompactVertexBuffer
+{
+    CompactVertex vertices[];
+};
+
+struct SurfaceStorage
+{
+    IndexBuffer indexBuffer;
+    VertexBuffer vertexBuffer; // CompactVertexBuffer with SURFACE_COMPACT_VERTICES
+    PositionBuffer positionBuffer; // Only with SURFACE_COMPACT_VERTICES
+    uint materialIndex;
+    uint startIndex;
+    uint count;
+    uint flags;
+};
+
+uint load_index(const SurfaceStorage surface, const uint i)
+{
+    if ((surface.flags & SURFACE_INDICES_16) != 0u)
+    {
+        // Two indices per word, the first one in the low half
+        const uint word = surface.indexBuffer.indices[i >> 1];
+        return (word >> ((i & 1u) * 16u)) & 0xFFFFu;
+    }
+    return surface.indexBuffer.indices[i];
+}
+
+Vertex load_vertex(const SurfaceStorage surface, const uint i)
+{
+    if ((surface.flags & SURFACE_COMPACT_VERTICES) != 0u)
+        return decode_vertex(surface.positionBuffer.positions[i],
+            CompactVertexBuffer(surface.vertexBuffer).vertices[i]);
+    return surface.vertexBuffer.vertices[i];
+}
+
+layout(set = 1, binding = 0, scalar) readonly buffer SurfaceStorageBuffer
+{
+    SurfaceStorage surfaces[];
+};
+
+layout(set = 1, binding = 4, scalar) readonly buffer MaterialTable
+{
+    MaterialData materials[];
+};
+
+const float reflectance = 0.5;
+const vec3 nonMetallicF0 = vec3(0.16 * reflectance * reflectance);
+
+// Explicit LOD of a texture for a ray cone footprint. coneLod is the texture independent part
+float texture_lod(const uint imageIndex, const uint samplerIndex, const float coneLod)
+{
+    const vec2 size = vec2(textureSize(sampler2D(textures[nonuniformEXT(imageIndex)],
+                samplers[nonuniformEXT(samplerIndex)]), 0));
+    return coneLod + 0.5 * log2(size.x * size.y);
+}
+
+// Picks a light in proportion to its power with the alias table. pdf is its selection probability.
+// numLights > 0
+uint sample_light(const uint numLights, inout uint rngState, out float pdf)
+{
+    // The integer part picks the bin, the fraction decides between the bin and its alias
+    const float u = stepAndOutputRNGFloat(rngState) * float(numLights);
+    const uint bin = min(uint(u), numLights - 1);
+    const uint i = (fract(u) < lights[bin].aliasProbability) ? bin : lights[bin].alias;
+    pdf = lights[i].pdf;
+    return i;
+}
+
+// Unoccluded luminance reflected towards v by a single light. Returns the shadow ray through l and distanceToLight
+vec3 evaluate_light(const Light light, const vec3 worldPos, const vec3 normal, const vec3 v, const vec3 diffuseColor, const vec3 f0, const float f90, const float a, const float NoV, out vec3 l, out float distanceToLight)
+{
+    float distanceSquared = 1.;
+    distanceToLight = tMax;
+    // Vector to the light
+    switch (light.type)
+    {
+        case 0: // Point
+        l = light.positionOrDirection - worldPos;
+        distanceSquared = dot(l, l);
+        distanceToLight = sqrt(distanceSquared);
+        l /= distanceToLight;
+        break;
+        case 1: // Directional
+        l = -light.positionOrDirection; // Already normalized from Host
+        break;
+    }
+    // Skip light if light or camera not looking to the hit point
+    const float NoL = clamp(dot(normal, l), 0., 1.);
+    if (NoL < 1e-5 || NoV < 1e-5)
+        return vec3(0.);
+
+    const vec3 h = normalize(l + v);
+
+    const float NoH = clamp(dot(normal, h), 0., 1.);
+    const float LoH = clamp(dot(l, h), 0., 1.);
+
+    const vec3 BSDF = BSDF(NoH, LoH, NoV, NoL,
+            diffuseColor, f0, f90, a);
+
+    // DIRECT LUMINANCE
+    vec3 luminance = vec3(0.);
+    switch (light.type) {
+        case 0: // Point light
+        luminance = evaluate_point_light(light, distanceSquared, BSDF);
+        break;
+        case 1: // Directional light
+        luminance = evaluate_directional_light(light, BSDF);
+        break;
+    }
+    return luminance;
+}
+
+void cosine_sample_hemisphere_cached(in const mat3 S, in const vec2 u, out vec3 sampleDir, out float pdf, out float nDotL) {
+    // Round to 2 decimals: 0.0132345 -> 0.01
+    const ivec2 index = min(ivec2(round(u * 100.f)), ivec2(99));
+    const vec3 sampleInNormalFrame = texelFetch(presamplingHemisphere, index, 0).xyz;
+    // print_val("s %f ", presample.w, 2., 1.);
+    sampleDir = S * sampleInNormalFrame;
+    nDotL = sampleInNormalFrame.z;
+    pdf = nDotL * ONEOVERPI;
+}
+
+void sample_microfacet_ggx_specular_cached(in const mat3 S, in const vec3 v, in const vec2 u, in const float a, out vec3 sampleDir, out vec3 h, out float nDotL, out float vDotH, out float pdf)
+{
+    const float a2 = a * a;
+    // Round to 2 decimals: 0.0132345 -> 0.01
+    const ivec3 index = min(ivec3(round(vec3(u, a) * 100.f)), ivec3(99));
+
+    // Half vector in local frame
+    // const vec3 hLocal = vec3(stheta * cos(phi), stheta * sin(phi), ctheta);
+    const vec3 hLocal = texelFetch(presamplingGGX, index, 0).xyz;
+    const float ctheta = hLocal.z;
+    // Move to world frame
+    h = S * hLocal;
+
+    // Reflect view direction around half-vector to get light direction
+    sampleDir = reflect(-v, h);
+
+    nDotL = dot(sampleDir, S[2]);
+    vDotH = dot(v, h);
+    pdf = pdf_microfacet_ggx_specular(ctheta, a2, vDotH);
+}
+
+// BSDF inputs at a hit point, in world space
+struct SurfaceHit
+{
+    vec3 position;
+    vec3 normal; // Shading normal, flipped towards v
+    vec3 v; // Inverse incoming ray direction
+    float NoV;
+    vec3 diffuseColor;
+    vec3 f0;
+    float f90;
+    float a;
+    float coneWidth; // Ray cone width at the hit, the origin width of the rays it spawns
+};
+
+// Loads the geometry and the material of a triangle hit and evaluates its textures. attribs are the
+// hit barycentrics, coneWidth and coneSpread the ray cone at the ray origin
+SurfaceHit evaluate_surface(const uint surfaceId, const uint primitiveId, const vec2 attribs, const mat4x3 objectToWorld, const mat4x3 worldToObject, const vec3 rayDirection, const float hitT, const float coneWidth, const float coneSpread, const float dScale)
+{
+    // -------- LOAD ALL THE DATA --------
+    SurfaceStorage surface = surfaces[surfaceId];
+
+    const uint primitiveIndex = surface.startIndex + primitiveId * 3;
+
+    const MaterialData material = materials[surface.materialIndex];
+    const uint colorSamplerIndex = material.colorSamplerIndex;
+    const uint colorImageIndex = material.colorImageIndex;
+    const uint materialSamplerIndex = material.materialSamplerIndex;
+    const uint materialImageIndex = material.materialImageIndex;
+    const uint normalMapIndex = material.normalMapIndex;
+    const uint normalSamplerIndex = material.normalSamplerIndex;
+
+    const uint i0 = load_index(surface, primitiveIndex);
+    const uint i1 = load_index(surface, primitiveIndex + 1);
+    const uint i2 = load_index(surface, primitiveIndex + 2);
+
+    const Vertex v0 = load_vertex(surface, i0);
+    const Vertex v1 = load_vertex(surface, i1);
+    const Vertex v2 = load_vertex(surface, i2);
+
+    const vec3 vertPos0 = v0.position;
+    const vec3 vertPos1 = v1.position;
+    const vec3 vertPos2 = v2.position;
+
+    const vec2 uv0 = v0.uv;
+    const vec2 uv1 = v1.uv;
+    const vec2 uv2 = v2.uv;
+
+    const vec3 barycentrics = vec3(1. - attribs.x - attribs.y, attribs.x, attribs.y);
+
+    // Computing the coordinates of the hit position
+    const vec3 pos = vertPos0 * barycentrics.x + vertPos1 * barycentrics.y
+            + vertPos2 * barycentrics.z;
+
+    const vec3 normalVtxRaw = v0.normal * barycentrics.x + v1.normal * barycentrics.y
+            + v2.normal * barycentrics.z; // already normalized
+    // Apply the transformation to the normals (not done in BLAS creation).
+    // The scale factor through push constants is a small optimization in order to avoid the non-linear normalization
+    const vec3 normalVtx = (normalVtxRaw * mat3(worldToObject)) * dScale;
+
+    const vec2 uv = uv0 * barycentrics.x + uv1 * barycentrics.y + uv2 * barycentrics.z;
+
+    // Ray cone LOD (Akenine-Moller et al., Ray Tracing Gems 2019): texel to world area ratio of the triangle, plus the
+    // cone width at the hit projected onto the triangle. Secondary rays keep the primary spread
+    const vec3 edge1 = mat3(objectToWorld) * (vertPos1 - vertPos0);
+    const vec3 edge2 = mat3(objectToWorld) * (vertPos2 - vertPos0);
+    const vec3 faceNormal = cross(edge1, edge2);
+    const float worldArea = length(faceNormal);
+    const vec2 uvEdge1 = uv1 - uv0;
+    const vec2 uvEdge2 = uv2 - uv0;
+    const float uvArea = abs(uvEdge1.x * uvEdge2.y - uvEdge1.y * uvEdge2.x);
+    const float hitConeWidth = coneWidth + coneSpread * hitT;
+    const float NoD = abs(dot(faceNormal / max(worldArea, 1e-12), rayDirection));
+    const float coneLod = 0.5 * log2(uvArea / max(worldArea, 1e-12))
+            + log2(hitConeWidth / max(NoD, 1e-4));
+
+    vec3 normal = normalVtx;
+    if (MATERIAL_CLASS == MATERIAL_FULL_PBR && normalMapIndex != -1)
+    {
+        const vec3 tangentRaw = v0.tangent.xyz * barycentrics.x + v1.tangent.xyz * barycentrics.y
+                + v2.tangent.xyz * barycentrics.z; // range [-1, 1]
+        const float handedness = v0.tangent.w; // All vi.tangent.w are the same
+        const vec3 tangent = (tangentRaw * mat3(worldToObject)) * dScale;
+
+        const vec3 bitangent = cross(normalVtx, tangent) * handedness;
+
+        const mat3 TBN = mat3(tangent, bitangent, normalVtx);
+
+        // Only xy are used, BC5 normal maps do not store z. Every normal map has them in rg
+        vec3 normalTex = vec3(2.
+                    * textureLod(sampler2D(textures[nonuniformEXT(normalMapIndex)],
+                            samplers[nonuniformEXT(normalSamplerIndex)]),
+                        uv, texture_lod(normalMapIndex, normalSamplerIndex, coneLod)).xy - 1., 0.); // range [0, 1] -> [-1, 1]
+        normalTex.z = sqrt(max(1. - dot(normalTex.xy, normalTex.xy), 0.));
+
+        normal = normalize(TBN * normalTex);
+    }
+
+    const vec4 baseColor = (MATERIAL_CLASS != MATERIAL_UNTEXTURED && colorImageIndex != -1) ? textureLod(sampler2D(textures[nonuniformEXT(colorImageIndex)],
+                samplers[nonuniformEXT(colorSamplerIndex)]),
+            uv, texture_lod(colorImageIndex, colorSamplerIndex, coneLod))
+            * material.baseColorFactor : material.baseColorFactor; // range [0, 1]
+
+    const vec4 metallicRoughness = (MATERIAL_CLASS == MATERIAL_FULL_PBR && materialImageIndex != -1) ? textureLod(sampler2D(textures[nonuniformEXT(materialImageIndex)],
+                samplers[nonuniformEXT(materialSamplerIndex)]),
+            uv, texture_lod(materialImageIndex, materialSamplerIndex, coneLod))
+            * vec4(0,
+                material.roughnessFactor,
+                material.metallicFactor,
+                0) : vec4(0, material.roughnessFactor, material.metallicFactor, 0);
+    const float perceptualRoughness = metallicRoughness.y;
+    const float metallic = metallicRoughness.z;
+
+    // -------------- BRDF --------------
+    SurfaceHit hit;
+    // Transforming the position to world space
+    hit.position = objectToWorld * vec4(pos, 1.);
+    hit.coneWidth = hitConeWidth;
+
+    // Parametrization
+    hit.diffuseColor = (1. - metallic) * baseColor.xyz;
+    hit.f0 = mix(nonMetallicF0, baseColor.xyz, metallic);
+    hit.f90 = clamp(50.0 * hit.f0.y, 0.0, 1.0);
+    // perceptually linear roughness to roughness
+    hit.a = perceptualRoughness;
+    // Ray directions
+    hit.v = -rayDirection; // Inverse incoming (view) ray direction. Already normalized
+    hit.NoV = dot(normal, hit.v);
+    if (hit.NoV < 0.) {
+        hit.NoV = -hit.NoV;
+        normal = -normal;
+    }
+    hit.normal = normal;
+    return hit;
+}
+
+// One vertex of the iterative integrator, without tracing anything
+struct PathVertex
+{
+    vec3 lightContribution; // Unoccluded, already weighted by the throughput. 0 without NEE
+    vec3 lightDirection;
+    float lightDistance;
+    vec3 throughput; // Including the sampled lobe
+    vec3 nextDirection; // vec3(0) if the path ends here
+};
+
+// One-sample MIS picks either the diffuse or the specular lobe, and next event estimation picks one light
+// with sample_light. The caller traces the shadow ray and the continuation
+PathVertex sample_path_vertex(const SurfaceHit hit, const vec3 throughput, const uint numLights, inout uint rngState)
+{
+    PathVertex vertex;
+    vertex.lightContribution = vec3(0.);
+    vertex.throughput = throughput;
+    vertex.nextDirection = vec3(0.);
+
+    // NEXT EVENT ESTIMATION
+    if (numLights > 0) {
+        float pdf;
+        const uint i = sample_light(numLights, rngState, pdf);
+        const vec3 lightLuminance = evaluate_light(lights[i].light, hit.position, hit.normal, hit.v,
+                hit.diffuseColor, hit.f0, hit.f90, hit.a, hit.NoV, vertex.lightDirection, vertex.lightDistance);
+        vertex.lightContribution = throughput * lightLuminance / pdf;
+    }
+
+    // CONTINUATION
+    // Lobe selection probability proportional to the albedo of each lobe
+    const float specularAlbedo = luminance(F_Schlick(hit.NoV, hit.f0, hit.f90));
+    const float pSpecular = clamp(specularAlbedo / (specularAlbedo + luminance(hit.diffuseColor) + 1e-5), 0.1, 0.9);
+
+    const mat3 S = normal_cob(hit.normal);
+    const vec2 u = vec2(stepAndOutputRNGFloat(rngState), stepAndOutputRNGFloat(rngState));
+    vec3 l, h;
+    float NoL, pdf_diffuse, pdf_specular;
+    if (stepAndOutputRNGFloat(rngState) < pSpecular) {
+        float VoH;
+        (PRESAMPLE) ? sample_microfacet_ggx_specular_cached(S, hit.v, u, hit.a, l, h, NoL, VoH, pdf_specular) :
+        sample_microfacet_ggx_specular(S, hit.v, u, hit.a, l, h, NoL, VoH, pdf_specular);
+        pdf_diffuse = pdf_cosine_sample_hemisphere(NoL);
+    } else {
+        (PRESAMPLE) ? cosine_sample_hemisphere_cached(S, u, l, pdf_diffuse, NoL) :
+        cosine_sample_hemisphere(S, u, l, pdf_diffuse, NoL);
+        h = normalize(l + hit.v);
+        pdf_specular = pdf_microfacet_ggx_specular(dot(hit.normal, h), hit.a * hit.a, dot(hit.v, h));
+    }
+
+    // Combined pdf of the one-sample MIS estimator (balance heuristic)
+    const float pdf = (1. - pSpecular) * pdf_diffuse + pSpecular * pdf_specular;
+    if (NoL < 1e-5 || pdf < 1e-5)
+        return vertex; // nextDirection stays at 0, the path ends here
+
+    const vec3 BSDF = BSDF(dot(hit.normal, h), dot(l, h), hit.NoV, NoL,
+            hit.diffuseColor, hit.f0, hit.f90, hit.a);
+    vertex.throughput = throughput * BSDF / pdf;
+    vertex.nextDirection = l;
+    return vertex;
+}
@@ -45,13 +45,47 @@ struct Vertex {
     vec4 color;
 };
 
+// Compact layout: quantized attributes next to a separate position stream
+struct CompactVertex {
+    uint normal; // Octahedral, snorm 2x16
+    uint tangent; // Octahedral, unorm 2x15, handedness in the top bit
+    uint uv; // Half 2x16
+    uint color; // RGBA8
+};
+
+// SurfaceStorage flags
+const uint SURFACE_COMPACT_VERTICES = 1u << 0;
+const uint SURFACE_INDICES_16 = 1u << 1;
+const uint SURFACE_CLASS_SHIFT = 8u; // MaterialClass in the flags bits above
+
+// MaterialClass, the closest-hit specialization of each hit group
+const uint MATERIAL_UNTEXTURED = 0u;
+const uint MATERIAL_BASE_COLOR_TEXTURE = 1u;
+const uint MATERIAL_FULL_PBR = 2u;
+const uint MATERIAL_CLASS_COUNT = 3u;
+
 struct HitPayload
 {
     vec3 hitValue;
     uint depth;
+    // Ray cone for the texture LOD: width at the ray origin and spread angle. The hit shader
+    // replaces the width with the one at the hit, which is the origin of the rays it spawns
+    float coneWidth;
+    float coneSpread;
     // float energyFactor;
+    // Only used by the iterative integrator: the hit shader returns the next path vertex
+    uint rngState;
+    vec3 throughput; // Path throughput, updated by the hit shader with the sampled lobe weight
+    vec3 nextOrigin;
+    vec3 nextDirection; // vec3(0) if the path ends here
+    vec3 lightContribution; // Unoccluded next event estimation, already weighted by the throughput
+    vec3 lightDirection;
+    float lightDistance;
 };
 
+const uint INTEGRATOR_RECURSIVE = 0;
+const uint INTEGRATOR_ITERATIVE = 1;
+
 struct Light
 {
     vec3 positionOrDirection;
@@ -60,16 +94,37 @@ struct Light
     uint type; // 0 - point, 1 - directional
 };
 
+// Mirrors LightEntry. Bin i of the alias table lives next to light i
+struct LightEntry
+{
+    Light light;
+    float aliasProbability; // Of keeping this bin's light instead of jumping to alias
+    uint alias;
+    float pdf; // Selection probability of this light, proportional to its power
+};
+
 struct RayPush
 {
     vec4 clearColor;
     uint numLights;
     float dScale;
+    uint frame;
+    uint accumulatedSamples;
+    uint integrator;
+    uint pathDepth;
 };
 
-struct MaterialConstants
+// One cache line per material, see MaterialData in loader.hpp
+struct MaterialData
 {
     vec4 baseColorFactor;
     float metallicFactor;
     float roughnessFactor;
+    int colorImageIndex;
+    int colorSamplerIndex;
+    int materialImageIndex;
+    int materialSamplerIndex;
+    int normalMapIndex;
+    int normalSamplerIndex;
+    uint pad[4];
 };
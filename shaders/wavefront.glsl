@@ -0,0 +1,113 @@
+// Ray streams and push constants shared by the wavefront stages. The streams are structures of
+// arrays, one entry per pixel, suballocated by WavefrontRenderer. Includes types.glsl first
+
+const uint WAVEFRONT_GROUP_SIZE = 64; // Of every 1D stage
+const uint DIRECTION_BINS = 8; // Ray direction octants
+const uint SHADE_BINS = MATERIAL_CLASS_COUNT * DIRECTION_BINS;
+const uint NO_HIT = 0xFFFFFFFFu; // Bin of the rays that missed
+
+// WavefrontRenderer::Phase, the work of the control stage
+const uint PHASE_EXTEND = 0; // Before extend: its indirect args, and resets the counters it fills
+const uint PHASE_SHADE = 1; // After extend: bin offsets and the shade args of every class
+const uint PHASE_SHADOW = 2; // After shade: the shadow args
+
+struct DispatchArgs
+{
+    uint x;
+    uint y;
+    uint z;
+};
+
+// Mirrored by WavefrontCounters. Doubles as the indirect dispatch buffer
+layout(buffer_reference, scalar) buffer Counters
+{
+    DispatchArgs extendArgs;
+    DispatchArgs shadowArgs;
+    DispatchArgs shadeArgs[MATERIAL_CLASS_COUNT];
+    uint rayCount[2]; // Of each ray queue
+    uint shadowCount;
+    uint classStart[MATERIAL_CLASS_COUNT + 1]; // Range of each class in the shade queue
+    uint binCount[SHADE_BINS];
+    uint binCursor[SHADE_BINS];
+};
+
+layout(buffer_reference, scalar) buffer Vec4Stream
+{
+    vec4 v[];
+};
+
+layout(buffer_reference, scalar) buffer UVec4Stream
+{
+    uvec4 v[];
+};
+
+layout(buffer_reference, scalar) buffer UintStream
+{
+    uint v[];
+};
+
+layout(buffer_reference, scalar) buffer FloatStream
+{
+    float v[];
+};
+
+layout(buffer_reference, scalar) buffer TransformStream
+{
+    mat4x3 v[];
+};
+
+// Mirrored by WavefrontStreams
+layout(buffer_reference, scalar) readonly buffer Streams
+{
+    Counters counters;
+    // Ray queues, swapped every bounce. Origin and cone width, direction and cone spread
+    Vec4Stream rayOrigin[2];
+    Vec4Stream rayDirection[2];
+    UintStream rayPixel[2];
+    // Path state, per pixel
+    Vec4Stream pathThroughput;
+    Vec4Stream pathRadiance;
+    UintStream pathRng;
+    // Hits of the current bounce, per ray. Surface, primitive and barycentric bits
+    UVec4Stream hitInfo;
+    FloatStream hitT;
+    TransformStream hitObjectToWorld;
+    UintStream hitBin;
+    UintStream shadeQueue; // Rays sorted by bin
+    // Shadow queue. Origin and distance, direction, unoccluded contribution
+    Vec4Stream shadowOrigin;
+    Vec4Stream shadowDirection;
+    Vec4Stream shadowContribution;
+    UintStream shadowPixel;
+};
+
+layout(scalar, push_constant) uniform WavefrontPushConstants
+{
+    RayPush rayPush;
+    Streams streams;
+    uint width;
+    uint height;
+    uint depth; // Of the rays in flight, from 1
+    uint phase;
+}
+push;
+
+uint current_queue()
+{
+    return push.depth & 1u;
+}
+
+// Bin of a hit: material class, then ray direction octant
+uint shade_bin(const uint materialClass, const vec3 direction)
+{
+    const uint octant = (direction.x < 0. ? 1u : 0u) | (direction.y < 0. ? 2u : 0u)
+            | (direction.z < 0. ? 4u : 0u);
+    return materialClass * DIRECTION_BINS + octant;
+}
+
+// Inverse of an affine transform
+mat4x3 affine_inverse(const mat4x3 m)
+{
+    const mat3 inv = inverse(mat3(m));
+    return mat4x3(inv[0], inv[1], inv[2], -(inv * m[3]));
+}
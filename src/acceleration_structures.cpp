@@ -1,16 +1,19 @@
 #include "acceleration_structures.hpp"
 #include "utils.hpp"
-#include <glm/gtc/type_ptr.hpp>
-#include <set>
+#include <algorithm>
+#include <print>
+#include <unordered_map>
 
 ASBuilder::ASBuilder(const vk::Device &device,
                      const VmaAllocator &allocator,
                      const uint32_t graphicsQueueFamilyIndex,
-                     const vk::PhysicalDeviceAccelerationStructurePropertiesKHR &asProperties)
+                     const vk::PhysicalDeviceAccelerationStructurePropertiesKHR &asProperties,
+                     UploadManager &uploader)
     : device{device}
     , allocator{allocator}
     , queueFamilyIndex{graphicsQueueFamilyIndex}
     , asProperties{asProperties}
+    , uploader{uploader}
 {
     init();
 }
@@ -20,174 +23,342 @@ void ASBuilder::destroy()
     device.freeCommandBuffers(asPool, asCmd);
     device.destroyFence(asFence);
     device.destroyCommandPool(asPool);
-    if (blasQueue.size() > 0) {
-        for (auto &b : blasQueue) {
-            device.destroyAccelerationStructureKHR(b.AS);
-            utils::destroy_buffer(allocator, b.buffer);
-        }
-    }
+    for (auto &b : blasQueue)
+        device.destroyAccelerationStructureKHR(b.AS);
+    // BLASes are suballocated from these
+    for (const auto &b : blasStorage)
+        utils::destroy_buffer(allocator, b);
 }
 
 AccelerationStructure ASBuilder::buildBLAS(const std::shared_ptr<MeshNode> &meshNode)
 {
+    return buildBLASes({meshNode})[0];
+}
+
+std::vector<AccelerationStructure> ASBuilder::buildBLASes(
+    const std::vector<std::shared_ptr<MeshNode>> &meshNodes)
+{
+    if (meshNodes.empty())
+        return {};
+
     VK_CHECK_RES(device.waitForFences(asFence, vk::True, FENCE_TIMEOUT));
-    device.resetFences(asFence);
 
-    // Geometry description (single triangle array)
-    // const uint32_t numIndices = meshNode->mesh->indexBuffer->allocationInfo.size / sizeof(uint32_t);
-    const uint32_t numVertices = meshNode->mesh->vertexBuffer->allocationInfo.size / sizeof(Vertex);
-
-    const size_t numSurfaces = meshNode->mesh->surfaces.size();
-    std::vector<vk::AccelerationStructureGeometryKHR> geometries(numSurfaces);
-    std::vector<vk::AccelerationStructureBuildRangeInfoKHR> buildRanges(numSurfaces);
-    std::vector<uint32_t> primitiveCounts(numSurfaces);
-    for (size_t i = 0; i < numSurfaces; i++) {
-        const Surface &s = meshNode->mesh->surfaces[i];
-
-        vk::AccelerationStructureGeometryTrianglesDataKHR triData{};
-        triData.setVertexFormat(vk::Format::eR32G32B32Sfloat);
-        triData.setVertexData(
-            vk::DeviceOrHostAddressConstKHR{meshNode->mesh->vertexBuffer->bufferAddress});
-        triData.setVertexStride(sizeof(Vertex));
-        triData.setMaxVertex(numVertices - 1);
-        triData.setIndexType(vk::IndexType::eUint32);
-        triData.setIndexData(
-            vk::DeviceOrHostAddressConstKHR{meshNode->mesh->indexBuffer->bufferAddress});
-
-        vk::AccelerationStructureGeometryKHR geom{};
-        geom.setGeometryType(vk::GeometryTypeKHR::eTriangles);
-        geom.setFlags(vk::GeometryFlagBitsKHR::eOpaque); // simplest
-        geom.setGeometry(triData);
-
-        // The entire array will be used to build the BLAS.
-        vk::AccelerationStructureBuildRangeInfoKHR offsets{};
-        offsets.setFirstVertex(0);
-        offsets.setPrimitiveCount(s.count / 3);
-        offsets.setPrimitiveOffset(s.startIndex * sizeof(uint32_t));
-        offsets.setTransformOffset(0);
-
-        geometries[i] = geom;
-        buildRanges[i] = offsets;
-        primitiveCounts[i] = s.count / 3;
+    // Per BLAS build description. The geometry vectors must outlive the recording
+    struct BlasBuild
+    {
+        std::vector<vk::AccelerationStructureGeometryKHR> geometries;
+        std::vector<vk::AccelerationStructureBuildRangeInfoKHR> buildRanges;
+        vk::AccelerationStructureBuildGeometryInfoKHR buildInfo;
+        vk::AccelerationStructureBuildSizesInfoKHR buildSizes;
+    };
+    std::vector<BlasBuild> builds(meshNodes.size());
+
+    // 1. Geometry and sizes of every BLAS up front
+    for (size_t b = 0; b < meshNodes.size(); b++) {
+        const std::shared_ptr<Mesh> &mesh = meshNodes[b]->mesh;
+        const uint32_t numVertices = mesh->vertexCount;
+        const size_t numSurfaces = mesh->surfaces.size();
+        const uint32_t indexSize = mesh->indexType == vk::IndexType::eUint16 ? sizeof(uint16_t)
+                                                                              : sizeof(uint32_t);
+
+        BlasBuild &build = builds[b];
+        build.geometries.resize(numSurfaces);
+        build.buildRanges.resize(numSurfaces);
+        std::vector<uint32_t> primitiveCounts(numSurfaces);
+        for (size_t i = 0; i < numSurfaces; i++) {
+            const Surface &s = mesh->surfaces[i];
+
+            vk::AccelerationStructureGeometryTrianglesDataKHR triData{};
+            triData.setVertexFormat(vk::Format::eR32G32B32Sfloat);
+            // The compact layout has a tightly packed position stream
+            if (mesh->compactVertices) {
+                triData.setVertexData(vk::DeviceOrHostAddressConstKHR{mesh->positions.address});
+                triData.setVertexStride(sizeof(glm::vec3));
+            } else {
+                triData.setVertexData(vk::DeviceOrHostAddressConstKHR{mesh->vertices.address});
+                triData.setVertexStride(sizeof(Vertex));
+            }
+            triData.setMaxVertex(numVertices - 1);
+            triData.setIndexType(mesh->indexType);
+            triData.setIndexData(vk::DeviceOrHostAddressConstKHR{mesh->indices.address});
+
+            vk::AccelerationStructureGeometryKHR geom{};
+            geom.setGeometryType(vk::GeometryTypeKHR::eTriangles);
+            geom.setFlags(vk::GeometryFlagBitsKHR::eOpaque); // simplest
+            geom.setGeometry(triData);
+
+            // The entire array will be used to build the BLAS.
+            vk::AccelerationStructureBuildRangeInfoKHR offsets{};
+            offsets.setFirstVertex(0);
+            offsets.setPrimitiveCount(s.count / 3);
+            offsets.setPrimitiveOffset(s.startIndex * indexSize);
+            offsets.setTransformOffset(0);
+
+            build.geometries[i] = geom;
+            build.buildRanges[i] = offsets;
+            primitiveCounts[i] = s.count / 3;
+        }
+
+        build.buildInfo.setMode(vk::BuildAccelerationStructureModeKHR::eBuild);
+        build.buildInfo.setType(vk::AccelerationStructureTypeKHR::eBottomLevel);
+        build.buildInfo.setFlags(vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace);
+        if (compaction)
+            build.buildInfo.setFlags(build.buildInfo.flags
+                                     | vk::BuildAccelerationStructureFlagBitsKHR::eAllowCompaction);
+        build.buildInfo.setGeometries(build.geometries);
+        build.buildSizes = device.getAccelerationStructureBuildSizesKHR(
+            vk::AccelerationStructureBuildTypeKHR::eDevice, build.buildInfo, primitiveCounts);
     }
 
-    // Info necessary to get the vk::AccelerationStructureBuildSizesInfoKHR struct
-    vk::AccelerationStructureBuildGeometryInfoKHR buildInfo{};
-    buildInfo.setMode(vk::BuildAccelerationStructureModeKHR::eBuild);
-    buildInfo.setType(vk::AccelerationStructureTypeKHR::eBottomLevel);
-    buildInfo.setFlags(vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace);
-    buildInfo.setGeometries(geometries);
+    // 2. Suballocate the results from a few large storage blocks
+    std::vector<vk::DeviceSize> blasSizes(builds.size());
+    for (size_t b = 0; b < builds.size(); b++)
+        blasSizes[b] = builds[b].buildSizes.accelerationStructureSize;
+    const size_t firstBlas = blasQueue.size();
+    const size_t firstBlock = blasStorage.size();
+    std::vector<AccelerationStructure> blases = createBLASStorage(blasSizes);
+    for (size_t b = 0; b < builds.size(); b++)
+        builds[b].buildInfo.setDstAccelerationStructure(blases[b].AS);
+
+    // 3. Group the builds so that their scratch fits in the arena. A BLAS larger than the budget
+    // gets a group of its own and sizes the arena
+    const auto align = [](const vk::DeviceSize x, const vk::DeviceSize a) {
+        return (x + a - 1) & ~(a - 1);
+    };
+    const vk::DeviceSize scratchAlignment = asProperties.minAccelerationStructureScratchOffsetAlignment;
+    std::vector<size_t> groupStarts{0};
+    std::vector<vk::DeviceSize> scratchOffsets(builds.size());
+    vk::DeviceSize groupScratch = 0, arenaSize = 0;
+    for (size_t b = 0; b < builds.size(); b++) {
+        const vk::DeviceSize size = align(builds[b].buildSizes.buildScratchSize, scratchAlignment);
+        if (groupScratch > 0 && groupScratch + size > BLAS_SCRATCH_BUDGET) {
+            groupStarts.push_back(b);
+            groupScratch = 0;
+        }
+        scratchOffsets[b] = groupScratch;
+        groupScratch += size;
+        arenaSize = std::max(arenaSize, groupScratch);
+    }
+    groupStarts.push_back(builds.size());
+
+    Buffer scratchBuffer = utils::create_buffer(device,
+                                                allocator,
+                                                arenaSize,
+                                                vk::BufferUsageFlagBits::eStorageBuffer
+                                                    | vk::BufferUsageFlagBits::eShaderDeviceAddress,
+                                                VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE,
+                                                0,
+                                                scratchAlignment);
+
+    std::vector<vk::AccelerationStructureBuildGeometryInfoKHR> buildInfos(builds.size());
+    std::vector<const vk::AccelerationStructureBuildRangeInfoKHR *> buildRanges(builds.size());
+    for (size_t b = 0; b < builds.size(); b++) {
+        builds[b].buildInfo.setScratchData(
+            vk::DeviceOrHostAddressKHR{scratchBuffer.bufferAddress + scratchOffsets[b]});
+        buildInfos[b] = builds[b].buildInfo;
+        buildRanges[b] = builds[b].buildRanges.data();
+    }
 
-    vk::AccelerationStructureBuildSizesInfoKHR buildSizes
-        = device.getAccelerationStructureBuildSizesKHR(vk::AccelerationStructureBuildTypeKHR::eDevice,
-                                                       buildInfo,
-                                                       primitiveCounts);
+    std::vector<vk::AccelerationStructureKHR> handles(blases.size());
+    for (size_t b = 0; b < blases.size(); b++)
+        handles[b] = blases[b].AS;
+    vk::QueryPool compactedSizes;
+    if (compaction) {
+        vk::QueryPoolCreateInfo queryPoolInfo{};
+        queryPoolInfo.setQueryType(vk::QueryType::eAccelerationStructureCompactedSizeKHR);
+        queryPoolInfo.setQueryCount(static_cast<uint32_t>(handles.size()));
+        compactedSizes = device.createQueryPool(queryPoolInfo);
+    }
 
-    // Allocate scratch buffer
-    Buffer scratchBuffer
-        = utils::create_buffer(device,
-                               allocator,
-                               buildSizes.buildScratchSize,
-                               vk::BufferUsageFlagBits::eStorageBuffer
-                                   | vk::BufferUsageFlagBits::eShaderDeviceAddress,
-                               VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE,
-                               0,
-                               asProperties.minAccelerationStructureScratchOffsetAlignment);
+    // 4. One build call per group, all in a single submission
+    utils::cmd_submit(device, queue, asFence, asCmd, [&](const vk::CommandBuffer &cmd) {
+        // The scratch arena is reused by the next group and the BLASes are read by the TLAS build
+        vk::MemoryBarrier2 barrier{};
+        barrier.setSrcAccessMask(vk::AccessFlagBits2::eAccelerationStructureWriteKHR);
+        barrier.setDstAccessMask(vk::AccessFlagBits2::eAccelerationStructureReadKHR
+                                 | vk::AccessFlagBits2::eAccelerationStructureWriteKHR);
+        barrier.setSrcStageMask(vk::PipelineStageFlagBits2::eAccelerationStructureBuildKHR);
+        barrier.setDstStageMask(vk::PipelineStageFlagBits2::eAccelerationStructureBuildKHR);
+        vk::DependencyInfo barrierInfo{};
+        barrierInfo.setMemoryBarriers(barrier);
 
-    AccelerationStructure blas;
-    blas.buffer = utils::create_buffer(device,
-                                       allocator,
-                                       buildSizes.accelerationStructureSize,
-                                       vk::BufferUsageFlagBits::eAccelerationStructureStorageKHR
-                                           | vk::BufferUsageFlagBits::eShaderDeviceAddress,
-                                       VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE,
-                                       0,
-                                       asProperties.minAccelerationStructureScratchOffsetAlignment);
-
-    // Actual allocation of buffer and acceleration structure.
-    vk::AccelerationStructureCreateInfoKHR blasCreate{};
-    blasCreate.setSize(buildSizes.accelerationStructureSize);
-    blasCreate.setOffset(0);
-    blasCreate.setType(vk::AccelerationStructureTypeKHR::eBottomLevel);
-    // blasCreate.setCreateFlags();
-    blasCreate.setBuffer(blas.buffer.buffer);
-    // blasCreate.setDeviceAddress(); // BLAS address is not the same as blas-buffer address!
-
-    blas.AS = device.createAccelerationStructureKHR(blasCreate);
-
-    vk::AccelerationStructureDeviceAddressInfoKHR blasAddressInfo{};
-    blasAddressInfo.setAccelerationStructure(blas.AS);
-    blas.addr = device.getAccelerationStructureAddressKHR(blasAddressInfo);
+        for (size_t g = 0; g + 1 < groupStarts.size(); g++) {
+            const size_t first = groupStarts[g];
+            const uint32_t count = static_cast<uint32_t>(groupStarts[g + 1] - first);
+            cmd.buildAccelerationStructuresKHR(
+                vk::ArrayProxy<const vk::AccelerationStructureBuildGeometryInfoKHR>(count,
+                                                                                    &buildInfos[first]),
+                vk::ArrayProxy<const vk::AccelerationStructureBuildRangeInfoKHR *const>(
+                    count, &buildRanges[first]));
+            cmd.pipelineBarrier2(barrierInfo);
+        }
+
+        if (compaction) {
+            cmd.resetQueryPool(compactedSizes, 0, static_cast<uint32_t>(handles.size()));
+            cmd.writeAccelerationStructuresPropertiesKHR(
+                handles, vk::QueryType::eAccelerationStructureCompactedSizeKHR, compactedSizes, 0);
+        }
+    });
+
+    // Scratch arena can be destroyed after queue finishes
+    utils::destroy_buffer(allocator, scratchBuffer);
+
+    if (compaction) {
+        blases = compactBLASes(blases, compactedSizes, firstBlas, firstBlock);
+        device.destroyQueryPool(compactedSizes);
+    }
+
+    return blases;
+}
+
+std::vector<AccelerationStructure> ASBuilder::createBLASStorage(
+    const std::vector<vk::DeviceSize> &sizes)
+{
+    // AS offsets within their buffer must be 256 aligned
+    std::vector<vk::DeviceSize> storageOffsets(sizes.size());
+    std::vector<size_t> storageBlocks(sizes.size());
+    std::vector<vk::DeviceSize> blockSizes{0};
+    for (size_t b = 0; b < sizes.size(); b++) {
+        vk::DeviceSize offset = (blockSizes.back() + 255) & ~vk::DeviceSize{255};
+        if (offset > 0 && offset + sizes[b] > BLAS_STORAGE_BLOCK_SIZE) {
+            blockSizes.push_back(0);
+            offset = 0;
+        }
+        storageBlocks[b] = blockSizes.size() - 1;
+        storageOffsets[b] = offset;
+        blockSizes.back() = offset + sizes[b];
+    }
+    std::vector<Buffer> blocks;
+    blocks.reserve(blockSizes.size());
+    for (const vk::DeviceSize size : blockSizes) {
+        blocks.emplace_back(utils::create_buffer(device,
+                                                 allocator,
+                                                 size,
+                                                 vk::BufferUsageFlagBits::eAccelerationStructureStorageKHR
+                                                     | vk::BufferUsageFlagBits::eShaderDeviceAddress,
+                                                 VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE));
+        blasStorage.push_back(blocks.back());
+    }
+
+    std::vector<AccelerationStructure> blases(sizes.size());
+    for (size_t b = 0; b < sizes.size(); b++) {
+        AccelerationStructure &blas = blases[b];
+        blas.buffer = blocks[storageBlocks[b]];
+        blas.offset = storageOffsets[b];
+
+        vk::AccelerationStructureCreateInfoKHR blasCreate{};
+        blasCreate.setSize(sizes[b]);
+        blasCreate.setOffset(blas.offset);
+        blasCreate.setType(vk::AccelerationStructureTypeKHR::eBottomLevel);
+        blasCreate.setBuffer(blas.buffer.buffer);
+        blas.AS = device.createAccelerationStructureKHR(blasCreate);
+
+        // BLAS address is not the same as blas-buffer address!
+        vk::AccelerationStructureDeviceAddressInfoKHR blasAddressInfo{};
+        blasAddressInfo.setAccelerationStructure(blas.AS);
+        blas.addr = device.getAccelerationStructureAddressKHR(blasAddressInfo);
+
+        blasQueue.push_back(blas);
+    }
+    return blases;
+}
+
+std::vector<AccelerationStructure> ASBuilder::compactBLASes(
+    const std::vector<AccelerationStructure> &blases,
+    const vk::QueryPool &compactedSizes,
+    const size_t firstBlas,
+    const size_t firstBlock)
+{
+    std::vector<vk::DeviceSize> sizes(blases.size());
+    VK_CHECK_RES(device.getQueryPoolResults(compactedSizes,
+                                            0,
+                                            static_cast<uint32_t>(sizes.size()),
+                                            sizes.size() * sizeof(vk::DeviceSize),
+                                            sizes.data(),
+                                            sizeof(vk::DeviceSize),
+                                            vk::QueryResultFlagBits::e64
+                                                | vk::QueryResultFlagBits::eWait));
+
+    vk::DeviceSize sizeBefore = 0, sizeAfter = 0;
+    for (size_t b = firstBlock; b < blasStorage.size(); b++)
+        sizeBefore += blasStorage[b].allocationInfo.size;
+
+    const size_t compactedBlock = blasStorage.size();
+    std::vector<AccelerationStructure> compacted = createBLASStorage(sizes);
+    for (size_t b = compactedBlock; b < blasStorage.size(); b++)
+        sizeAfter += blasStorage[b].allocationInfo.size;
 
-    buildInfo.setSrcAccelerationStructure(nullptr);
-    buildInfo.setDstAccelerationStructure(blas.AS);
-    buildInfo.setScratchData(vk::DeviceOrHostAddressKHR{scratchBuffer.bufferAddress});
-    // vk::AccelerationStructureBuildRangeInfoKHR buildRange{};
-    // buildRange.setFirstVertex(0);
-    // buildRange.setPrimitiveCount(numIndices / 3);
-    // buildRange.setPrimitiveOffset(0);
-    // buildRange.setFirstVertex(0);
-
-    // Record and submit the command buffer
     utils::cmd_submit(device, queue, asFence, asCmd, [&](const vk::CommandBuffer &cmd) {
-        cmd.buildAccelerationStructuresKHR(buildInfo, buildRanges.data());
-        // Barrier: BLAS build writes → TLAS read later
+        for (size_t b = 0; b < blases.size(); b++) {
+            vk::CopyAccelerationStructureInfoKHR copyInfo{};
+            copyInfo.setSrc(blases[b].AS);
+            copyInfo.setDst(compacted[b].AS);
+            copyInfo.setMode(vk::CopyAccelerationStructureModeKHR::eCompact);
+            cmd.copyAccelerationStructureKHR(copyInfo);
+        }
+        // The TLAS build reads the compacted BLASes
         vk::MemoryBarrier2 barrier{};
         barrier.setSrcAccessMask(vk::AccessFlagBits2::eAccelerationStructureWriteKHR);
         barrier.setDstAccessMask(vk::AccessFlagBits2::eAccelerationStructureReadKHR);
-        barrier.setSrcStageMask(vk::PipelineStageFlagBits2::eAccelerationStructureBuildKHR);
+        barrier.setSrcStageMask(vk::PipelineStageFlagBits2::eAccelerationStructureCopyKHR);
         barrier.setDstStageMask(vk::PipelineStageFlagBits2::eAccelerationStructureBuildKHR);
         vk::DependencyInfo barrierInfo{};
         barrierInfo.setMemoryBarriers(barrier);
         cmd.pipelineBarrier2(barrierInfo);
     });
 
-    // Scratch buffer can be destroyed after queue finishes
-    utils::destroy_buffer(allocator, scratchBuffer);
-
-    blasQueue.push_back(blas);
-    return blas;
+    // Free the originals and their storage blocks
+    for (const auto &b : blases)
+        device.destroyAccelerationStructureKHR(b.AS);
+    blasQueue.erase(blasQueue.begin() + firstBlas, blasQueue.begin() + firstBlas + blases.size());
+    for (size_t b = firstBlock; b < compactedBlock; b++)
+        utils::destroy_buffer(allocator, blasStorage[b]);
+    blasStorage.erase(blasStorage.begin() + firstBlock, blasStorage.begin() + compactedBlock);
+
+    std::println("BLAS compaction: {} -> {} bytes, {:.2f} MiB saved",
+                 sizeBefore,
+                 sizeAfter,
+                 (static_cast<double>(sizeBefore) - static_cast<double>(sizeAfter))
+                     / (1024.0 * 1024.0));
+    return compacted;
 }
 
-TopLevelAS ASBuilder::buildTLAS(const std::shared_ptr<GLTFObj> &scene)
+TopLevelAS ASBuilder::buildTLAS(const std::shared_ptr<GLTFObj> &scene, const uint32_t frameOverlap)
 {
-    std::set<vk::DeviceAddress> indexBufferAddresses;
-    std::unordered_map<vk::DeviceAddress, AccelerationStructure> uniqueBlases;
-    std::vector<std::pair<AccelerationStructure, glm::mat4>> blases;
-    blases.reserve(scene->surfaceCount);
+    // One BLAS for every unique mesh slice, all built together
+    std::unordered_map<vk::DeviceAddress, size_t> blasIndices;
+    std::vector<std::shared_ptr<MeshNode>> uniqueMeshNodes;
     for (const auto &mn : scene->meshNodes) {
-        const vk::DeviceAddress indexBufferAddress = mn->mesh->indexBuffer->bufferAddress;
-        // Build BLAS for every unique mesh buffer
-        if (indexBufferAddresses.count(indexBufferAddress) == 0)
-            uniqueBlases[indexBufferAddress] = buildBLAS(mn);
-        indexBufferAddresses.insert(indexBufferAddress);
-        // Repeat blases each with its own transform matrix
-        blases.emplace_back(std::make_pair(uniqueBlases[indexBufferAddress], mn->worldTransform));
+        const vk::DeviceAddress indexBufferAddress = mn->mesh->indices.address;
+        if (blasIndices.try_emplace(indexBufferAddress, uniqueMeshNodes.size()).second)
+            uniqueMeshNodes.push_back(mn);
     }
+    const std::vector<AccelerationStructure> uniqueBlases = buildBLASes(uniqueMeshNodes);
 
     // Here starts the vulkan stuff for building the tlas
     VK_CHECK_RES(device.waitForFences(asFence, vk::True, FENCE_TIMEOUT));
     device.resetFences(asFence);
 
+    // One record per mesh node, or per copy of the EXT_mesh_gpu_instancing nodes. Those come
+    // ready from the loader but for the BLAS reference
     std::vector<vk::AccelerationStructureInstanceKHR> instances;
-    instances.reserve(blases.size());
-    uint32_t instanceIndex = 0;
-    for (const auto &b : blases) {
-        const glm::mat3x4 transformGlm = glm::mat3x4(glm::transpose(b.second));
-        const AccelerationStructure blas = b.first;
-        vk::AccelerationStructureInstanceKHR instance{};
-        vk::TransformMatrixKHR transformVk;
-        memcpy(&transformVk.matrix, glm::value_ptr(transformGlm), sizeof(transformVk.matrix));
-        instance.setTransform(transformVk);
-        instance.setInstanceCustomIndex(instanceIndex); // gl_InstanceCustomIndexEXT
-        instanceIndex++;
+    instances.reserve(scene->meshNodes.size() + scene->gpuInstances.size());
+    for (const auto &mn : scene->meshNodes) {
+        const AccelerationStructure &blas = uniqueBlases[blasIndices.at(mn->mesh->indices.address)];
+        if (mn->instanceCount > 0) {
+            const auto first = scene->gpuInstances.begin() + mn->firstInstance;
+            for (auto it = first; it != first + mn->instanceCount; it++)
+                instances.emplace_back(*it).setAccelerationStructureReference(blas.addr);
+            continue;
+        }
+        vk::AccelerationStructureInstanceKHR instance
+            = tlas_instance(mn->worldTransform * mn->mesh->geometryTransform,
+                            mn->mesh->surfaces.front().bufferIndex);
         instance.setAccelerationStructureReference(blas.addr);
-        // instance.setFlags(vk::GeometryInstanceFlagBitsKHR::eForceOpaque);
-        instance.setMask(0xFF); //  Only be hit if rayMask & instance.mask != 0
-        instance.setInstanceShaderBindingTableRecordOffset(
-            0); // We will use the same hit group for all objects
         instances.emplace_back(instance);
     }
+    // The TLAS owns the records from here, the loader and the cache writer are done with them
+    scene->gpuInstances = {};
 
     // Create a buffer holding the actual instance data (matrices++) for use by the AS builder
     vk::DeviceSize instancesSize = static_cast<vk::DeviceSize>(
@@ -202,15 +373,9 @@ TopLevelAS ASBuilder::buildTLAS(const std::shared_ptr<GLTFObj> &scene)
                                    | vk::BufferUsageFlagBits::eTransferDst,
                                VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE);
 
-    // Fill the buffer
-    utils::copy_to_device_buffer(instancesBuffer,
-                                 device,
-                                 allocator,
-                                 asCmd,
-                                 queue,
-                                 asFence,
-                                 instances.data(),
-                                 instancesSize);
+    // Fill the buffer. The build waits for the copy on the GPU
+    uploader.upload_buffer(instancesBuffer, instances.data(), instancesSize);
+    const uint64_t instancesUploaded = uploader.flush();
 
     // Wraps a device pointer to the above uploaded instances.
     vk::AccelerationStructureGeometryInstancesDataKHR instancesData{};
@@ -280,23 +445,55 @@ TopLevelAS ASBuilder::buildTLAS(const std::shared_ptr<GLTFObj> &scene)
     // Build the TLAS
     // Record the next set of commands
     // asCmd.reset();
-    utils::cmd_submit(device, queue, asFence, asCmd, [&](const vk::CommandBuffer &cmd) {
-        cmd.buildAccelerationStructuresKHR(buildInfo, &buildRangeInfo);
-    });
+    utils::cmd_submit(
+        device,
+        queue,
+        asFence,
+        asCmd,
+        [&](const vk::CommandBuffer &cmd) {
+            cmd.buildAccelerationStructuresKHR(buildInfo, &buildRangeInfo);
+        },
+        {uploader.wait_info(instancesUploaded,
+                            vk::PipelineStageFlagBits2::eAccelerationStructureBuildKHR)});
 
     // Scratch buffer can be destroyed after queue finishes
     utils::destroy_buffer(allocator, scratchBuffer);
     // utils::destroy_buffer(allocator, instancesBuffer);
 
-    return TopLevelAS{.as = tlas, .instances = instances, .instancesBuffer = instancesBuffer};
+    TopLevelAS topLevelAS{.as = tlas,
+                          .instances = std::move(instances),
+                          .instancesBuffer = instancesBuffer};
+
+    // Resources of the per-frame updates: persistently mapped instances, one buffer per frame in
+    // flight so that the host never writes one that a build may still be reading, and a scratch
+    // buffer that the serialized updates reuse
+    topLevelAS.frameInstanceBuffers.reserve(frameOverlap);
+    for (uint32_t f = 0; f < frameOverlap; f++)
+        topLevelAS.frameInstanceBuffers.emplace_back(utils::create_buffer(
+            device,
+            allocator,
+            instancesSize,
+            vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR
+                | vk::BufferUsageFlagBits::eShaderDeviceAddress,
+            VMA_MEMORY_USAGE_AUTO,
+            VMA_ALLOCATION_CREATE_MAPPED_BIT
+                | VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT));
+    topLevelAS.updateScratch
+        = utils::create_buffer(device,
+                               allocator,
+                               sizeInfo.updateScratchSize,
+                               vk::BufferUsageFlagBits::eStorageBuffer
+                                   | vk::BufferUsageFlagBits::eShaderDeviceAddress,
+                               VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE,
+                               0,
+                               asProperties.minAccelerationStructureScratchOffsetAlignment);
+
+    return topLevelAS;
 }
 
 void ASBuilder::updateTLAS(TopLevelAS &tlas, const glm::mat4 &transform)
 {
-    // Here starts the vulkan stuff for building the tlas
-    VK_CHECK_RES(device.waitForFences(asFence, vk::True, FENCE_TIMEOUT));
-    device.resetFences(asFence);
-
+    // Host side only. The refit is recorded in the next frame by recordTLASUpdate()
     for (auto &i : tlas.instances) {
         glm::mat4 currentTransform{1.f};
         // VkTransformMatrixKHR is row-major 3x4, so we need to reconstruct it properly
@@ -307,11 +504,6 @@ void ASBuilder::updateTLAS(TopLevelAS &tlas, const glm::mat4 &transform)
         }
         // Apply the new transform
         glm::mat4 newTransform = transform * currentTransform;
-        // const glm::mat4x3 origTransform = glm::make_mat4x3((float *) i.transform.matrix.data());
-        // const glm::mat3x4 transform0 = glm::transpose(glm::make_mat4x3(&i.transform.matrix[0][0]));
-        // const glm::mat4 transform4x4 = transform * glm::mat4(origTransform);
-        // const glm::mat3x4 transform3x4 = glm::mat3x4(glm::transpose(transform4x4));
-        // const glm::mat3x4 transform3x4 = glm::mat3x4(glm::transpose(transform4x4));
         // Convert back to VkTransformMatrixKHR format (row-major 3x4)
         vk::TransformMatrixKHR transformVk;
         for (size_t row = 0; row < 3; ++row) {
@@ -319,32 +511,35 @@ void ASBuilder::updateTLAS(TopLevelAS &tlas, const glm::mat4 &transform)
                 transformVk.matrix[row][col] = newTransform[col][row];
             }
         }
-        // memcpy(&transformVk.matrix, glm::value_ptr(transform3x4), sizeof(transformVk.matrix));
         i.setTransform(transformVk);
     }
+    tlas.updatePending = true;
+}
+
+void ASBuilder::recordTLASUpdate(const vk::CommandBuffer &cmd,
+                                 TopLevelAS &tlas,
+                                 const uint32_t frameIndex,
+                                 const vk::PipelineStageFlags2 &traceStages)
+{
+    if (!tlas.updatePending)
+        return;
+    tlas.updatePending = false;
 
-    // Fill the buffer
-    const vk::DeviceSize instancesSize = static_cast<vk::DeviceSize>(
-        sizeof(vk::AccelerationStructureInstanceKHR) * tlas.instances.size());
-    utils::copy_to_device_buffer(tlas.instancesBuffer,
-                                 device,
-                                 allocator,
-                                 asCmd,
-                                 queue,
-                                 asFence,
-                                 tlas.instances.data(),
-                                 instancesSize);
+    // The frame fence has been waited, so no build is reading this frame's instances
+    const Buffer &instancesBuffer = tlas.frameInstanceBuffers[frameIndex];
+    utils::copy_to_buffer(instancesBuffer,
+                          allocator,
+                          tlas.instances.data(),
+                          sizeof(vk::AccelerationStructureInstanceKHR) * tlas.instances.size());
 
     // Wraps a device pointer to the above uploaded instances.
     vk::AccelerationStructureGeometryInstancesDataKHR instancesData{};
-    instancesData.setData(vk::DeviceOrHostAddressConstKHR{tlas.instancesBuffer.bufferAddress});
+    instancesData.setData(vk::DeviceOrHostAddressConstKHR{instancesBuffer.bufferAddress});
 
-    // Put the above into a VkAccelerationStructureGeometryKHR. We need to put the instances struct in a union and label it as instance data.
     vk::AccelerationStructureGeometryKHR topASGeometry{};
     topASGeometry.setGeometryType(vk::GeometryTypeKHR::eInstances);
     topASGeometry.setGeometry(instancesData);
 
-    // Find sizes
     vk::AccelerationStructureBuildGeometryInfoKHR buildInfo{};
     buildInfo.setFlags(vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace
                        | vk::BuildAccelerationStructureFlagBitsKHR::eAllowUpdate);
@@ -353,39 +548,41 @@ void ASBuilder::updateTLAS(TopLevelAS &tlas, const glm::mat4 &transform)
     buildInfo.setType(vk::AccelerationStructureTypeKHR::eTopLevel);
     buildInfo.setSrcAccelerationStructure(tlas.as.AS);
     buildInfo.setDstAccelerationStructure(tlas.as.AS);
+    buildInfo.setScratchData(tlas.updateScratch.bufferAddress);
 
-    vk::AccelerationStructureBuildSizesInfoKHR sizeInfo
-        = device.getAccelerationStructureBuildSizesKHR(vk::AccelerationStructureBuildTypeKHR::eDevice,
-                                                       buildInfo,
-                                                       tlas.instances.size());
-
-    // Allocate scratch buffer
-    Buffer scratchBuffer
-        = utils::create_buffer(device,
-                               allocator,
-                               sizeInfo.buildScratchSize,
-                               vk::BufferUsageFlagBits::eStorageBuffer
-                                   | vk::BufferUsageFlagBits::eShaderDeviceAddress,
-                               VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE,
-                               0,
-                               asProperties.minAccelerationStructureScratchOffsetAlignment);
-
-    // Update build information
-    buildInfo.setScratchData(scratchBuffer.bufferAddress);
-
-    // Build Offsets info: n instances
     vk::AccelerationStructureBuildRangeInfoKHR buildRangeInfo{};
     buildRangeInfo.setPrimitiveCount(tlas.instances.size());
 
-    // Build the TLAS
-    // Record the next set of commands
-    // asCmd.reset();
-    utils::cmd_submit(device, queue, asFence, asCmd, [&](const vk::CommandBuffer &cmd) {
-        cmd.buildAccelerationStructuresKHR(buildInfo, &buildRangeInfo);
-    });
+    // Previous frames may still be tracing against the TLAS or updating it with the same scratch
+    vk::MemoryBarrier2 barrier{};
+    barrier.setSrcStageMask(traceStages | vk::PipelineStageFlagBits2::eAccelerationStructureBuildKHR);
+    barrier.setSrcAccessMask(vk::AccessFlagBits2::eAccelerationStructureReadKHR
+                             | vk::AccessFlagBits2::eAccelerationStructureWriteKHR);
+    barrier.setDstStageMask(vk::PipelineStageFlagBits2::eAccelerationStructureBuildKHR);
+    barrier.setDstAccessMask(vk::AccessFlagBits2::eAccelerationStructureReadKHR
+                             | vk::AccessFlagBits2::eAccelerationStructureWriteKHR);
+    vk::DependencyInfo depInfo{};
+    depInfo.setMemoryBarriers(barrier);
+    cmd.pipelineBarrier2(depInfo);
+
+    cmd.buildAccelerationStructuresKHR(buildInfo, &buildRangeInfo);
+
+    // Update -> traceRays or the ray queries of the compute backends
+    barrier.setSrcStageMask(vk::PipelineStageFlagBits2::eAccelerationStructureBuildKHR);
+    barrier.setSrcAccessMask(vk::AccessFlagBits2::eAccelerationStructureWriteKHR);
+    barrier.setDstStageMask(traceStages);
+    barrier.setDstAccessMask(vk::AccessFlagBits2::eAccelerationStructureReadKHR);
+    cmd.pipelineBarrier2(depInfo);
+}
 
-    // Scratch buffer can be destroyed after queue finishes
-    utils::destroy_buffer(allocator, scratchBuffer);
+void ASBuilder::destroyTLAS(const TopLevelAS &tlas)
+{
+    utils::destroy_buffer(allocator, tlas.as.buffer);
+    device.destroyAccelerationStructureKHR(tlas.as.AS);
+    utils::destroy_buffer(allocator, tlas.instancesBuffer);
+    for (const auto &b : tlas.frameInstanceBuffers)
+        utils::destroy_buffer(allocator, b);
+    utils::destroy_buffer(allocator, tlas.updateScratch);
 }
 
 void ASBuilder::init()
@@ -6,11 +6,13 @@ import vulkan;
 #endif
 
 #include "loader.hpp"
+#include "upload_manager.hpp"
 
 struct AccelerationStructure
 {
     vk::AccelerationStructureKHR AS;
-    Buffer buffer;
+    Buffer buffer; // BLASes share their storage buffer, at offset
+    vk::DeviceSize offset{0};
     VkDeviceAddress addr;
 };
 
@@ -19,6 +21,11 @@ struct TopLevelAS
     AccelerationStructure as;
     std::vector<vk::AccelerationStructureInstanceKHR> instances;
     Buffer instancesBuffer;
+
+    // Per-frame updates
+    std::vector<Buffer> frameInstanceBuffers; // Host visible, one per frame in flight
+    Buffer updateScratch;
+    bool updatePending{false};
 };
 
 class ASBuilder
@@ -28,20 +35,38 @@ public:
     ASBuilder(const vk::Device &device,
               const VmaAllocator &allocator,
               const uint32_t graphicsQueueFamilyIndex,
-              const vk::PhysicalDeviceAccelerationStructurePropertiesKHR &asProperties);
+              const vk::PhysicalDeviceAccelerationStructurePropertiesKHR &asProperties,
+              UploadManager &uploader);
     ~ASBuilder() = default;
     void destroy();
     AccelerationStructure buildBLAS(const std::shared_ptr<MeshNode> &meshNode);
+    // Sizes all the BLASes first, suballocates them and builds them in a single submission
+    std::vector<AccelerationStructure> buildBLASes(
+        const std::vector<std::shared_ptr<MeshNode>> &meshNodes);
 
-    TopLevelAS buildTLAS(const std::shared_ptr<GLTFObj> &scene);
+    TopLevelAS buildTLAS(const std::shared_ptr<GLTFObj> &scene, const uint32_t frameOverlap);
 
+    // Applies the transform to the host instances. Does not touch the GPU
     void updateTLAS(TopLevelAS &tlas, const glm::mat4 &transform);
 
+    // Records the pending update, if any, into the frame command buffer before traceRays.
+    // traceStages are the shader stages that read the TLAS
+    void recordTLASUpdate(const vk::CommandBuffer &cmd,
+                          TopLevelAS &tlas,
+                          const uint32_t frameIndex,
+                          const vk::PipelineStageFlags2 &traceStages);
+
+    void destroyTLAS(const TopLevelAS &tlas);
+
+    // Opt-in (--compact-blas): build with eAllowCompaction and copy the BLASes into right-sized storage
+    bool compaction{BLAS_COMPACTION};
+
 private:
     const vk::Device &device;
     const VmaAllocator &allocator;
     const uint32_t queueFamilyIndex;
     const vk::PhysicalDeviceAccelerationStructurePropertiesKHR &asProperties;
+    UploadManager &uploader;
 
     vk::CommandPool asPool;
     vk::Queue queue;
@@ -50,5 +75,15 @@ private:
 
     void init();
 
+    // Creates the BLAS handles, suballocated from new storage blocks
+    std::vector<AccelerationStructure> createBLASStorage(const std::vector<vk::DeviceSize> &sizes);
+
+    // Replaces the BLASes (and the blocks created for them) with compacted copies
+    std::vector<AccelerationStructure> compactBLASes(const std::vector<AccelerationStructure> &blases,
+                                                     const vk::QueryPool &compactedSizes,
+                                                     const size_t firstBlas,
+                                                     const size_t firstBlock);
+
     std::vector<AccelerationStructure> blasQueue;
+    std::vector<Buffer> blasStorage;
 };
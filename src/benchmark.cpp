@@ -0,0 +1,201 @@
+#include "benchmark.hpp"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <format>
+#include <fstream>
+#include <numeric>
+#include <sstream>
+
+static glm::vec3 parse_vec3(const std::string &s, const std::string &line)
+{
+    glm::vec3 v;
+    if (std::sscanf(s.c_str(), "%f,%f,%f", &v.x, &v.y, &v.z) != 3)
+        throw std::runtime_error("Benchmark: expected x,y,z in line \"" + line + "\"");
+    return v;
+}
+
+uint32_t parse_integrator(const std::string &name)
+{
+    if (name == "iterative")
+        return eIterative;
+    if (name == "recursive")
+        return eRecursive;
+    throw std::runtime_error("Unknown integrator \"" + name + "\", expected iterative|recursive");
+}
+
+uint32_t parse_backend(const std::string &name)
+{
+    if (name == "rt")
+        return eRtPipeline;
+    if (name == "wavefront")
+        return eWavefront;
+    if (name == "rayquery")
+        return eRayQuery;
+    throw std::runtime_error("Unknown backend \"" + name + "\", expected rt|wavefront|rayquery");
+}
+
+BenchmarkScript::BenchmarkScript(const std::filesystem::path &path)
+    : path{path}
+{
+    std::ifstream file(path);
+    if (!file.is_open())
+        throw std::runtime_error("Benchmark script " + path.string() + " could not be opened");
+
+    std::string line;
+    while (std::getline(file, line)) {
+        line = line.substr(0, line.find('#'));
+        std::istringstream ss(line);
+        std::string command;
+        if (!(ss >> command))
+            continue;
+
+        if (command == "size") {
+            std::string size;
+            ss >> size;
+            if (std::sscanf(size.c_str(), "%ux%u", &extent.width, &extent.height) != 2)
+                throw std::runtime_error("Benchmark: expected <width>x<height> in line \"" + line
+                                         + "\"");
+        } else if (command == "seed") {
+            ss >> seed;
+        } else if (command == "warmup") {
+            ss >> warmupFrames;
+        } else if (command == "frames") {
+            ss >> frames;
+        } else if (command == "backend") {
+            std::string name;
+            ss >> name;
+            backend = parse_backend(name);
+        } else if (command == "integrator") {
+            std::string name;
+            ss >> name;
+            integrator = parse_integrator(name);
+        } else if (command == "depth") {
+            ss >> pathDepth;
+        } else if (command == "recursion") {
+            ss >> constantsCH.recursionDepth;
+        } else if (command == "bounces") {
+            ss >> constantsCH.numBounces;
+        } else if (command == "random") {
+            ss >> constantsCH.random;
+        } else if (command == "presampled") {
+            ss >> constantsCH.presampled;
+        } else if (command == "envmap") {
+            ss >> constantsMiss.envMap;
+        } else if (command == "camera") {
+            CameraKeyframe keyframe{};
+            std::string eye, target;
+            ss >> keyframe.frame >> eye >> target;
+            keyframe.eye = parse_vec3(eye, line);
+            keyframe.target = parse_vec3(target, line);
+            cameraKeyframes.push_back(keyframe);
+        } else if (command == "light") {
+            BenchmarkEvent event{BenchmarkEvent::eLight};
+            std::string type, position, color;
+            ss >> event.frame >> type >> position >> color >> event.light.intensity;
+            event.light.type = (type == "directional") ? LightType::eDirectional
+                                                       : LightType::ePoint;
+            event.light.positionOrDirection = parse_vec3(position, line);
+            event.light.color = parse_vec3(color, line);
+            events.push_back(event);
+        } else if (command == "scale") {
+            BenchmarkEvent event{BenchmarkEvent::eScale};
+            ss >> event.frame >> event.value;
+            events.push_back(event);
+        } else if (command == "rotate") {
+            BenchmarkEvent event{BenchmarkEvent::eRotate};
+            std::string axis;
+            float degrees;
+            ss >> event.frame >> axis >> degrees;
+            // Same axes as the imgui rotation sliders
+            event.axis = (axis == "x")   ? glm::vec3(1.f, 0.f, 0.f)
+                         : (axis == "y") ? glm::vec3(0.f, -1.f, 0.f)
+                                         : glm::vec3(0.f, 0.f, 1.f);
+            event.value = glm::radians(degrees);
+            events.push_back(event);
+        } else if (command == "report") {
+            std::string reportPath;
+            ss >> reportPath;
+            report = std::filesystem::path(reportPath);
+        } else {
+            throw std::runtime_error("Benchmark: unknown command \"" + command + "\"");
+        }
+
+        if (ss.fail())
+            throw std::runtime_error("Benchmark: could not parse line \"" + line + "\"");
+    }
+
+    auto byFrame = [](const auto &a, const auto &b) { return a.frame < b.frame; };
+    std::stable_sort(cameraKeyframes.begin(), cameraKeyframes.end(), byFrame);
+    std::stable_sort(events.begin(), events.end(), byFrame);
+}
+
+void BenchmarkScript::camera_at(const uint32_t frame, glm::vec3 &eye, glm::vec3 &target) const
+{
+    assert(!cameraKeyframes.empty());
+    auto next = std::find_if(cameraKeyframes.begin(),
+                             cameraKeyframes.end(),
+                             [frame](const CameraKeyframe &k) { return k.frame > frame; });
+    if (next == cameraKeyframes.begin() || next == cameraKeyframes.end()) {
+        const CameraKeyframe &k = (next == cameraKeyframes.end()) ? cameraKeyframes.back() : *next;
+        eye = k.eye;
+        target = k.target;
+        return;
+    }
+    const CameraKeyframe &k0 = *std::prev(next);
+    const CameraKeyframe &k1 = *next;
+    const float t = static_cast<float>(frame - k0.frame) / static_cast<float>(k1.frame - k0.frame);
+    eye = glm::mix(k0.eye, k1.eye, t);
+    target = glm::mix(k0.target, k1.target, t);
+}
+
+// Nearest-rank percentile of a sorted vector
+static float percentile(const std::vector<float> &sorted, const float p)
+{
+    const size_t rank = static_cast<size_t>(std::ceil(p / 100.f * sorted.size()));
+    return sorted[std::clamp(rank, size_t{1}, sorted.size()) - 1];
+}
+
+std::string benchmark_report(const BenchmarkScript &script,
+                             const std::filesystem::path &scenePath,
+                             const BenchmarkResults &results)
+{
+    std::vector<float> sorted = results.frameTimesMs;
+    std::sort(sorted.begin(), sorted.end());
+    if (sorted.empty())
+        sorted.push_back(0.f);
+    const float mean = std::accumulate(sorted.begin(), sorted.end(), 0.f) / sorted.size();
+    const float primaryRays = static_cast<float>(script.extent.width) * script.extent.height;
+
+    std::string json = "{\n";
+    json += std::format("  \"scene\": \"{}\",\n", scenePath.generic_string());
+    json += std::format("  \"script\": \"{}\",\n", script.path.generic_string());
+    json += std::format("  \"device\": \"{}\",\n", results.deviceName);
+    json += std::format("  \"driverVersion\": {},\n", results.driverVersion);
+    json += std::format("  \"width\": {},\n", script.extent.width);
+    json += std::format("  \"height\": {},\n", script.extent.height);
+    json += std::format("  \"seed\": {},\n", script.seed);
+    json += std::format("  \"warmupFrames\": {},\n", script.warmupFrames);
+    json += std::format("  \"frames\": {},\n", results.frameTimesMs.size());
+    const char *backends[] = {"rt", "wavefront", "rayquery"};
+    json += std::format("  \"backend\": \"{}\",\n", backends[results.backend]);
+    // The compute backends only have the iterative integrator
+    const bool iterative = script.integrator == eIterative || results.backend != eRtPipeline;
+    json += std::format("  \"integrator\": \"{}\",\n", iterative ? "iterative" : "recursive");
+    json += std::format("  \"presampled\": {},\n", script.constantsCH.presampled == vk::True);
+    json += std::format("  \"startupSeconds\": {:.4f},\n", results.startupSeconds);
+    json += "  \"frameTimeMs\": {\n";
+    json += std::format("    \"mean\": {:.4f},\n", mean);
+    json += std::format("    \"min\": {:.4f},\n", sorted.front());
+    json += std::format("    \"p50\": {:.4f},\n", percentile(sorted, 50.f));
+    json += std::format("    \"p95\": {:.4f},\n", percentile(sorted, 95.f));
+    json += std::format("    \"p99\": {:.4f},\n", percentile(sorted, 99.f));
+    json += std::format("    \"max\": {:.4f}\n", sorted.back());
+    json += "  },\n";
+    // Only camera rays are counted, the number of secondary rays depends on the scene
+    json += std::format("  \"primaryRaysPerSecond\": {:.0f}\n",
+                        (mean > 0.f) ? primaryRays * 1000.f / mean : 0.f);
+    json += "}\n";
+    return json;
+}
@@ -0,0 +1,91 @@
+#pragma once
+#ifndef USE_CXX20_MODULES
+#include <vulkan/vulkan.hpp>
+#else
+import vulkan;
+#endif
+
+#include "lights.hpp"
+#include "types.hpp"
+#include <filesystem>
+#include <glm/glm.hpp>
+#include <string>
+#include <vector>
+
+// Scene change applied at a given frame of the benchmark timeline
+struct BenchmarkEvent
+{
+    enum Type { eLight, eScale, eRotate };
+
+    Type type;
+    uint32_t frame{0};
+    Light::LightData light{}; // eLight
+    float value{1.f};         // eScale: relative factor. eRotate: angle in radians
+    glm::vec3 axis{0.f};      // eRotate
+};
+
+struct CameraKeyframe
+{
+    uint32_t frame{0};
+    glm::vec3 eye{0.f};
+    glm::vec3 target{0.f};
+};
+
+// Line based benchmark description. One command per line, '#' starts a comment:
+//   size 1280x720                   render extent
+//   seed 1234                       first value of the RNG frame counter
+//   warmup 30                       frames rendered before measuring, discarded
+//   frames 300                      measured frames
+//   backend rt|wavefront|rayquery   RT pipeline, wavefront compute stages or single ray query kernel
+//   integrator iterative|recursive
+//   depth 8                         path depth of the iterative integrator
+//   recursion 2                     specialization constants of the recursive integrator
+//   bounces 8
+//   random 0|1
+//   presampled 0|1
+//   envmap 0|1
+//   camera <frame> ex,ey,ez tx,ty,tz       keyframe, linearly interpolated
+//   light <frame> point|directional x,y,z r,g,b intensity
+//   scale <frame> factor
+//   rotate <frame> x|y|z degrees
+//   report results.json             also write the JSON report to a file
+class BenchmarkScript
+{
+public:
+    BenchmarkScript(const std::filesystem::path &path);
+
+    // Interpolated camera at a frame of the measured timeline
+    void camera_at(const uint32_t frame, glm::vec3 &eye, glm::vec3 &target) const;
+
+    std::filesystem::path path;
+    vk::Extent2D extent{W, H};
+    uint32_t seed{0};
+    uint32_t warmupFrames{30};
+    uint32_t frames{300};
+    uint32_t backend{eRtPipeline};
+    uint32_t integrator{eRecursive};
+    uint32_t pathDepth{8};
+    SpecializationConstantsClosestHit constantsCH{};
+    SpecializationConstantsMiss constantsMiss{};
+    std::vector<CameraKeyframe> cameraKeyframes;
+    std::vector<BenchmarkEvent> events; // Sorted by frame
+    std::filesystem::path report;
+};
+
+struct BenchmarkResults
+{
+    float startupSeconds{0.f};
+    std::vector<float> frameTimesMs; // Measured frames only
+    std::string deviceName;
+    uint32_t driverVersion{0};
+    uint32_t backend{eRtPipeline}; // The one that ran, rt falls back to rayquery without the RT pipeline
+};
+
+// Names shared by the command line and the scripts. Throw std::runtime_error on unknown ones
+uint32_t parse_integrator(const std::string &name); // iterative|recursive
+uint32_t parse_backend(const std::string &name);    // rt|wavefront|rayquery
+
+// JSON with the frame time percentiles and the primary ray throughput
+std::string benchmark_report(const BenchmarkScript &script,
+                             const std::filesystem::path &scenePath,
+                             const BenchmarkResults &results);
@@ -71,10 +71,19 @@ void Camera::lookAt(const glm::vec3 &point)
     orientation = glm::normalize(point - translation);
 }
 
-void Camera::update()
+void Camera::setPosition(const glm::vec3 &position)
+{
+    translation = position;
+}
+
+bool Camera::update()
 {
     orientation = glm::normalize(orientation);
-    viewMatrix = glm::lookAt(translation, translation + orientation, glm::vec3(0, 1, 0));
+    const glm::mat4 newViewMatrix = glm::lookAt(translation,
+                                                translation + orientation,
+                                                glm::vec3(0, 1, 0));
+    const bool changed = newViewMatrix != viewMatrix || projInverse != cameraData.projInverse;
+    viewMatrix = newViewMatrix;
     invView = glm::inverse(viewMatrix);
     if (cameraBuffer.buffer) {
         cameraData.origin = translation;
@@ -83,6 +92,7 @@ void Camera::update()
         cameraData.viewInverse = invView;
         utils::copy_to_buffer(cameraBuffer, allocator, &cameraData);
     }
+    return changed;
 }
 
 void Camera::create_camera_buffer()
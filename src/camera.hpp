@@ -34,8 +34,10 @@ public:
     void lookRight(const float &dx);
     void lookLeft(const float &dx);
     void lookAt(const glm::vec3 &point);
+    void setPosition(const glm::vec3 &position);
 
-    void update();
+    // Returns true if the view or the projection changed since the last call
+    bool update();
 
     void create_camera_buffer();
     void destroy_camera_buffer();
@@ -3,24 +3,31 @@
 #include "lights.hpp"
 #include "types.hpp"
 #include "utils.hpp"
+#include <algorithm>
+#include <chrono>
 #include <glm/ext.hpp>
 #include <imgui_impl_sdl3.h>
 #include <imgui_impl_vulkan.h>
 #include <print>
 
-Engine::Engine(const std::filesystem::path &gltfPath)
+Engine::Engine(const std::filesystem::path &gltfPath,
+               const bool headless,
+               const vk::Extent2D &extent,
+               const SceneOptions &sceneOptions)
 {
-    I = std::make_unique<Init>(gltfPath);
+    I = std::make_unique<Init>(gltfPath, headless, extent, sceneOptions);
+    backend = I->rtPipeline ? eRtPipeline : eRayQuery;
 
     descUpdater = std::make_unique<DescriptorUpdater>(I->device);
-    lightsManager = std::make_unique<LightsManager>(I->device, I->allocator);
+    lightsManager = std::make_unique<LightsManager>(I->device, I->allocator, I->frameOverlap);
 }
 
 Engine::~Engine()
 {
-    // Destroy all the remaining lights
-    for (Light &l : lightsManager->lights)
-        l.destroy();
+    // The light buffers go after the last frame, clean() waits for it
+    if (I->isInitialized)
+        I->device.waitIdle();
+    lightsManager->destroy();
     I->clean();
 }
 
@@ -71,6 +78,176 @@ void Engine::run()
     }
 }
 
+void Engine::render_offline(const OfflineRenderSettings &settings)
+{
+    update_descriptors();
+
+    if (settings.customCamera) {
+        I->camera->setPosition(settings.cameraPosition);
+        I->camera->lookAt(settings.cameraTarget);
+    }
+    rayPush.integrator = settings.integrator;
+    rayPush.pathDepth = settings.pathDepth;
+    select_backend(static_cast<RenderBackend>(settings.backend));
+
+    const auto start = std::chrono::steady_clock::now();
+    // One sample per submission, accumulated in the shaders
+    for (uint32_t s = 0; s < settings.samples; s++)
+        submit_headless_frame();
+    I->device.waitIdle();
+    const std::chrono::duration<float> elapsed = std::chrono::steady_clock::now() - start;
+    std::println("Rendered {} samples at {}x{} in {:.2f} s",
+                 settings.samples,
+                 I->swapchainExtent.width,
+                 I->swapchainExtent.height,
+                 elapsed.count());
+
+    const std::vector<float> pixels = utils::read_image(I->device,
+                                                        I->allocator,
+                                                        get_current_frame().mainCommandBuffer,
+                                                        get_current_frame().renderFence,
+                                                        I->graphicsQueue,
+                                                        I->accumulationImage);
+    utils::save_image(settings.output, pixels, I->swapchainExtent);
+    std::println("Image saved to {}", settings.output.c_str());
+}
+
+BenchmarkResults Engine::run_benchmark(const BenchmarkScript &script)
+{
+    update_descriptors();
+
+    // Fixed seed: the RNG of every frame only depends on the frame counter
+    rayPush.frame = script.seed;
+    rayPush.integrator = script.integrator;
+    rayPush.pathDepth = script.pathDepth;
+    if (I->rtPipeline)
+        I->rebuid_rt_pipeline(script.constantsCH, script.constantsMiss, frameNumber);
+    select_backend(static_cast<RenderBackend>(script.backend));
+    if (I->wavefront)
+        I->wavefront->build_pipelines(script.constantsCH, script.constantsMiss);
+    if (I->rayQueryRenderer)
+        I->rayQueryRenderer->build_pipeline(script.constantsCH, script.constantsMiss);
+
+    BenchmarkResults results{};
+    results.backend = backend;
+    results.deviceName = std::string(I->physicalDeviceProperties.deviceName.data());
+    results.driverVersion = I->physicalDeviceProperties.driverVersion;
+    results.frameTimesMs.reserve(script.frames);
+
+    size_t nextEvent = 0;
+    for (uint32_t f = 0; f < script.warmupFrames + script.frames; f++) {
+        // Warm-up frames replay the first frame of the timeline and are discarded
+        const uint32_t t = (f < script.warmupFrames) ? 0 : f - script.warmupFrames;
+        const auto start = std::chrono::steady_clock::now();
+
+        if (!script.cameraKeyframes.empty()) {
+            glm::vec3 eye, target;
+            script.camera_at(t, eye, target);
+            I->camera->setPosition(eye);
+            I->camera->lookAt(target);
+        }
+
+        for (; nextEvent < script.events.size() && script.events[nextEvent].frame <= t;
+             nextEvent++) {
+            const BenchmarkEvent &event = script.events[nextEvent];
+            switch (event.type) {
+            case BenchmarkEvent::eLight:
+                lightsManager->add_light(event.light);
+                resetAccumulation = true;
+                break;
+            case BenchmarkEvent::eScale:
+                rayPush.dScale = event.value;
+                transform_scene(glm::scale(glm::mat4{1.f}, glm::vec3(event.value)));
+                break;
+            case BenchmarkEvent::eRotate:
+                transform_scene(glm::rotate(event.value, event.axis));
+                break;
+            }
+        }
+
+        submit_headless_frame();
+        // Serialize the frames so that each measurement covers exactly one frame
+        VK_CHECK_RES(I->device.waitForFences(I->frames[(frameNumber + I->frameOverlap - 1)
+                                                       % I->frameOverlap]
+                                                 .renderFence,
+                                             vk::True,
+                                             FENCE_TIMEOUT));
+
+        const std::chrono::duration<float, std::milli> elapsed = std::chrono::steady_clock::now()
+                                                                 - start;
+        if (f >= script.warmupFrames)
+            results.frameTimesMs.push_back(elapsed.count());
+    }
+    I->device.waitIdle();
+
+    return results;
+}
+
+void Engine::select_backend(RenderBackend newBackend)
+{
+    if (newBackend == eRtPipeline && !I->rtPipeline)
+        newBackend = eRayQuery;
+    if (newBackend != eRtPipeline && !I->rayQuery)
+        throw std::runtime_error("The compute backends need VK_KHR_ray_query");
+    backend = newBackend;
+    resetAccumulation = true;
+}
+
+void Engine::enable_trace(const std::filesystem::path &path)
+{
+    I->profiler->enable_trace(path);
+}
+
+void Engine::submit_headless_frame()
+{
+    const vk::Fence frameFence = get_current_frame().renderFence;
+    VK_CHECK_RES(I->device.waitForFences(frameFence, vk::True, FENCE_TIMEOUT));
+    I->device.resetFences(frameFence);
+    I->destroy_retired(frameNumber);
+
+    vk::CommandBuffer cmd = get_current_frame().mainCommandBuffer;
+    cmd.reset();
+    vk::CommandBufferBeginInfo commandBufferBeginInfo{};
+    commandBufferBeginInfo.setFlags(vk::CommandBufferUsageFlagBits::eOneTimeSubmit);
+    cmd.begin(commandBufferBeginInfo);
+    I->profiler->begin_frame(cmd, get_current_frame());
+    const uint32_t raytraceScope = I->profiler->begin_scope(cmd, get_current_frame(), "raytrace");
+    raytrace(cmd);
+    I->profiler->end_scope(cmd, get_current_frame(), raytraceScope);
+    cmd.end();
+
+    vk::CommandBufferSubmitInfo cmdInfo{};
+    cmdInfo.setDeviceMask(1);
+    cmdInfo.setCommandBuffer(cmd);
+    vk::SubmitInfo2 submitInfo{};
+    submitInfo.setCommandBufferInfos(cmdInfo);
+    I->graphicsQueue.submit2(submitInfo, frameFence);
+
+    frameNumber = (frameNumber + 1) % I->frameOverlap;
+}
+
+void Engine::transform_scene(const glm::mat4 &transform)
+{
+    // The refit itself is recorded in the next frame
+    I->asBuilder->updateTLAS(I->tlas, transform);
+    resetAccumulation = true;
+}
+
+void Engine::sync_lights()
+{
+    // The frame fence has been waited, so its buffer and its descriptor set are free. The descriptor
+    // only changes when the buffer has to grow
+    if (lightsManager->upload(frameNumber)) {
+        descUpdater->clean();
+        descUpdater->add_storage(get_current_frame().descriptorSetUAB,
+                                 3,
+                                 {lightsManager->buffers[frameNumber]});
+        descUpdater->update();
+    }
+
+    rayPush.nLights = static_cast<uint32_t>(lightsManager->lights.size());
+}
+
 void Engine::update_imgui()
 {
     static SpecializationConstantsClosestHit constantsCH{};
@@ -79,7 +256,10 @@ void Engine::update_imgui()
         presample{static_cast<bool>(constantsCH.presampled)},
         envMap{static_cast<bool>(constantsMiss.envMap)}, dirLightOn{false};
     static int recursionDepth = constantsCH.recursionDepth, numBounces = constantsCH.numBounces;
+    static int integrator = rayPush.integrator, pathDepth = rayPush.pathDepth;
+    static int renderBackend = backend;
     static float scale{1.f}, xRot{0.f}, yRot{0.f}, zRot{0.f};
+    static int materialIndex{0};
     static std::filesystem::path imPath{std::string(PROJECT_DIR)
                                         + std::string("/assets/rogland_clear_night_4k.hdr")};
 
@@ -107,6 +287,11 @@ void Engine::update_imgui()
     ImGui::Begin("Performance", nullptr, flags);
     ImGui::Text("%.1f FPS", fps);
     ImGui::Text("%.2f ms", framerate);
+    if (I->profiler->enabled()) {
+        ImGui::Separator();
+        ImGui::Text("GPU (avg. %zu frames)", GpuProfiler::ScopeStats::WINDOW);
+        I->profiler->draw_imgui();
+    }
     ImGui::End();
 
     ImGui::Begin("Controls");
@@ -128,6 +313,7 @@ void Engine::update_imgui()
         }
         descUpdater->update();
         imPath = newImPath;
+        resetAccumulation = true;
     }
     if (envMap) {
         ImGui::SameLine();
@@ -148,9 +334,37 @@ void Engine::update_imgui()
         constantsCH.presampled = static_cast<vk::Bool32>(presample);
 
         constantsMiss.envMap = static_cast<vk::Bool32>(envMap);
-        I->rebuid_rt_pipeline(constantsCH, constantsMiss);
+        // Compiled in the background, draw() swaps them in and resets the accumulation
+        if (I->rtPipeline)
+            I->request_rt_pipeline(constantsCH, constantsMiss);
+        if (I->rayQuery)
+            I->request_compute_pipelines(constantsCH, constantsMiss);
+    }
+
+    // The compute backends need ray queries and always run the iterative integrator
+    if (I->rayQuery) {
+        const char *backends[] = {"RT pipeline", "Wavefront", "Ray query"};
+        if (ImGui::Combo("Backend", &renderBackend, backends, IM_ARRAYSIZE(backends))) {
+            select_backend(static_cast<RenderBackend>(renderBackend));
+            renderBackend = backend; // Falls back to ray queries without the RT pipeline
+        }
     }
 
+    // Push constants, no pipeline rebuild needed
+    const char *integrators[] = {"Recursive", "Iterative"};
+    if (backend == eRtPipeline)
+        ImGui::Combo("Integrator", &integrator, integrators, IM_ARRAYSIZE(integrators));
+    rayPush.integrator = static_cast<uint32_t>(integrator);
+    if (integrator == eIterative || backend != eRtPipeline) {
+        ImGui::InputInt("Path depth", &pathDepth, 1, 4);
+        pathDepth = std::max(pathDepth, 1);
+        rayPush.pathDepth = static_cast<uint32_t>(pathDepth);
+    }
+
+    ImGui::Checkbox("Accumulate", &accumulate);
+    ImGui::SameLine();
+    ImGui::Text("%u samples", rayPush.accumulatedSamples);
+
     ImGui::Separator();
 
     const float scaleOld{scale};
@@ -159,46 +373,50 @@ void Engine::update_imgui()
         const float ds = scale / scaleOld;
         const glm::mat4 S = glm::scale(glm::mat4{1.f}, glm::vec3(ds));
         rayPush.dScale = ds;
-        I->asBuilder->updateTLAS(I->tlas, S);
+        transform_scene(S);
     }
 
     const float xRotOld{xRot};
     if (ImGui::SliderAngle("X-axis Rotation", &xRot, -180.f, 180.f)) {
         const float dr = xRot - xRotOld;
         const glm::mat4 R = glm::rotate(dr, glm::vec3(1.f, 0.f, 0.f));
-        I->asBuilder->updateTLAS(I->tlas, R);
+        transform_scene(R);
     }
 
     const float yRotOld{yRot};
     if (ImGui::SliderAngle("Y-axis Rotation", &yRot, -180.f, 180.f)) {
         const float dr = yRot - yRotOld;
         const glm::mat4 R = glm::rotate(dr, glm::vec3(0.f, -1.f, 0.f));
-        I->asBuilder->updateTLAS(I->tlas, R);
+        transform_scene(R);
     }
 
     const float zRotOld{zRot};
     if (ImGui::SliderAngle("Z-axis Rotation", &zRot, -180.f, 180.f)) {
         const float dr = zRot - zRotOld;
         const glm::mat4 R = glm::rotate(dr, glm::vec3(0.f, 0.f, 1.f));
-        I->asBuilder->updateTLAS(I->tlas, R);
+        transform_scene(R);
     }
 
-    lightsManager->run();
-    assert(lightsManager->lightBuffers.size() == lightsManager->lights.size());
-    bool updateDescriptors = false;
-    for (auto &f : I->frames) {
-        updateDescriptors = updateDescriptors || (f.lightsCount != lightsManager->lights.size());
-        f.lightsCount = lightsManager->lights.size();
-    }
-    if (updateDescriptors && lightsManager->lightBuffers.size() > 0) {
-        descUpdater->clean();
-        for (const auto &f : I->frames) {
-            descUpdater->add_uniform(f.descriptorSetUAB, 3, lightsManager->lightBuffers);
+    ImGui::Separator();
+
+    // Live material tweaking. Only the edited table entry is patched
+    const int materialCount = static_cast<int>(I->scene->materialTable.size());
+    if (ImGui::TreeNode("Materials")) {
+        ImGui::SliderInt("Material", &materialIndex, 0, materialCount - 1);
+        materialIndex = std::clamp(materialIndex, 0, materialCount - 1);
+        MaterialData material = I->scene->materialTable[materialIndex];
+        bool materialChanged = ImGui::ColorEdit4("Base color", (float *) &material.baseColorFactor);
+        materialChanged |= ImGui::SliderFloat("Metallic", &material.metallicFactor, 0.f, 1.f);
+        materialChanged |= ImGui::SliderFloat("Roughness", &material.roughnessFactor, 0.f, 1.f);
+        if (materialChanged) {
+            I->scene->set_material(static_cast<uint32_t>(materialIndex), material);
+            resetAccumulation = true;
         }
-        descUpdater->update();
+        ImGui::TreePop();
     }
 
-    rayPush.nLights = static_cast<uint32_t>(lightsManager->lights.size());
+    if (lightsManager->run())
+        resetAccumulation = true;
 
     ImGui::End();
 
@@ -212,24 +430,26 @@ void Engine::update_descriptors()
     // resources
     const static bool withTextures = I->scene->samplers.size() > 0 && I->scene->images.size() > 0;
 
-    for (const auto &frame : I->frames) {
+    for (size_t i = 0; i < I->frames.size(); i++) {
         // Inform the shaders about all the different descriptors
+        const FrameData &frame = I->frames[i];
         const vk::DescriptorSet descriptorSetUAB = frame.descriptorSetUAB;
         const vk::DescriptorSet descriptorSetRt = frame.descriptorSetRt;
 
-        descUpdater->add_uniform(descriptorSetUAB, 0, I->scene->surfaceUniformBuffers);
+        descUpdater->add_storage(descriptorSetUAB, 0, {I->scene->surfaceStorageBuffer});
+        descUpdater->add_storage(descriptorSetUAB, 4, {I->scene->materialBuffer});
         if (withTextures) {
             descUpdater->add_sampler(descriptorSetUAB, 1, I->scene->samplers);
             descUpdater->add_sampled_image(descriptorSetUAB, 2, I->scene->images);
         }
-        if (lightsManager->lightBuffers.size() > 0)
-            descUpdater->add_uniform(descriptorSetUAB, 3, lightsManager->lightBuffers);
+        descUpdater->add_storage(descriptorSetUAB, 3, {lightsManager->buffers[i]});
         descUpdater->add_as(descriptorSetRt, 0, I->tlas.as.AS);
         descUpdater->add_storage_image(descriptorSetRt, 1, {frame.imageDraw});
         descUpdater->add_uniform(descriptorSetRt, 2, {I->camera->cameraBuffer});
         descUpdater->add_combined_image(descriptorSetRt, 3, {I->presampler->hemisphereImage});
         descUpdater->add_combined_image(descriptorSetRt, 4, {I->presampler->ggxImage});
         descUpdater->add_combined_image(descriptorSetRt, 5, {I->backgroundImage});
+        descUpdater->add_storage_image(descriptorSetRt, 6, {I->accumulationImage});
     }
     descUpdater->update();
 }
@@ -246,6 +466,12 @@ void Engine::draw()
         std::println("Skipping frame");
         return;
     }
+    // The previous use of this frame is done, so is everything retired with it
+    I->destroy_retired(frameNumber);
+    // Newest finished pipeline variants. The old ones go when the frames in flight are done
+    const bool rtSwapped = I->swap_rt_pipeline(frameNumber);
+    if (I->swap_compute_pipelines(frameNumber) || rtSwapped)
+        resetAccumulation = true;
     // Request image from the swapchain
     vk::AcquireNextImageInfoKHR acquireImageInfo{};
     acquireImageInfo.setSwapchain(I->swapchain);
@@ -281,28 +507,37 @@ void Engine::draw()
     commandBufferBeginInfo.setFlags(vk::CommandBufferUsageFlagBits::eOneTimeSubmit);
     cmd.begin(commandBufferBeginInfo);
 
+    // Collects the timestamps of the last time this frame was used, its fence has been waited
+    GpuProfiler *profiler = I->profiler.get();
+    FrameData &frame = get_current_frame();
+    profiler->begin_frame(cmd, frame);
+
     utils::transition_image(cmd,
                             I->swapchainImages[swapchainImageIndex],
                             vk::ImageLayout::eUndefined,
                             vk::ImageLayout::eGeneral,
                             vk::PipelineStageFlagBits2::eTopOfPipe,
-                            vk::PipelineStageFlagBits2::eRayTracingShaderKHR);
+                            I->traceStages);
 
     // raster(cmd);
+    const uint32_t raytraceScope = profiler->begin_scope(cmd, frame, "raytrace");
     raytrace(cmd);
+    profiler->end_scope(cmd, frame, raytraceScope);
 
-    barrier.setSrcStageMask(vk::PipelineStageFlagBits2::eRayTracingShaderKHR);
+    barrier.setSrcStageMask(I->traceStages);
     barrier.setDstStageMask(vk::PipelineStageFlagBits2::eBlit);
     barrier.setSrcAccessMask(vk::AccessFlagBits2::eMemoryWrite);
     barrier.setDstAccessMask(vk::AccessFlagBits2::eMemoryRead | vk::AccessFlagBits2::eMemoryWrite);
     cmd.pipelineBarrier2(depInfo);
 
     // Copy draw to swapchain
+    const uint32_t copyScope = profiler->begin_scope(cmd, frame, "copy_image");
     utils::copy_image(cmd,
                       imageDraw.image,
                       I->swapchainImages[swapchainImageIndex].image,
                       vk::Extent2D{imageDraw.extent.width, imageDraw.extent.height},
                       I->swapchainExtent);
+    profiler->end_scope(cmd, frame, copyScope);
 
     barrier.setSrcStageMask(vk::PipelineStageFlagBits2::eBlit);
     barrier.setDstStageMask(vk::PipelineStageFlagBits2::eAllGraphics);
@@ -310,7 +545,9 @@ void Engine::draw()
     barrier.setDstAccessMask(vk::AccessFlagBits2::eMemoryRead | vk::AccessFlagBits2::eMemoryWrite);
     cmd.pipelineBarrier2(depInfo);
 
+    const uint32_t imguiScope = profiler->begin_scope(cmd, frame, "draw_imgui");
     draw_imgui(cmd, I->swapchainImages[swapchainImageIndex].imageView);
+    profiler->end_scope(cmd, frame, imguiScope);
 
     utils::transition_image(cmd,
                             I->swapchainImages[swapchainImageIndex],
@@ -330,14 +567,12 @@ void Engine::draw()
     cmdInfo.setCommandBuffer(cmd);
     vk::SemaphoreSubmitInfo semaphoreWaitInfo{};
     semaphoreWaitInfo.setSemaphore(acquireSemaphore);
-    semaphoreWaitInfo.setStageMask(vk::PipelineStageFlagBits2::eAllGraphics
-                                   | vk::PipelineStageFlagBits2::eRayTracingShaderKHR);
+    semaphoreWaitInfo.setStageMask(vk::PipelineStageFlagBits2::eAllGraphics | I->traceStages);
     semaphoreWaitInfo.setDeviceIndex(0);
     semaphoreWaitInfo.setValue(1);
     vk::SemaphoreSubmitInfo semaphoreSignalInfo{};
     semaphoreSignalInfo.setSemaphore(submitSemaphore);
-    semaphoreSignalInfo.setStageMask(vk::PipelineStageFlagBits2::eAllGraphics
-                                     | vk::PipelineStageFlagBits2::eRayTracingShaderKHR);
+    semaphoreSignalInfo.setStageMask(vk::PipelineStageFlagBits2::eAllGraphics | I->traceStages);
     semaphoreSignalInfo.setDeviceIndex(0);
     semaphoreSignalInfo.setValue(1);
     vk::SubmitInfo2 submitInfo{};
@@ -375,14 +610,56 @@ void Engine::draw()
 
 void Engine::raytrace(const vk::CommandBuffer &cmd)
 {
-    cmd.bindPipeline(vk::PipelineBindPoint::eRayTracingKHR, I->simpleRtPipeline.pipeline);
+    // Material edits are patched in place
+    I->scene->record_material_updates(cmd, I->traceStages);
+
+    // Pending scene transforms are refitted on the GPU right before tracing
+    if (I->tlas.updatePending) {
+        const uint32_t tlasScope = I->profiler->begin_scope(cmd, get_current_frame(), "tlas_update");
+        I->asBuilder->recordTLASUpdate(cmd, I->tlas, frameNumber, I->traceStages);
+        I->profiler->end_scope(cmd, get_current_frame(), tlasScope);
+    }
 
     vk::DescriptorSet descriptorSetUniform = get_current_frame().descriptorSetUAB;
     vk::DescriptorSet descriptorSetRt = get_current_frame().descriptorSetRt;
-    vk::ImageView imageView = get_current_frame().imageDraw.imageView;
-    vk::AccelerationStructureKHR tlas = I->tlas.as.AS;
-
     std::vector<vk::DescriptorSet> descriptorSets = {descriptorSetRt, descriptorSetUniform};
+
+    sync_lights();
+    update_accumulation(I->camera->update());
+
+    // The previous frame may still be writing the accumulation image that we are about to read,
+    // with any backend. The wavefront streams are reused the same way
+    vk::MemoryBarrier2 accumulationBarrier{};
+    accumulationBarrier.setSrcStageMask(I->traceStages);
+    accumulationBarrier.setSrcAccessMask(vk::AccessFlagBits2::eShaderStorageWrite);
+    accumulationBarrier.setDstStageMask(I->traceStages);
+    accumulationBarrier.setDstAccessMask(vk::AccessFlagBits2::eShaderStorageRead
+                                         | vk::AccessFlagBits2::eShaderStorageWrite);
+    vk::DependencyInfo accumulationDepInfo{};
+    accumulationDepInfo.setMemoryBarriers(accumulationBarrier);
+    cmd.pipelineBarrier2(accumulationDepInfo);
+
+    switch (backend) {
+    case eRtPipeline:
+        trace_rays(cmd, descriptorSets);
+        break;
+    case eWavefront:
+        I->wavefront->record(cmd, descriptorSets, rayPush);
+        break;
+    case eRayQuery:
+        I->rayQueryRenderer->record(cmd, descriptorSets, rayPush, I->swapchainExtent);
+        break;
+    }
+
+    rayPush.accumulatedSamples++;
+    rayPush.frame++;
+}
+
+void Engine::trace_rays(const vk::CommandBuffer &cmd,
+                        const std::vector<vk::DescriptorSet> &descriptorSets)
+{
+    cmd.bindPipeline(vk::PipelineBindPoint::eRayTracingKHR, I->simpleRtPipeline.pipeline);
+
     vk::BindDescriptorSetsInfo bindSetsInfo{};
     bindSetsInfo.setDescriptorSets(descriptorSets);
     bindSetsInfo.setStageFlags(vk::ShaderStageFlagBits::eRaygenKHR
@@ -403,17 +680,30 @@ void Engine::raytrace(const vk::CommandBuffer &cmd)
     pushInfo.setOffset(0);
     cmd.pushConstants2(pushInfo);
 
-    I->camera->update();
-
-    cmd.traceRaysKHR(I->sbtHelper->rgenRegion,
-                     I->sbtHelper->missRegion,
-                     I->sbtHelper->hitRegion,
+    cmd.traceRaysKHR(I->rtSBT.rgenRegion,
+                     I->rtSBT.missRegion,
+                     I->rtSBT.hitRegion,
                      vk::StridedDeviceAddressRegionKHR{},
                      I->swapchainExtent.width,
                      I->swapchainExtent.height,
                      1);
 }
 
+void Engine::update_accumulation(const bool cameraChanged)
+{
+    // Changes in the push constants that alter the image (the counters are excluded)
+    const bool pushChanged = rayPush.clearColor != lastRayPush.clearColor
+                             || rayPush.nLights != lastRayPush.nLights
+                             || rayPush.dScale != lastRayPush.dScale
+                             || rayPush.integrator != lastRayPush.integrator
+                             || rayPush.pathDepth != lastRayPush.pathDepth;
+    lastRayPush = rayPush;
+
+    if (cameraChanged || pushChanged || resetAccumulation || !accumulate)
+        rayPush.accumulatedSamples = 0;
+    resetAccumulation = false;
+}
+
 void Engine::draw_imgui(const vk::CommandBuffer &cmd, const vk::ImageView &imageView)
 {
     vk::RenderingAttachmentInfo colorAttachmentInfo{};
@@ -442,11 +732,14 @@ void Engine::resize()
 
     I->recreate_draw_data();
     descUpdater->clean();
-    for (const auto &f : I->frames)
+    for (const auto &f : I->frames) {
         descUpdater->add_storage_image(f.descriptorSetRt, 1, {f.imageDraw});
+        descUpdater->add_storage_image(f.descriptorSetRt, 6, {I->accumulationImage});
+    }
     descUpdater->update();
 
     I->recreate_camera();
+    resetAccumulation = true;
 
     // std::println("Swapchain, draw data and camera recreated");
 
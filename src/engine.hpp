@@ -5,18 +5,30 @@
 import vulkan;
 #endif
 
+#include "benchmark.hpp"
 #include "init.hpp"
 #include <memory>
 
 class Engine
 {
 public:
-    Engine(const std::filesystem::path &gltfPath);
+    Engine(const std::filesystem::path &gltfPath,
+           const bool headless = false,
+           const vk::Extent2D &extent = {W, H},
+           const SceneOptions &sceneOptions = {});
     ~Engine();
 
     // run main loop
     void run();
 
+    // Headless: accumulate the requested samples, read them back and save them to a file
+    void render_offline(const OfflineRenderSettings &settings);
+
+    // Headless: replay a benchmark script and time every frame
+    BenchmarkResults run_benchmark(const BenchmarkScript &script);
+
+    // Stream the GPU profiler scopes to a chrome://tracing file, finished at exit
+    void enable_trace(const std::filesystem::path &path);
 
 private:
     // initializes everything in the engine
@@ -40,15 +52,28 @@ private:
     // Deprecated for now
     // void raster(const vk::CommandBuffer &cmd);
 
-    // Ray tracing commands
+    // Ray tracing commands, with the selected backend
     void raytrace(const vk::CommandBuffer &cmd);
 
+    // RT pipeline backend: the megakernel over the SBT
+    void trace_rays(const vk::CommandBuffer &cmd,
+                    const std::vector<vk::DescriptorSet> &descriptorSets);
+
     // Imgui
     void draw_imgui(const vk::CommandBuffer &cmd, const vk::ImageView &imageView);
 
     // Resize
     void resize();
 
+    // Record and submit one ray traced frame without swapchain. Signals the frame fence
+    void submit_headless_frame();
+
+    // Upload the lights to the buffer of the current frame, once its fence has been waited
+    void sync_lights();
+
+    // Apply a transform to every TLAS instance
+    void transform_scene(const glm::mat4 &transform);
+
     // Other data
     uint64_t frameNumber{0};
     uint32_t swapchainImageIndex{0};
@@ -58,6 +83,17 @@ private:
     // RT push constants
     RayPush rayPush{};
 
+    RenderBackend backend{eRtPipeline};
+    // eRtPipeline falls back to eRayQuery without VK_KHR_ray_tracing_pipeline. Throws
+    // std::runtime_error for the compute backends if the device has no ray queries
+    void select_backend(RenderBackend newBackend);
+
+    // Progressive accumulation. Any change of the view or the scene restarts it
+    bool accumulate{true};
+    bool resetAccumulation{true};
+    RayPush lastRayPush{};
+    void update_accumulation(const bool cameraChanged);
+
     // Lights manager
     std::unique_ptr<LightsManager> lightsManager;
 };
@@ -0,0 +1,51 @@
+#include "geometry_arena.hpp"
+#include "utils.hpp"
+#include <algorithm>
+
+GeometryArena::GeometryArena(const vk::Device &device,
+                             const VmaAllocator &allocator,
+                             UploadManager &uploader,
+                             const vk::DeviceSize blockSize)
+    : device{device}
+    , allocator{allocator}
+    , uploader{uploader}
+    , blockSize{blockSize}
+{}
+
+void GeometryArena::destroy()
+{
+    for (const Buffer &b : blocks)
+        utils::destroy_buffer(allocator, b);
+    blocks.clear();
+    head = capacity = 0;
+}
+
+BufferSlice GeometryArena::upload(const void *data, const vk::DeviceSize size)
+{
+    // Buffer references in the shaders assume 16 byte aligned addresses
+    vk::DeviceSize offset = (head + GEOMETRY_ALIGNMENT - 1) & ~(GEOMETRY_ALIGNMENT - 1);
+    if (blocks.empty() || offset + size > capacity) {
+        // Meshes larger than a block get a block of their own size
+        capacity = std::max(blockSize, size);
+        blocks.emplace_back(utils::create_buffer(
+            device,
+            allocator,
+            capacity,
+            vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eShaderDeviceAddress
+                | vk::BufferUsageFlagBits::eTransferDst
+                | vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR,
+            VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE));
+        offset = 0;
+    }
+
+    const Buffer &block = blocks.back();
+    uploader.upload_buffer(block, data, size, offset);
+    head = offset + size;
+
+    BufferSlice slice;
+    slice.buffer = block.buffer;
+    slice.offset = offset;
+    slice.size = size;
+    slice.address = block.bufferAddress + offset;
+    return slice;
+}
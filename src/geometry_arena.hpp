@@ -0,0 +1,48 @@
+#pragma once
+#ifndef USE_CXX20_MODULES
+#include <vulkan/vulkan.hpp>
+#else
+import vulkan;
+#endif
+
+#include "types.hpp"
+#include "upload_manager.hpp"
+#include <vector>
+
+// Range of an arena block
+struct BufferSlice
+{
+    vk::Buffer buffer;
+    vk::DeviceSize offset{0};
+    vk::DeviceSize size{0};
+    vk::DeviceAddress address{0}; // Block address + offset
+};
+
+// Bump allocator over a few large device-local buffers, for the vertex and index data of every
+// mesh. Blocks are never freed individually, everything goes away on destroy()
+class GeometryArena
+{
+public:
+    GeometryArena(const vk::Device &device,
+                  const VmaAllocator &allocator,
+                  UploadManager &uploader,
+                  const vk::DeviceSize blockSize = GEOMETRY_ARENA_BLOCK_SIZE);
+    ~GeometryArena() = default;
+
+    void destroy();
+
+    // Suballocates the slice and queues its upload
+    BufferSlice upload(const void *data, const vk::DeviceSize size);
+
+    size_t block_count() const { return blocks.size(); }
+
+private:
+    const vk::Device &device;
+    const VmaAllocator &allocator;
+    UploadManager &uploader;
+    const vk::DeviceSize blockSize;
+
+    std::vector<Buffer> blocks;
+    vk::DeviceSize head{0}; // In the last block
+    vk::DeviceSize capacity{0};
+};
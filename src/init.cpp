@@ -15,27 +15,75 @@
 #include <imgui.h>
 #include <imgui_impl_sdl3.h>
 #include <imgui_impl_vulkan.h>
+#include <optional>
 #include <print>
 #include <stb_image.h>
 
-Init::Init(const std::filesystem::path &gltfPath)
+namespace {
+// Pops the finished builds in order and keeps the newest one. The older ones, never bound, go to
+// discard, and so do all of them with wait set, once they finish
+template<typename T, typename Discard>
+std::optional<T> take_newest(std::queue<std::future<T>> &pending,
+                             const Discard &discard,
+                             const bool wait = false)
 {
-    init_sdl();
+    std::optional<T> newest;
+    while (!pending.empty()
+           && (wait
+               || pending.front().wait_for(std::chrono::seconds(0))
+                      == std::future_status::ready)) {
+        try {
+            T variant = pending.front().get();
+            if (newest)
+                discard(*newest);
+            newest = variant;
+        } catch (const std::exception &e) {
+            std::println("Pipeline build failed: {}", e.what());
+        }
+        pending.pop();
+    }
+    if (newest && wait) {
+        discard(*newest);
+        newest.reset();
+    }
+    return newest;
+}
+} // namespace
+
+Init::Init(const std::filesystem::path &gltfPath,
+           const bool headless,
+           const vk::Extent2D &headlessExtent,
+           const SceneOptions &sceneOptions)
+    : headless{headless}
+    , sceneOptions{sceneOptions}
+{
+    if (!headless)
+        init_sdl();
     init_vulkan();
     init_rt();
-    recreate_swapchain();
+    if (!headless) {
+        recreate_swapchain();
+    } else {
+        swapchainExtent = headlessExtent;
+        frameOverlap = FRAME_OVERLAP;
+    }
     recreate_camera();
     init_commands();
     init_sync_structures();
+    init_profiler();
     recreate_draw_data();
     load_meshes(gltfPath);
     load_background();
     // create_lights();
-    create_as();
+    {
+        GpuProfiler::Section section{profiler.get(), "AS build", graphicsQueueFamilyIndex};
+        create_as();
+    }
     init_descriptors();
     init_pipelines();
     create_sbt();
-    init_imgui();
+    if (!headless)
+        init_imgui();
     presample();
 
     isInitialized = true;
@@ -47,10 +95,9 @@ void Init::clean()
     if (isInitialized) {
         device.waitIdle();
 
-        ImGui_ImplVulkan_Shutdown();
-        utils::destroy_buffer(allocator, tlas.as.buffer);
-        device.destroyAccelerationStructureKHR(tlas.as.AS);
-        utils::destroy_buffer(allocator, tlas.instancesBuffer);
+        if (!headless)
+            ImGui_ImplVulkan_Shutdown();
+        asBuilder->destroyTLAS(tlas);
         asBuilder->destroy();
 
         gltfLoader->destroy();
@@ -64,17 +111,25 @@ void Init::clean()
 
         // device.destroyPipelineLayout(simpleMeshGraphicsPipeline.pipelineLayout);
         // device.destroyPipeline(simpleMeshGraphicsPipeline.pipeline);
-        rtPipelineBuilder->destroy();
+        // Finish the builds in flight, their results were never used
+        const auto discard = [this](const auto &variant) { destroy_variant(variant); };
+        take_newest(pendingRtPipelines, discard, true);
+        take_newest(pendingComputePipelines, discard, true);
+        pipelineWorker.reset();
+        if (wavefront)
+            wavefront->destroy();
+        if (rayQueryRenderer)
+            rayQueryRenderer->destroy();
+        if (rtPipelineBuilder)
+            rtPipelineBuilder->destroy();
+        pipelineCache->destroy();
         device.destroyPipelineLayout(simpleRtPipeline.pipelineLayout);
-        // device.destroyPipeline(simpleRtPipeline.pipeline);
-        while (!rtPipelineQueue.empty()) {
-            device.destroyPipeline(rtPipelineQueue.front());
-            rtPipelineQueue.pop();
-        }
-        while (!rtSBTBufferQueue.empty()) {
-            utils::destroy_buffer(allocator, rtSBTBufferQueue.front());
-            rtSBTBufferQueue.pop();
+        if (rtPipeline) {
+            device.destroyPipeline(simpleRtPipeline.pipeline);
+            utils::destroy_buffer(allocator, rtSBT.buffer);
         }
+        for (uint32_t i = 0; i < frameOverlap; i++)
+            destroy_retired(i);
 
         device.destroyDescriptorPool(imguiPool);
         descHelperUAB->destroy();
@@ -85,6 +140,8 @@ void Init::clean()
         // Destroy things created in this class from here:
         camera->destroy_camera_buffer();
 
+        uploader->destroy(); // Collects the timestamps of its last batches
+        profiler->destroy(frames);
         device.destroyCommandPool(transferCmdPool);
         device.destroyFence(transferFence);
         for (int i = 0; i < frameOverlap; i++) {
@@ -92,18 +149,22 @@ void Init::clean()
             device.destroyFence(frames[i].renderFence);
             device.destroySemaphore(frames[i].renderSemaphore);
         }
-        utils::destroy_swapchain(device, swapchain, swapchainImages);
-        instance.destroySurfaceKHR(surface);
+        if (!headless) {
+            utils::destroy_swapchain(device, swapchain, swapchainImages);
+            instance.destroySurfaceKHR(surface);
+        }
         utils::destroy_image(device, allocator, backgroundImage);
         for (const auto &f : frames) {
             utils::destroy_image(device, allocator, f.imageDraw);
             utils::destroy_image(device, allocator, f.imageDepth);
         }
+        utils::destroy_image(device, allocator, accumulationImage);
         vmaDestroyAllocator(allocator);
         device.destroy();
         vkb::destroy_debug_utils_messenger(instance, debugMessenger);
         instance.destroy();
-        SDL_DestroyWindow(window);
+        if (!headless)
+            SDL_DestroyWindow(window);
     }
 }
 
@@ -111,13 +172,17 @@ void Init::init_vulkan()
 {
     // Initialize the vulkan instance
     vkb::InstanceBuilder instBuilder;
-    auto instRet = instBuilder.set_app_name(PROJNAME)
-                       .require_api_version(API_VERSION[0], API_VERSION[1], API_VERSION[2])
-                       .request_validation_layers(enableValidationLayers)
-                       .enable_extensions({VK_KHR_GET_SURFACE_CAPABILITIES_2_EXTENSION_NAME,
-                                           VK_EXT_SURFACE_MAINTENANCE_1_EXTENSION_NAME})
-                       .use_default_debug_messenger()
-                       .build();
+    instBuilder.set_app_name(PROJNAME)
+        .require_api_version(API_VERSION[0], API_VERSION[1], API_VERSION[2])
+        .request_validation_layers(enableValidationLayers)
+        .use_default_debug_messenger();
+    // Headless does not load any surface extension, so it also runs without a display server
+    if (headless)
+        instBuilder.set_headless(true);
+    else
+        instBuilder.enable_extensions({VK_KHR_GET_SURFACE_CAPABILITIES_2_EXTENSION_NAME,
+                                       VK_EXT_SURFACE_MAINTENANCE_1_EXTENSION_NAME});
+    auto instRet = instBuilder.build();
 
     vkb::Instance vkbInstance = instRet.value();
 
@@ -126,9 +191,11 @@ void Init::init_vulkan()
     debugMessenger = vkbInstance.debug_messenger;
 
     // Create a surface
-    VkSurfaceKHR cSurface;
-    SDL_Vulkan_CreateSurface(window, instance, nullptr, &cSurface);
-    surface = vk::SurfaceKHR(cSurface);
+    if (!headless) {
+        VkSurfaceKHR cSurface;
+        SDL_Vulkan_CreateSurface(window, instance, nullptr, &cSurface);
+        surface = vk::SurfaceKHR(cSurface);
+    }
 
     // Set the device features that we want
     vk::PhysicalDeviceVulkan13Features features13{};
@@ -150,13 +217,14 @@ void Init::init_vulkan()
     features12.runtimeDescriptorArray = vk::True;
     features12.scalarBlockLayout = vk::True;
     features12.bufferDeviceAddress = vk::True;
+    features12.hostQueryReset = vk::True; // GPU profiler sections
+    features12.timelineSemaphore = vk::True; // Upload manager
 
     // NOT SUPPORTED YET! ENABLE AS IT GETS SUPPORTED
     vk::PhysicalDeviceUnifiedImageLayoutsFeaturesKHR unifiedImageLayoutsFeatures{};
     unifiedImageLayoutsFeatures.setUnifiedImageLayouts(vk::True);
 
-    std::vector<const char *> rtExtensions = {VK_KHR_RAY_TRACING_PIPELINE_EXTENSION_NAME,
-                                              VK_KHR_ACCELERATION_STRUCTURE_EXTENSION_NAME,
+    std::vector<const char *> asExtensions = {VK_KHR_ACCELERATION_STRUCTURE_EXTENSION_NAME,
                                               VK_KHR_DEFERRED_HOST_OPERATIONS_EXTENSION_NAME
                                               /*,VK_KHR_RAY_TRACING_MAINTENANCE_1_EXTENSION_NAME*/};
     vk::PhysicalDeviceAccelerationStructureFeaturesKHR asFeatures{};
@@ -164,6 +232,8 @@ void Init::init_vulkan()
     // asFeatures.setDescriptorBindingAccelerationStructureUpdateAfterBind(vk::True);
     vk::PhysicalDeviceRayTracingPipelineFeaturesKHR rtPipelineFeatures{};
     rtPipelineFeatures.setRayTracingPipeline(vk::True);
+    vk::PhysicalDeviceRayQueryFeaturesKHR rayQueryFeatures{};
+    rayQueryFeatures.setRayQuery(vk::True);
 
     vk::PhysicalDeviceSwapchainMaintenance1FeaturesKHR swapchainMaintenanceFeatures{};
     swapchainMaintenanceFeatures.setSwapchainMaintenance1(vk::True);
@@ -173,30 +243,59 @@ void Init::init_vulkan()
     // vk::PhysicalDeviceRobustness2FeaturesKHR robustnessFeatures{};
     // robustnessFeatures.setRobustBufferAccess2(vk::True);
 
-    // Select a GPU
-    vkb::PhysicalDeviceSelector physDevSelector{vkbInstance};
-
-    auto resSelector = physDevSelector.set_minimum_version(API_VERSION[0], API_VERSION[1])
-                           .set_required_features_13(features13)
-                           .set_required_features_12(features12)
-                           .add_required_extension(VK_EXT_SWAPCHAIN_MAINTENANCE_1_EXTENSION_NAME)
-                           // .add_required_extension(VK_KHR_ROBUSTNESS_2_EXTENSION_NAME)
-                           .add_required_extension(VK_KHR_UNIFIED_IMAGE_LAYOUTS_EXTENSION_NAME)
-                           .add_required_extension_features(unifiedImageLayoutsFeatures)
-                           .add_required_extensions(rtExtensions)
-                           .add_required_extension_features(asFeatures)
-                           .add_required_extension_features(rtPipelineFeatures)
-                           // .set_required_features(pdFeatures)
-                           // .add_required_extension_features(robustnessFeatures)
-                           .add_required_extension_features(swapchainMaintenanceFeatures)
-                           .set_surface(surface)
-                           .select();
-
-    // std::cout << resSelector.error() << std::endl;
+    // Select a GPU. The RT pipeline is preferred, ray queries are enough for the compute backends
+    const auto select_device = [&](const bool withRtPipeline) {
+        vkb::PhysicalDeviceSelector physDevSelector{vkbInstance};
+
+        physDevSelector.set_minimum_version(API_VERSION[0], API_VERSION[1])
+            .set_required_features_13(features13)
+            .set_required_features_12(features12)
+            // .add_required_extension(VK_KHR_ROBUSTNESS_2_EXTENSION_NAME)
+            .add_required_extension(VK_KHR_UNIFIED_IMAGE_LAYOUTS_EXTENSION_NAME)
+            .add_required_extension_features(unifiedImageLayoutsFeatures)
+            .add_required_extensions(asExtensions)
+            .add_required_extension_features(asFeatures);
+        // .set_required_features(pdFeatures)
+        // .add_required_extension_features(robustnessFeatures)
+        if (withRtPipeline)
+            physDevSelector.add_required_extension(VK_KHR_RAY_TRACING_PIPELINE_EXTENSION_NAME)
+                .add_required_extension_features(rtPipelineFeatures);
+        else
+            physDevSelector.add_required_extension(VK_KHR_RAY_QUERY_EXTENSION_NAME)
+                .add_required_extension_features(rayQueryFeatures);
+        if (!headless)
+            physDevSelector.add_required_extension(VK_EXT_SWAPCHAIN_MAINTENANCE_1_EXTENSION_NAME)
+                .add_required_extension_features(swapchainMaintenanceFeatures)
+                .set_surface(surface);
+        return physDevSelector.select();
+    };
+    auto resSelector = select_device(true);
+    rtPipeline = resSelector.has_value();
+    if (!rtPipeline) {
+        std::println("No device with VK_KHR_ray_tracing_pipeline, falling back to ray queries");
+        resSelector = select_device(false);
+        if (!resSelector)
+            throw std::runtime_error("No device with VK_KHR_ray_tracing_pipeline or VK_KHR_ray_query: "
+                                     + resSelector.error().message());
+    }
+
     vkb::PhysicalDevice vkbPhysDev = resSelector.value();
     physicalDevice = vkbPhysDev.physical_device;
     physicalDeviceProperties = vkbPhysDev.properties;
 
+    // Block compressed textures if the device has them
+    VkPhysicalDeviceFeatures bcFeatures{};
+    bcFeatures.textureCompressionBC = VK_TRUE;
+    textureCompressionBC = vkbPhysDev.enable_features_if_present(bcFeatures);
+
+    // Ray queries for the compute backends. Already required without the RT pipeline
+    rayQuery = vkbPhysDev.enable_extension_if_present(VK_KHR_RAY_QUERY_EXTENSION_NAME)
+               && vkbPhysDev.enable_extension_features_if_present(rayQueryFeatures);
+
+    traceStages = vk::PipelineStageFlagBits2::eComputeShader;
+    if (rtPipeline)
+        traceStages |= vk::PipelineStageFlagBits2::eRayTracingShaderKHR;
+
     // Create the vulkan logical device
     vkb::DeviceBuilder deviceBuilder{vkbPhysDev};
     vkb::Device vkbDevice = deviceBuilder.build().value();
@@ -312,6 +411,24 @@ void Init::recreate_draw_data()
                                            depthUsageFlags,
                                            drawExtent);
     }
+
+    // The accumulation image keeps the running average across frames, so there is only one
+    if (accumulationImage.image)
+        utils::destroy_image(device, allocator, accumulationImage);
+
+    accumulationImage = utils::create_image(device,
+                                            allocator,
+                                            frames[0].mainCommandBuffer,
+                                            frames[0].renderFence,
+                                            graphicsQueue,
+                                            vk::Format::eR32G32B32A32Sfloat,
+                                            vk::ImageUsageFlagBits::eStorage
+                                                | vk::ImageUsageFlagBits::eTransferSrc,
+                                            drawExtent);
+
+    // Its streams hold one ray per pixel
+    if (wavefront)
+        wavefront->resize(swapchainExtent);
 }
 
 void Init::recreate_camera()
@@ -357,6 +474,11 @@ void Init::init_commands()
     transferBufferAllocInfo.setCommandBufferCount(1);
     transferBufferAllocInfo.setLevel(vk::CommandBufferLevel::ePrimary);
     cmdTransfer = device.allocateCommandBuffers(transferBufferAllocInfo)[0];
+
+    uploader = std::make_unique<UploadManager>(device,
+                                               allocator,
+                                               transferQueueFamilyIndex,
+                                               graphicsQueueFamilyIndex);
 }
 
 void Init::init_sync_structures()
@@ -375,17 +497,29 @@ void Init::init_sync_structures()
     transferFence = device.createFence(fenceCreateInfo);
 }
 
+void Init::init_profiler()
+{
+    profiler = std::make_unique<GpuProfiler>(device,
+                                             physicalDevice,
+                                             physicalDeviceProperties.limits.timestampPeriod);
+    profiler->create_frame_pools(frames, graphicsQueueFamilyIndex);
+    uploader->profiler = profiler.get();
+}
+
 void Init::init_descriptors()
 {
+    // Every binding is also read by the compute backends. The ray tracing stages need rtPipeline
+    const auto stages = [this](const vk::ShaderStageFlags rtStages) {
+        return (rtPipeline ? rtStages : vk::ShaderStageFlags{}) | vk::ShaderStageFlagBits::eCompute;
+    };
+
     descHelperUAB = std::make_unique<DescHelper>(device,
                                                  physicalDeviceProperties,
                                                  asProperties,
                                                  true);
     descHelperUAB
-        ->add_descriptor_set(vk::DescriptorPoolSize{vk::DescriptorType::eUniformBuffer,
-                                                    static_cast<uint32_t>(
-                                                        scene->surfaceUniformBuffers.size())},
-                             frameOverlap); // per-surface storage
+        ->add_descriptor_set(vk::DescriptorPoolSize{vk::DescriptorType::eStorageBuffer, 1},
+                             frameOverlap); // surface storage
     descHelperUAB->add_descriptor_set(vk::DescriptorPoolSize{vk::DescriptorType::eSampler,
                                                              static_cast<uint32_t>(
                                                                  scene->samplers.size())},
@@ -394,28 +528,32 @@ void Init::init_descriptors()
                                                              static_cast<uint32_t>(
                                                                  scene->images.size())},
                                       frameOverlap); // images to sample
-    descHelperUAB->add_descriptor_set(vk::DescriptorPoolSize{vk::DescriptorType::eUniformBuffer,
-                                                             MAX_LIGHTS},
+    descHelperUAB->add_descriptor_set(vk::DescriptorPoolSize{vk::DescriptorType::eStorageBuffer, 1},
                                       frameOverlap); // Lights
+    descHelperUAB->add_descriptor_set(vk::DescriptorPoolSize{vk::DescriptorType::eStorageBuffer, 1},
+                                      frameOverlap); // material table
     descHelperUAB->create_descriptor_pool();
-    descHelperUAB->add_binding(
-        Binding{vk::DescriptorType::eUniformBuffer,
-                vk::ShaderStageFlagBits::eClosestHitKHR,
-                0,
-                static_cast<uint32_t>(scene->surfaceUniformBuffers.size())}); // per-surface storage
+    descHelperUAB->add_binding(Binding{vk::DescriptorType::eStorageBuffer,
+                                       stages(vk::ShaderStageFlagBits::eClosestHitKHR),
+                                       0,
+                                       1}); // surface storage
     descHelperUAB->add_binding(Binding{vk::DescriptorType::eSampler,
-                                       vk::ShaderStageFlagBits::eClosestHitKHR,
+                                       stages(vk::ShaderStageFlagBits::eClosestHitKHR),
                                        1,
                                        static_cast<uint32_t>(scene->samplers.size())}); // samplers
-    descHelperUAB->add_binding(
-        Binding{vk::DescriptorType::eSampledImage,
-                vk::ShaderStageFlagBits::eClosestHitKHR,
-                2,
-                static_cast<uint32_t>(scene->images.size())}); // sampled images
-    descHelperUAB->add_binding(Binding{vk::DescriptorType::eUniformBuffer,
-                                       vk::ShaderStageFlagBits::eClosestHitKHR,
+    descHelperUAB->add_binding(Binding{vk::DescriptorType::eSampledImage,
+                                       stages(vk::ShaderStageFlagBits::eClosestHitKHR),
+                                       2,
+                                       static_cast<uint32_t>(
+                                           scene->images.size())}); // sampled images
+    descHelperUAB->add_binding(Binding{vk::DescriptorType::eStorageBuffer,
+                                       stages(vk::ShaderStageFlagBits::eClosestHitKHR),
                                        3,
-                                       MAX_LIGHTS}); // lights
+                                       1}); // lights and their alias table
+    descHelperUAB->add_binding(Binding{vk::DescriptorType::eStorageBuffer,
+                                       stages(vk::ShaderStageFlagBits::eClosestHitKHR),
+                                       4,
+                                       1}); // material table
     descriptorSetLayoutUAB = descHelperUAB->create_descriptor_set_layout();
     std::vector<vk::DescriptorSet> setsUAB
         = descHelperUAB->allocate_descriptor_sets(descriptorSetLayoutUAB, frameOverlap);
@@ -443,26 +581,31 @@ void Init::init_descriptors()
     descHelperRt
         ->add_descriptor_set(vk::DescriptorPoolSize{vk::DescriptorType::eCombinedImageSampler, 1},
                              frameOverlap); // Env map
+    descHelperRt->add_descriptor_set(vk::DescriptorPoolSize{vk::DescriptorType::eStorageImage, 1},
+                                     frameOverlap); // accumulation image
     descHelperRt->create_descriptor_pool();
-    descHelperRt->add_binding(
-        Binding{vk::DescriptorType::eAccelerationStructureKHR,
-                vk::ShaderStageFlagBits::eRaygenKHR | vk::ShaderStageFlagBits::eClosestHitKHR,
-                0}); // tlas
+    descHelperRt->add_binding(Binding{vk::DescriptorType::eAccelerationStructureKHR,
+                                      stages(vk::ShaderStageFlagBits::eRaygenKHR
+                                             | vk::ShaderStageFlagBits::eClosestHitKHR),
+                                      0}); // tlas
     descHelperRt->add_binding(Binding{vk::DescriptorType::eStorageImage,
-                                      vk::ShaderStageFlagBits::eRaygenKHR,
+                                      stages(vk::ShaderStageFlagBits::eRaygenKHR),
                                       1}); // drawImage
     descHelperRt->add_binding(Binding{vk::DescriptorType::eUniformBuffer,
-                                      vk::ShaderStageFlagBits::eRaygenKHR,
+                                      stages(vk::ShaderStageFlagBits::eRaygenKHR),
                                       2}); // camera
     descHelperRt->add_binding(Binding{vk::DescriptorType::eCombinedImageSampler,
-                                      vk::ShaderStageFlagBits::eClosestHitKHR,
+                                      stages(vk::ShaderStageFlagBits::eClosestHitKHR),
                                       3}); // presampling hemisphere
     descHelperRt->add_binding(Binding{vk::DescriptorType::eCombinedImageSampler,
-                                      vk::ShaderStageFlagBits::eClosestHitKHR,
+                                      stages(vk::ShaderStageFlagBits::eClosestHitKHR),
                                       4}); // presampling ggx
     descHelperRt->add_binding(Binding{vk::DescriptorType::eCombinedImageSampler,
-                                      vk::ShaderStageFlagBits::eMissKHR,
+                                      stages(vk::ShaderStageFlagBits::eMissKHR),
                                       5}); // Env map
+    descHelperRt->add_binding(Binding{vk::DescriptorType::eStorageImage,
+                                      stages(vk::ShaderStageFlagBits::eRaygenKHR),
+                                      6}); // accumulation image
 
     rtDescriptorSetLayout = descHelperRt->create_descriptor_set_layout();
     std::vector<vk::DescriptorSet> setsRt
@@ -473,47 +616,154 @@ void Init::init_descriptors()
 
 void Init::init_pipelines()
 {
-    rtPipelineBuilder = std::make_unique<RtPipelineBuilder>(device);
-    rtPipelineBuilder->create_shader_stages();
-    rtPipelineBuilder->create_shader_groups();
+    pipelineCache = std::make_unique<PipelineCache>(device, physicalDeviceProperties);
+    pipelineWorker = std::make_unique<ThreadPool>(1);
     std::vector<vk::DescriptorSetLayout> descLayouts = {rtDescriptorSetLayout,
                                                         descriptorSetLayoutUAB};
-    simpleRtPipeline.pipelineLayout = rtPipelineBuilder->buildPipelineLayout(descLayouts);
-    simpleRtPipeline.pipeline = rtPipelineBuilder->buildPipeline(simpleRtPipeline.pipelineLayout);
-    rtPipelineQueue.push(simpleRtPipeline.pipeline);
+    if (rtPipeline) {
+        rtPipelineBuilder = std::make_unique<RtPipelineBuilder>(device, pipelineCache->cache);
+        rtPipelineBuilder->create_shader_stages();
+        rtPipelineBuilder->create_shader_groups();
+        simpleRtPipeline.pipelineLayout = rtPipelineBuilder->buildPipelineLayout(descLayouts);
+        simpleRtPipeline.pipeline = rtPipelineBuilder->buildPipeline(
+            simpleRtPipeline.pipelineLayout);
+    }
+
+    if (rayQuery) {
+        wavefront = std::make_unique<WavefrontRenderer>(device,
+                                                        allocator,
+                                                        pipelineCache->cache,
+                                                        descLayouts);
+        wavefront->build_pipelines();
+        wavefront->resize(swapchainExtent);
+        rayQueryRenderer = std::make_unique<RayQueryRenderer>(device,
+                                                              pipelineCache->cache,
+                                                              descLayouts);
+        rayQueryRenderer->build_pipeline();
+    }
+}
+
+void Init::check_recursion_depth(const SpecializationConstantsClosestHit &constantsCH) const
+{
+    if (!rtPipeline)
+        throw std::runtime_error("The RT pipeline needs VK_KHR_ray_tracing_pipeline");
+    if (rtProperties.maxRayRecursionDepth < constantsCH.recursionDepth)
+        throw std::runtime_error("Driver recursion depth not enough. Driver: "
+                                 + std::to_string(rtProperties.maxRayRecursionDepth)
+                                 + ". Required: " + std::to_string(constantsCH.recursionDepth + 1));
+}
+
+void Init::set_rt_pipeline(const vk::Pipeline &pipeline,
+                           const ShaderBindingTable &sbt,
+                           const uint32_t frameIndex)
+{
+    retire(frameIndex, {simpleRtPipeline.pipeline}, {rtSBT.buffer});
+    simpleRtPipeline.pipeline = pipeline;
+    rtSBT = sbt;
+}
+
+void Init::retire(const uint32_t frameIndex,
+                  const std::vector<vk::Pipeline> &pipelines,
+                  const std::vector<Buffer> &buffers)
+{
+    FrameData &lastUser = frames[(frameIndex + frameOverlap - 1) % frameOverlap];
+    lastUser.retiredPipelines.insert(lastUser.retiredPipelines.end(),
+                                     pipelines.begin(),
+                                     pipelines.end());
+    lastUser.retiredBuffers.insert(lastUser.retiredBuffers.end(), buffers.begin(), buffers.end());
+}
+
+void Init::destroy_retired(const uint32_t frameIndex)
+{
+    FrameData &frame = frames[frameIndex];
+    for (const vk::Pipeline &pipeline : frame.retiredPipelines)
+        device.destroyPipeline(pipeline);
+    for (const Buffer &buffer : frame.retiredBuffers)
+        utils::destroy_buffer(allocator, buffer);
+    frame.retiredPipelines.clear();
+    frame.retiredBuffers.clear();
 }
 
 void Init::rebuid_rt_pipeline(const SpecializationConstantsClosestHit &constantsCH,
-                              const SpecializationConstantsMiss &constantsMiss)
+                              const SpecializationConstantsMiss &constantsMiss,
+                              const uint32_t frameIndex)
 {
+    check_recursion_depth(constantsCH);
     vk::Pipeline newPipeline = rtPipelineBuilder->buildPipeline(simpleRtPipeline.pipelineLayout,
                                                                 constantsCH,
                                                                 constantsMiss);
-    simpleRtPipeline.pipeline = newPipeline;
-    rtSBTBuffer = sbtHelper->create_shader_binding_table(newPipeline);
-    rtPipelineQueue.push(newPipeline);
-    rtSBTBufferQueue.push(rtSBTBuffer);
-    assert(rtPipelineQueue.size() == rtSBTBufferQueue.size());
-    if (rtPipelineQueue.size() > 2) {
-        vk::Pipeline pipelineToDestroy = rtPipelineQueue.front();
-        Buffer bufferToDestroy = rtSBTBufferQueue.front();
-        device.destroyPipeline(pipelineToDestroy);
-        utils::destroy_buffer(allocator, bufferToDestroy);
-        rtPipelineQueue.pop();
-        rtSBTBufferQueue.pop();
-    }
+    set_rt_pipeline(newPipeline, sbtHelper->create_shader_binding_table(newPipeline), frameIndex);
+}
 
-    if (rtProperties.maxRayRecursionDepth < constantsCH.recursionDepth)
-        throw std::runtime_error("Driver recursion depth not enough. Driver: "
-                                 + std::to_string(rtProperties.maxRayRecursionDepth)
-                                 + ". Required: " + std::to_string(constantsCH.recursionDepth + 1));
+void Init::request_rt_pipeline(const SpecializationConstantsClosestHit &constantsCH,
+                               const SpecializationConstantsMiss &constantsMiss)
+{
+    check_recursion_depth(constantsCH);
+    // The builder, the layout and the SBT helper outlive the worker, which clean() drains first
+    pendingRtPipelines.push(pipelineWorker->submit([this, constantsCH, constantsMiss]() {
+        vk::Pipeline pipeline = rtPipelineBuilder->buildPipeline(simpleRtPipeline.pipelineLayout,
+                                                                 constantsCH,
+                                                                 constantsMiss);
+        return RtPipelineVariant{pipeline, sbtHelper->create_shader_binding_table(pipeline)};
+    }));
+}
+
+bool Init::swap_rt_pipeline(const uint32_t frameIndex)
+{
+    const std::optional<RtPipelineVariant> newest = take_newest(
+        pendingRtPipelines, [this](const RtPipelineVariant &v) { destroy_variant(v); });
+    if (!newest)
+        return false;
+    set_rt_pipeline(newest->first, newest->second, frameIndex);
+    return true;
+}
+
+void Init::request_compute_pipelines(const SpecializationConstantsClosestHit &constantsCH,
+                                     const SpecializationConstantsMiss &constantsMiss)
+{
+    // Same worker as the RT pipeline, which clean() drains before destroying the renderers
+    pendingComputePipelines.push(pipelineWorker->submit([this, constantsCH, constantsMiss]() {
+        return ComputePipelineVariant{wavefront->create_pipelines(constantsCH, constantsMiss),
+                                      rayQueryRenderer->create_pipeline(constantsCH,
+                                                                        constantsMiss)};
+    }));
+}
+
+bool Init::swap_compute_pipelines(const uint32_t frameIndex)
+{
+    const std::optional<ComputePipelineVariant> newest = take_newest(
+        pendingComputePipelines, [this](const ComputePipelineVariant &v) { destroy_variant(v); });
+    if (!newest)
+        return false;
+    const WavefrontRenderer::Pipelines old = wavefront->set_pipelines(newest->first);
+    std::vector<vk::Pipeline> retired(old.begin(), old.end());
+    retired.push_back(rayQueryRenderer->set_pipeline(newest->second));
+    retire(frameIndex, retired);
+    return true;
+}
+
+void Init::destroy_variant(const RtPipelineVariant &variant)
+{
+    device.destroyPipeline(variant.first);
+    utils::destroy_buffer(allocator, variant.second.buffer);
+}
+
+void Init::destroy_variant(const ComputePipelineVariant &variant)
+{
+    for (const vk::Pipeline &pipeline : variant.first)
+        device.destroyPipeline(pipeline);
+    device.destroyPipeline(variant.second);
 }
 
 void Init::create_sbt()
 {
-    sbtHelper = std::make_unique<SbtHelper>(device, allocator, rtProperties);
-    rtSBTBuffer = sbtHelper->create_shader_binding_table(simpleRtPipeline.pipeline);
-    rtSBTBufferQueue.push(rtSBTBuffer);
+    if (!rtPipeline)
+        return;
+    sbtHelper = std::make_unique<SbtHelper>(device,
+                                            allocator,
+                                            rtProperties,
+                                            scene->surfaceClasses);
+    rtSBT = sbtHelper->create_shader_binding_table(simpleRtPipeline.pipeline);
 }
 
 void Init::init_imgui()
@@ -571,9 +821,13 @@ void Init::init_imgui()
 
 void Init::init_rt()
 {
-    rtProperties.pNext = &asProperties;
     vk::PhysicalDeviceProperties2 physDevProp2{};
-    physDevProp2.pNext = &rtProperties;
+    physDevProp2.pNext = &asProperties;
+    // Left zeroed without the extension
+    if (rtPipeline) {
+        rtProperties.pNext = &asProperties;
+        physDevProp2.pNext = &rtProperties;
+    }
     physicalDevice.getProperties2(&physDevProp2);
 }
 
@@ -589,10 +843,16 @@ void Init::presample()
 
 void Init::load_meshes(const std::filesystem::path &gltfPath)
 {
-    gltfLoader = std::make_unique<GLTFLoader>(device, allocator, transferQueueFamilyIndex);
+    gltfLoader = std::make_unique<GLTFLoader>(device, allocator, *uploader);
+    gltfLoader->bcTextures = textureCompressionBC;
+    gltfLoader->compactVertices = sceneOptions.compactVertices;
+    gltfLoader->compressTextures = sceneOptions.compressTextures;
+    gltfLoader->dedupTranslatedMeshes = sceneOptions.dedupTranslatedMeshes;
     // scene = gltfLoader->load_gltf_asset("/home/jordi/Documents/lrt/assets/CornellBox-Original.gltf")
     //             .value();
     scene = gltfLoader->load_gltf_asset(gltfPath).value();
+    // Single host wait for the whole scene, the BLAS builds read its buffers
+    uploader->flush_and_wait();
     std::println("Asset loaded");
 
     // glm::mat4 S = glm::scale(1.f * glm::vec3(1.f));
@@ -611,15 +871,14 @@ void Init::load_background(const std::filesystem::path &imPath)
     imSize.setHeight(h);
     imSize.setDepth(1);
 
-    backgroundImage = utils::create_image(device,
-                                          allocator,
-                                          cmdTransfer,
-                                          transferFence,
-                                          transferQueue,
-                                          vk::Format::eR8G8B8A8Unorm,
-                                          vk::ImageUsageFlagBits::eSampled,
-                                          imSize,
-                                          imData);
+    backgroundImage = utils::allocate_image(device,
+                                            allocator,
+                                            vk::Format::eR8G8B8A8Unorm,
+                                            vk::ImageUsageFlagBits::eSampled
+                                                | vk::ImageUsageFlagBits::eTransferDst,
+                                            imSize);
+    uploader->upload_image(backgroundImage, imData, vk::DeviceSize{imSize.width} * imSize.height * 4);
+    uploader->flush_and_wait();
 
     vk::SamplerCreateInfo samplerCreate{};
     samplerCreate.setMaxLod(vk::LodClampNone);
@@ -645,6 +904,8 @@ void Init::create_as()
     asBuilder = std::make_unique<ASBuilder>(device,
                                             allocator,
                                             graphicsQueueFamilyIndex,
-                                            asProperties);
-    tlas = asBuilder->buildTLAS(scene);
+                                            asProperties,
+                                            *uploader);
+    asBuilder->compaction = sceneOptions.compactBLAS;
+    tlas = asBuilder->buildTLAS(scene, frameOverlap);
 }
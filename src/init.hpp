@@ -10,11 +10,18 @@ import vulkan;
 #include "descriptors.hpp"
 #include "lights.hpp"
 #include "loader.hpp"
+#include "pipeline_cache.hpp"
 #include "presampling.hpp"
+#include "profiler.hpp"
+#include "ray_query.hpp"
 #include "rt_pipelines.hpp"
 #include "shader_binding_tables.hpp"
+#include "thread_pool.hpp"
 #include "types.hpp"
+#include "upload_manager.hpp"
+#include "wavefront.hpp"
 #include <SDL3/SDL.h>
+#include <future>
 #include <memory>
 #include <queue>
 #include <vk_mem_alloc.h>
@@ -22,8 +29,12 @@ import vulkan;
 class Init
 {
 public:
-    // Initializes everything in the engine
-    Init(const std::filesystem::path &gltfPath);
+    // Initializes everything in the engine. Headless skips the window, the swapchain and imgui
+    // and renders at a fixed extent
+    Init(const std::filesystem::path &gltfPath,
+         const bool headless = false,
+         const vk::Extent2D &headlessExtent = {W, H},
+         const SceneOptions &sceneOptions = {});
     ~Init() = default;
 
     // Shuts down the engine
@@ -35,6 +46,8 @@ public:
     void recreate_draw_data();
 
     SDL_Window *window{nullptr};
+    const bool headless;
+    const SceneOptions sceneOptions;
 
     // Strucutres gotten at init time
     vk::Instance instance;
@@ -44,6 +57,11 @@ public:
     vk::SurfaceKHR surface;
     VmaAllocator allocator;
     vk::PhysicalDeviceProperties physicalDeviceProperties;
+    bool textureCompressionBC{false}; // Optional feature, enabled if present
+    bool rayQuery{false};             // Same, required by the compute backends
+    bool rtPipeline{false}; // VK_KHR_ray_tracing_pipeline. Without it only the compute backends run
+    // Shader stages that read the TLAS and the scene: compute, plus ray tracing with rtPipeline
+    vk::PipelineStageFlags2 traceStages;
 
     // Commands data
     std::vector<FrameData> frames;
@@ -56,7 +74,10 @@ public:
     vk::CommandPool transferCmdPool;
     vk::CommandBuffer cmdTransfer;
 
-    // Swapchain structures and functions
+    // Staging ring on the transfer queue for every scene upload
+    std::unique_ptr<UploadManager> uploader;
+
+    // Swapchain structures and functions. In headless mode swapchainExtent is the render extent
     vk::SwapchainKHR swapchain;
     vk::Format swapchainImageFormat;
     vk::Extent2D swapchainExtent;
@@ -73,10 +94,16 @@ public:
     // Pipelines
     SimplePipelineData simpleRtPipeline;
     std::unique_ptr<RtPipelineBuilder> rtPipelineBuilder;
+    std::unique_ptr<PipelineCache> pipelineCache;
+    std::unique_ptr<WavefrontRenderer> wavefront; // Null without ray queries
+    std::unique_ptr<RayQueryRenderer> rayQueryRenderer; // Same
 
     // Envmap
     ImageData backgroundImage;
 
+    // Progressive accumulation target, shared by all the frames in flight
+    ImageData accumulationImage;
+
     // Imgui
     vk::DescriptorPool imguiPool;
 
@@ -84,19 +111,46 @@ public:
     vk::PhysicalDeviceRayTracingPipelinePropertiesKHR rtProperties{};
     vk::PhysicalDeviceAccelerationStructurePropertiesKHR asProperties{};
     TopLevelAS tlas;
-    Buffer rtSBTBuffer;
+    ShaderBindingTable rtSBT; // Always the one of simpleRtPipeline.pipeline
     std::unique_ptr<SbtHelper> sbtHelper;
     std::unique_ptr<ASBuilder> asBuilder;
     std::unique_ptr<Presampler> presampler;
 
+    // GPU timestamps
+    std::unique_ptr<GpuProfiler> profiler;
+
     // Meshes
     std::unique_ptr<GLTFLoader> gltfLoader;
     std::shared_ptr<GLTFObj> scene;
 
     bool isInitialized{false};
 
+    // Builds the variant and its SBT and swaps them in right away, before recording frameIndex.
+    // Only with rtPipeline
     void rebuid_rt_pipeline(const SpecializationConstantsClosestHit &constantsCH,
-                            const SpecializationConstantsMiss &constantsMiss);
+                            const SpecializationConstantsMiss &constantsMiss,
+                            const uint32_t frameIndex);
+
+    // Same, but compiled on the pipeline worker. The current pipeline keeps rendering meanwhile
+    void request_rt_pipeline(const SpecializationConstantsClosestHit &constantsCH,
+                             const SpecializationConstantsMiss &constantsMiss);
+    // Swaps in the newest finished request before recording frameIndex, and destroys the older
+    // ones, which were never bound. True if anything changed
+    bool swap_rt_pipeline(const uint32_t frameIndex);
+
+    // Same for the wavefront and ray query pipelines, compiled together. Only with rayQuery
+    void request_compute_pipelines(const SpecializationConstantsClosestHit &constantsCH,
+                                   const SpecializationConstantsMiss &constantsMiss);
+    bool swap_compute_pipelines(const uint32_t frameIndex);
+
+    // Hands over pipelines and buffers that the frames in flight may still use. They go with the
+    // frame recorded before frameIndex, the last one that can use them, and are destroyed after
+    // its fence
+    void retire(const uint32_t frameIndex,
+                const std::vector<vk::Pipeline> &pipelines,
+                const std::vector<Buffer> &buffers = {});
+    // Destroys what was retired with a frame. Call it right after waiting for its fence
+    void destroy_retired(const uint32_t frameIndex);
 
     void load_background(const std::filesystem::path &imPath = std::filesystem::path(
                              std::string(PROJECT_DIR)
@@ -110,6 +164,7 @@ private:
     void presample();
     void init_commands();
     void init_sync_structures();
+    void init_profiler();
     void init_descriptors();
     void init_pipelines();
     void create_sbt();
@@ -117,6 +172,18 @@ private:
     void load_meshes(const std::filesystem::path &gltfPath);
     void create_as();
 
-    std::queue<vk::Pipeline> rtPipelineQueue;
-    std::queue<Buffer> rtSBTBufferQueue;
+    void check_recursion_depth(const SpecializationConstantsClosestHit &constantsCH) const;
+    // Makes the pipeline and its SBT current, and retires the previous ones
+    void set_rt_pipeline(const vk::Pipeline &pipeline,
+                         const ShaderBindingTable &sbt,
+                         const uint32_t frameIndex);
+
+    using RtPipelineVariant = std::pair<vk::Pipeline, ShaderBindingTable>;
+    using ComputePipelineVariant = std::pair<WavefrontRenderer::Pipelines, vk::Pipeline>;
+    std::unique_ptr<ThreadPool> pipelineWorker;
+    std::queue<std::future<RtPipelineVariant>> pendingRtPipelines;
+    std::queue<std::future<ComputePipelineVariant>> pendingComputePipelines;
+
+    void destroy_variant(const RtPipelineVariant &variant);
+    void destroy_variant(const ComputePipelineVariant &variant);
 };
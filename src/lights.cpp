@@ -1,54 +1,126 @@
 #include "lights.hpp"
 #include "imgui.h"
 #include "utils.hpp"
+#include <algorithm>
 #include <glm/gtc/type_ptr.hpp>
 #include <glm/gtx/norm.hpp>
 
 uint32_t Light::nextId = 0;
 
-void Light::upload(const vk::Device &device, const VmaAllocator &allocator)
+LightsManager::LightsManager(const vk::Device &device,
+                             const VmaAllocator &allocator,
+                             const uint32_t frameOverlap)
+    : device{device}
+    , allocator{allocator}
+    , bufferVersions(frameOverlap, 0)
+    , capacities(frameOverlap, LIGHT_BUFFER_CAPACITY)
 {
-    if (!ubo.buffer) {
-        ubo = utils::create_buffer(device,
-                                   allocator,
-                                   sizeof(Light::LightData),
-                                   vk::BufferUsageFlagBits::eUniformBuffer,
-                                   VMA_MEMORY_USAGE_AUTO,
-                                   VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT
-                                       | VMA_ALLOCATION_CREATE_MAPPED_BIT);
-        utils::copy_to_buffer(ubo, allocator, &lightData);
+    for (uint32_t f = 0; f < frameOverlap; f++)
+        buffers.push_back(create_buffer(LIGHT_BUFFER_CAPACITY));
+}
+
+Buffer LightsManager::create_buffer(const size_t capacity) const
+{
+    return utils::create_buffer(device,
+                                allocator,
+                                capacity * sizeof(LightEntry),
+                                vk::BufferUsageFlagBits::eStorageBuffer,
+                                VMA_MEMORY_USAGE_AUTO,
+                                VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT
+                                    | VMA_ALLOCATION_CREATE_MAPPED_BIT);
+}
+
+void LightsManager::build_table()
+{
+    const size_t n = lights.size();
+    entries.resize(n);
+    version++;
+    if (n == 0)
+        return;
+
+    // Power estimate: the intensity of point lights and the illuminance of directional ones, i.e.
+    // their contribution one unit away, weighted by the luminance of their color
+    std::vector<float> weights(n);
+    float total = 0.f;
+    for (size_t i = 0; i < n; i++) {
+        const Light::LightData &data = lights[i].lightData;
+        weights[i] = data.intensity * glm::dot(data.color, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+        total += weights[i];
+    }
+
+    std::vector<float> scaled(n);
+    std::vector<uint32_t> small, large;
+    for (size_t i = 0; i < n; i++) {
+        LightEntry &entry = entries[i];
+        entry.light = lights[i].lightData;
+        if (entry.light.type == LightType::eDirectional
+            && glm::length2(entry.light.positionOrDirection) > 0.f)
+            entry.light.positionOrDirection = glm::normalize(entry.light.positionOrDirection);
+        // All black: uniform, none of them contributes anyway
+        entry.pdf = (total > 0.f) ? weights[i] / total : 1.f / n;
+        scaled[i] = entry.pdf * n;
+        (scaled[i] < 1.f ? small : large).push_back(static_cast<uint32_t>(i));
     }
 
-    this->allocator = allocator;
+    // Vose: every underfull bin is topped up by a light with more than its share
+    while (!small.empty() && !large.empty()) {
+        const uint32_t s = small.back();
+        small.pop_back();
+        const uint32_t l = large.back();
+        entries[s].aliasProbability = scaled[s];
+        entries[s].alias = l;
+        scaled[l] -= 1.f - scaled[s];
+        if (scaled[l] < 1.f) {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+    // The rest are full up to rounding errors
+    small.insert(small.end(), large.begin(), large.end());
+    for (const uint32_t i : small) {
+        entries[i].aliasProbability = 1.f;
+        entries[i].alias = i;
+    }
 }
 
-void Light::update()
+bool LightsManager::upload(const uint32_t frameIndex)
 {
-    LightData uploadData{lightData};
-    assert(ubo.buffer && allocator);
-    if (lightData.type == LightType::eDirectional
-        && glm::length2(lightData.positionOrDirection) > 0.f)
-        uploadData.positionOrDirection = glm::normalize(lightData.positionOrDirection);
-    utils::copy_to_buffer(ubo, allocator, &uploadData);
+    if (bufferVersions[frameIndex] == version)
+        return false;
+    bufferVersions[frameIndex] = version;
+
+    // Geometric growth, so adding lights one by one reallocates a logarithmic number of times
+    bool grown = false;
+    if (entries.size() > capacities[frameIndex]) {
+        utils::destroy_buffer(allocator, buffers[frameIndex]);
+        capacities[frameIndex] = std::max(entries.size(), 2 * capacities[frameIndex]);
+        buffers[frameIndex] = create_buffer(capacities[frameIndex]);
+        grown = true;
+    }
+    if (!entries.empty())
+        utils::copy_to_buffer(buffers[frameIndex],
+                              allocator,
+                              entries.data(),
+                              entries.size() * sizeof(LightEntry));
+    return grown;
 }
 
-void Light::destroy()
+void LightsManager::destroy()
 {
-    assert(allocator);
-    if (ubo.buffer)
-        utils::destroy_buffer(allocator, ubo);
+    for (const Buffer &buffer : buffers)
+        utils::destroy_buffer(allocator, buffer);
+    buffers.clear();
 }
 
-void LightsManager::run()
+bool LightsManager::run()
 {
+    bool changed{false};
+
     ImGui::Begin("Lights Manager");
 
-    if (ImGui::Button("Add Light") && lights.size() < static_cast<size_t>(MAX_LIGHTS)) {
-        // positionOrDirection = {0.f, 0.f, 0.f};
-        Light light{};
-        light.upload(device, allocator);
-        lights.push_back(light);
-        lightBuffers.push_back(light.ubo);
+    if (ImGui::Button("Add Light")) {
+        lights.push_back(Light{});
+        changed = true;
     }
 
     ImGui::Separator();
@@ -99,7 +171,7 @@ void LightsManager::run()
                 lights[i].lightData.intensity = defaultLightData.intensity;
             }
             if (update) {
-                lights[i].update();
+                changed = true;
                 // std::println("Update light {}", i);
             }
 
@@ -111,10 +183,22 @@ void LightsManager::run()
     }
 
     if (lightToRemove >= 0) {
-        lights[lightToRemove].destroy();
         lights.erase(std::next(lights.begin(), lightToRemove));
-        lightBuffers.erase(std::next(lightBuffers.begin(), lightToRemove));
+        changed = true;
     }
 
     ImGui::End();
+
+    if (changed)
+        build_table();
+
+    return changed;
+}
+
+void LightsManager::add_light(const Light::LightData &lightData)
+{
+    Light light{};
+    light.lightData = lightData;
+    lights.push_back(light);
+    build_table();
 }
@@ -26,36 +26,58 @@ public:
     {}
     ~Light() = default;
 
-    void upload(const vk::Device &device, const VmaAllocator &allocator);
-    void update();
-    void destroy();
-
     uint32_t id() const { return id_; }
 
     LightData lightData{};
 
-    Buffer ubo{};
-
 private:
     uint32_t id_;
     static uint32_t nextId;
-    VmaAllocator allocator;
 };
 
+// Mirrors LightEntry in types.glsl. Bin i of the alias table is stored with light i
+struct LightEntry
+{
+    Light::LightData light;
+    float aliasProbability; // Of keeping this bin's light instead of jumping to alias
+    uint32_t alias;
+    float pdf; // Selection probability of this light
+};
+static_assert(sizeof(LightEntry) == 44);
+
+// All the lights in one storage buffer per frame in flight, with no cap on their number. Next event
+// estimation picks them in proportion to their power with an alias table (Vose's method) built here
 class LightsManager
 {
 public:
-    LightsManager(const vk::Device &device, const VmaAllocator &allocator)
-        : device{device}
-        , allocator{allocator}
-    {}
+    LightsManager(const vk::Device &device,
+                  const VmaAllocator &allocator,
+                  const uint32_t frameOverlap);
 
-    void run();
+    // Draws the lights UI. Returns true if any light was added, removed or modified
+    bool run();
+
+    // Adds a light without the UI
+    void add_light(const Light::LightData &lightData);
+
+    // Writes the lights into the buffer of a frame that the GPU no longer reads. Returns true if the
+    // buffer grew, and the descriptor of the frame has to point to the new one
+    bool upload(const uint32_t frameIndex);
+
+    void destroy();
 
     std::vector<Light> lights;
-    std::vector<Buffer> lightBuffers;
+    std::vector<Buffer> buffers; // One per frame in flight
 
 private:
     const vk::Device &device;
     const VmaAllocator &allocator;
+
+    std::vector<LightEntry> entries; // Host copy of the buffer contents
+    uint64_t version{0};             // Of entries, bumped on every change
+    std::vector<uint64_t> bufferVersions;
+    std::vector<size_t> capacities;
+
+    void build_table();
+    Buffer create_buffer(const size_t capacity) const;
 };
@@ -1,42 +1,31 @@
 #include "loader.hpp"
+#include "mesh_processing.hpp"
 #include "utils.hpp"
 #include <fastgltf/glm_element_traits.hpp>
 #include <fastgltf/math.hpp>
 #include <fastgltf/tools.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/packing.hpp>
+#include <glm/gtc/quaternion.hpp>
 #include <glm/gtc/type_ptr.hpp>
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <future>
 #include <print>
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
 GLTFLoader::GLTFLoader(const vk::Device &device,
                        const VmaAllocator &allocator,
-                       const uint32_t queueFamilyIndex)
+                       UploadManager &uploader)
     : device{device}
     , allocator{allocator}
+    , uploader{uploader}
 {
-    // Create pool
-    vk::CommandPoolCreateInfo commandPoolCreateInfo{};
-    commandPoolCreateInfo.setFlags(vk::CommandPoolCreateFlagBits::eResetCommandBuffer);
-    commandPoolCreateInfo.setQueueFamilyIndex(queueFamilyIndex);
-    gltfCmdPool = device.createCommandPool(commandPoolCreateInfo);
-
-    // Get queue
-    vk::DeviceQueueInfo2 queueInfo{};
-    queueInfo.setQueueFamilyIndex(queueFamilyIndex);
-    queueInfo.setQueueIndex(0); // Why can't I use index 1?
-    queue = device.getQueue2(queueInfo);
-
-    // Create command buffer
-    vk::CommandBufferAllocateInfo cmdBufferAllocInfo{};
-    cmdBufferAllocInfo.setCommandPool(gltfCmdPool);
-    cmdBufferAllocInfo.setCommandBufferCount(1);
-    cmdBufferAllocInfo.setLevel(vk::CommandBufferLevel::ePrimary);
-    gltfCmd = device.allocateCommandBuffers(cmdBufferAllocInfo)[0];
-
-    // Create fence
-    vk::FenceCreateInfo fenceCreateInfo{};
-    fenceCreateInfo.setFlags(vk::FenceCreateFlagBits::eSignaled);
-    gltfFence = device.createFence(fenceCreateInfo);
+    // Image decoding workers
+    threadPool = std::make_unique<ThreadPool>();
 
     // Create default images for default textures
     uint32_t black = glm::packUnorm4x8(glm::vec4(0, 0, 0, 0));
@@ -50,58 +39,22 @@ GLTFLoader::GLTFLoader(const vk::Device &device,
             pixels[y * 16 + x] = ((x % 2) ^ (y % 2)) ? magenta : black;
         }
     }
-    checkerboardImage = utils::create_image(device,
-                                            allocator,
-                                            gltfCmd,
-                                            gltfFence,
-                                            queue,
-                                            vk::Format::eR8G8B8A8Unorm,
-                                            vk::ImageUsageFlagBits::eSampled
-                                                | vk::ImageUsageFlagBits::eTransferDst,
-                                            vk::Extent3D{16, 16, 1},
-                                            pixels.data());
-
-    whiteImage = utils::create_image(device,
-                                     allocator,
-                                     gltfCmd,
-                                     gltfFence,
-                                     queue,
-                                     vk::Format::eR8G8B8A8Unorm,
-                                     vk::ImageUsageFlagBits::eSampled
-                                         | vk::ImageUsageFlagBits::eTransferDst,
-                                     vk::Extent3D{1, 1, 1},
-                                     &white);
-
-    greyImage = utils::create_image(device,
-                                    allocator,
-                                    gltfCmd,
-                                    gltfFence,
-                                    queue,
-                                    vk::Format::eR8G8B8A8Unorm,
-                                    vk::ImageUsageFlagBits::eSampled
-                                        | vk::ImageUsageFlagBits::eTransferDst,
-                                    vk::Extent3D{1, 1, 1},
-                                    &grey);
-
-    blackImage = utils::create_image(device,
-                                     allocator,
-                                     gltfCmd,
-                                     gltfFence,
-                                     queue,
-                                     vk::Format::eR8G8B8A8Unorm,
-                                     vk::ImageUsageFlagBits::eSampled
-                                         | vk::ImageUsageFlagBits::eTransferDst,
-                                     vk::Extent3D{1, 1, 1},
-                                     &black);
+    checkerboardImage = create_texture(vk::Extent3D{16, 16, 1}, pixels.data());
+    whiteImage = create_texture(vk::Extent3D{1, 1, 1}, &white);
+    greyImage = create_texture(vk::Extent3D{1, 1, 1}, &grey);
+    blackImage = create_texture(vk::Extent3D{1, 1, 1}, &black);
 
     // Default samplers
     vk::SamplerCreateInfo samplerInfo{};
     samplerInfo.setMagFilter(vk::Filter::eLinear);
     samplerInfo.setMinFilter(vk::Filter::eLinear);
+    samplerInfo.setMipmapMode(vk::SamplerMipmapMode::eLinear);
+    samplerInfo.setMaxLod(vk::LodClampNone);
     samplerLinear = device.createSampler(samplerInfo);
 
     samplerInfo.setMagFilter(vk::Filter::eNearest);
     samplerInfo.setMinFilter(vk::Filter::eNearest);
+    samplerInfo.setMipmapMode(vk::SamplerMipmapMode::eNearest);
     samplerNearest = device.createSampler(samplerInfo);
 }
 
@@ -113,8 +66,53 @@ void GLTFLoader::destroy()
     utils::destroy_image(device, allocator, greyImage);
     device.destroySampler(samplerLinear);
     device.destroySampler(samplerNearest);
-    device.destroyFence(gltfFence);
-    device.destroyCommandPool(gltfCmdPool);
+}
+
+ImageData GLTFLoader::create_texture(const vk::Extent3D &extent, const void *pixels)
+{
+    return create_texture(extent,
+                          vk::Format::eR8G8B8A8Unorm,
+                          pixels,
+                          vk::DeviceSize{extent.width} * extent.height * 4);
+}
+
+ImageData GLTFLoader::create_texture(const vk::Extent3D &extent,
+                                     const vk::Format format,
+                                     const void *data,
+                                     const vk::DeviceSize size,
+                                     const std::span<const vk::DeviceSize> mipOffsets,
+                                     const vk::ComponentMapping &swizzle)
+{
+    const ImageData image = utils::allocate_image(device,
+                                                  allocator,
+                                                  format,
+                                                  vk::ImageUsageFlagBits::eSampled
+                                                      | vk::ImageUsageFlagBits::eTransferDst,
+                                                  extent,
+                                                  std::max<uint32_t>(1, mipOffsets.size()),
+                                                  swizzle);
+    uploader.upload_image(image, data, size, mipOffsets);
+    return image;
+}
+
+// KHR_texture_basisu textures point to their KTX2 image through basisuImageIndex
+static size_t texture_image_index(const fastgltf::Texture &texture)
+{
+    return texture.basisuImageIndex.value_or(texture.imageIndex.value_or(0));
+}
+
+std::vector<TextureEncoding> GLTFLoader::texture_encodings(const fastgltf::Asset &asset) const
+{
+    // Everything is color unless a material samples it as a normal map
+    std::vector<TextureEncoding> encodings(asset.images.size(),
+                                           bcTextures ? TextureEncoding::eBC7
+                                                      : TextureEncoding::eRGBA8);
+    for (const fastgltf::Material &m : asset.materials) {
+        if (m.normalTexture.has_value())
+            encodings[texture_image_index(asset.textures[m.normalTexture->textureIndex])]
+                = bcTextures ? TextureEncoding::eBC5 : TextureEncoding::eRGBA8Normal;
+    }
+    return encodings;
 }
 
 std::optional<std::shared_ptr<GLTFObj>> GLTFLoader::load_gltf_asset(const std::filesystem::path &path)
@@ -123,6 +121,31 @@ std::optional<std::shared_ptr<GLTFObj>> GLTFLoader::load_gltf_asset(const std::f
     const auto pathAbsolute = std::filesystem::canonical(path).string();
     // so no need to assert here anything
     std::println("Loading GLTF asset from {}", pathAbsolute);
+
+    // Unchanged assets are read back from their preprocessed snapshot, without parsing or decoding
+    uint64_t sourceHash = 0;
+    if (useSceneCache) {
+        // Different texture, dedup and vertex layout settings produce different scenes
+        sourceHash = hash_combine(hash_file(path),
+                                  (bcTextures ? 1u : 0u) | (compressTextures ? 2u : 0u)
+                                      | (dedupTranslatedMeshes ? 4u : 0u)
+                                      | (compactVertices ? 8u : 0u));
+        if (std::unique_ptr<SceneCacheReader> reader
+            = SceneCacheReader::open(scene_cache_path(sourceHash), sourceHash)) {
+            std::shared_ptr<GLTFObj> scene = create_scene();
+            try {
+                load_cached_scene(*reader, scene);
+                uploader.flush();
+                std::println("Loaded from the scene cache");
+                return scene;
+            } catch (const std::exception &e) {
+                // Corrupt indices surface as std::out_of_range from the lookups
+                std::println("Scene cache unusable ({}), loading the asset", e.what());
+                uploader.flush_and_wait();
+                scene->destroy(device, allocator);
+            }
+        }
+    }
     auto data = fastgltf::GltfDataBuffer::FromPath(path);
 
     // Load asset and check that there were no issues
@@ -138,7 +161,13 @@ std::optional<std::shared_ptr<GLTFObj>> GLTFLoader::load_gltf_asset(const std::f
     }
 
     // Create the main object which will hold all the gltf data
-    std::shared_ptr<GLTFObj> scene = std::make_shared<GLTFObj>();
+    std::shared_ptr<GLTFObj> scene = create_scene();
+
+    // Everything below is also streamed to the cache
+    if (useSceneCache)
+        cacheWriter = std::make_unique<SceneCacheWriter>(scene_cache_path(sourceHash),
+                                                         sourceHash,
+                                                         collect_dependencies(path));
 
     // Temporal arrays for all the objects to use while creating the GLTF data
     std::vector<std::shared_ptr<Mesh>> meshes;
@@ -162,11 +191,166 @@ std::optional<std::shared_ptr<GLTFObj>> GLTFLoader::load_gltf_asset(const std::f
     // Load nodes and their meshes
     load_nodes(asset.get(), meshes, scene, nodes);
 
+    // Submit the remaining copies. Users wait on the uploader before reading the scene
+    uploader.flush();
+
+    if (cacheWriter) {
+        cacheWriter->finish();
+        cacheWriter.reset();
+    }
+
     return scene;
 }
 
+std::shared_ptr<GLTFObj> GLTFLoader::create_scene()
+{
+    std::shared_ptr<GLTFObj> scene = std::make_shared<GLTFObj>();
+    scene->vertexArena = std::make_unique<GeometryArena>(device, allocator, uploader);
+    scene->indexArena = std::make_unique<GeometryArena>(device, allocator, uploader);
+    return scene;
+}
+
+std::vector<CacheDependency> GLTFLoader::collect_dependencies(const std::filesystem::path &path)
+{
+    // The loaded asset has its external buffers and images inlined already, so parse the JSON
+    // again without loading anything just to list the files referenced by URI
+    std::vector<CacheDependency> dependencies;
+    auto data = fastgltf::GltfDataBuffer::FromPath(path);
+    if (data.error() != fastgltf::Error::None)
+        return dependencies;
+    auto asset = parser.loadGltf(data.get(),
+                                 path.parent_path(),
+                                 fastgltf::Options::DontRequireValidAssetMember);
+    if (asset.error() != fastgltf::Error::None)
+        return dependencies;
+
+    const auto add_source = [&](const fastgltf::DataSource &source) {
+        const auto *uri = std::get_if<fastgltf::sources::URI>(&source);
+        if (uri && uri->uri.isLocalPath())
+            dependencies.emplace_back(make_dependency(path.parent_path() / uri->uri.fspath()));
+    };
+    for (const fastgltf::Buffer &b : asset.get().buffers)
+        add_source(b.data);
+    for (const fastgltf::Image &im : asset.get().images)
+        add_source(im.data);
+    return dependencies;
+}
+
+void GLTFLoader::load_cached_scene(SceneCacheReader &reader, std::shared_ptr<GLTFObj> &scene)
+{
+    // Samplers
+    const uint64_t numSamplers = reader.read<uint64_t>();
+    if (numSamplers == 0)
+        scene->samplers.push_back(samplerLinear);
+    for (uint64_t i = 0; i < numSamplers; i++) {
+        vk::SamplerCreateInfo samplerCreate{};
+        samplerCreate.setMaxLod(vk::LodClampNone);
+        samplerCreate.setMinLod(0.f);
+        samplerCreate.setMagFilter(reader.read<vk::Filter>());
+        samplerCreate.setMinFilter(reader.read<vk::Filter>());
+        samplerCreate.setMipmapMode(reader.read<vk::SamplerMipmapMode>());
+        vk::Sampler sampler = device.createSampler(samplerCreate);
+        scene->samplers.emplace_back(sampler);
+        scene->samplerQueue.emplace_back(sampler);
+    }
+
+    // Images, already decoded or transcoded. Staged straight from the mapping
+    const uint64_t numImages = reader.read<uint64_t>();
+    scene->images.resize(numImages, checkerboardImage);
+    vk::DeviceSize batchBytes = 0;
+    for (uint64_t i = 0; i < numImages; i++) {
+        const vk::Extent3D extent = reader.read<vk::Extent3D>();
+        const vk::Format format = reader.read<vk::Format>();
+        const vk::ComponentMapping swizzle = reader.read<vk::ComponentMapping>();
+        const std::span<const vk::DeviceSize> mipOffsets = reader.read_array<vk::DeviceSize>();
+        const std::span<const unsigned char> pixels = reader.read_array<unsigned char>();
+        if (pixels.empty())
+            continue;
+        const ImageData image
+            = create_texture(extent, format, pixels.data(), pixels.size(), mipOffsets, swizzle);
+        scene->images[i] = image;
+        scene->imageQueue.emplace_back(image);
+        batchBytes += pixels.size();
+        if (batchBytes >= IMAGE_UPLOAD_BATCH_BYTES) {
+            uploader.flush();
+            batchBytes = 0;
+        }
+    }
+
+    // Materials
+    const std::span<const MaterialData> table = reader.read_array<MaterialData>();
+    const std::span<const GLTFMaterial::MaterialPass> passes
+        = reader.read_array<GLTFMaterial::MaterialPass>();
+    if (table.empty() || passes.size() != table.size())
+        throw std::runtime_error("Bad material table");
+    std::vector<std::shared_ptr<GLTFMaterial>> materials;
+    materials.reserve(table.size());
+    scene->materialTable.assign(table.begin(), table.end());
+    for (size_t i = 0; i < table.size(); i++) {
+        std::shared_ptr<GLTFMaterial> matTmp = std::make_shared<GLTFMaterial>();
+        matTmp->index = static_cast<uint32_t>(i);
+        matTmp->materialPass = passes[i];
+        materials.emplace_back(std::move(matTmp));
+    }
+    const uint64_t numNamedMaterials = reader.read<uint64_t>();
+    for (uint64_t i = 0; i < numNamedMaterials; i++)
+        scene->materials[reader.read_string()] = materials.at(i);
+    upload_material_table(scene);
+
+    // Meshes
+    const uint64_t numMeshes = reader.read<uint64_t>();
+    std::vector<std::shared_ptr<Mesh>> meshes;
+    meshes.reserve(numMeshes);
+    for (uint64_t i = 0; i < numMeshes; i++) {
+        std::shared_ptr<Mesh> meshTmp = std::make_shared<Mesh>();
+        meshTmp->name = reader.read_string();
+        for (const CachedSurface &cs : reader.read_array<CachedSurface>()) {
+            Surface surface;
+            surface.startIndex = cs.startIndex;
+            surface.count = cs.count;
+            surface.material = materials.at(cs.materialIndex);
+            meshTmp->surfaces.emplace_back(surface);
+            scene->surfaceCount++;
+        }
+        const uint32_t source = reader.read<uint32_t>();
+        meshTmp->geometryTransform = reader.read<glm::mat4>();
+        if (source == i) {
+            const std::span<const Vertex> vertices = reader.read_array<Vertex>();
+            const std::span<const uint32_t> indices = reader.read_array<uint32_t>();
+            create_mesh_buffers(indices, vertices, scene, meshTmp);
+        } else if (source < i) {
+            share_mesh_buffers(meshes[source], meshTmp);
+        } else {
+            throw std::runtime_error("Corrupt scene cache: mesh geometry source");
+        }
+        meshes.emplace_back(std::move(meshTmp));
+        scene->meshes.insert({meshes.back()->name, meshes.back()});
+    }
+    create_surface_storages(meshes, scene);
+
+    // Mesh nodes, flattened: their world transform becomes the local one
+    const uint64_t numMeshNodes = reader.read<uint64_t>();
+    scene->meshNodes.reserve(numMeshNodes);
+    for (uint64_t i = 0; i < numMeshNodes; i++) {
+        std::shared_ptr<MeshNode> meshNodeTmp = std::make_shared<MeshNode>();
+        const std::string name = reader.read_string();
+        meshNodeTmp->mesh = meshes.at(reader.read<uint32_t>());
+        meshNodeTmp->localTransform = reader.read<glm::mat4>();
+        meshNodeTmp->refreshTransform(glm::mat4(1.f));
+        const auto instances = reader.read_array<vk::AccelerationStructureInstanceKHR>();
+        meshNodeTmp->firstInstance = static_cast<uint32_t>(scene->gpuInstances.size());
+        meshNodeTmp->instanceCount = static_cast<uint32_t>(instances.size());
+        scene->gpuInstances.insert(scene->gpuInstances.end(), instances.begin(), instances.end());
+        scene->meshNodes.emplace_back(meshNodeTmp);
+        scene->nodes[name] = meshNodeTmp;
+        scene->topNodes.emplace_back(std::move(meshNodeTmp));
+    }
+}
+
 void GLTFLoader::load_samplers(const fastgltf::Asset &asset, std::shared_ptr<GLTFObj> &scene)
 {
+    if (cacheWriter)
+        cacheWriter->write<uint64_t>(asset.samplers.size());
     if (asset.samplers.empty()) {
         scene->samplers.push_back(samplerLinear);
         return;
@@ -185,143 +369,132 @@ void GLTFLoader::load_samplers(const fastgltf::Asset &asset, std::shared_ptr<GLT
         vk::Sampler sampler = device.createSampler(samplerCreate);
         scene->samplers.emplace_back(sampler);
         scene->samplerQueue.emplace_back(sampler);
+        if (cacheWriter) {
+            cacheWriter->write(samplerCreate.magFilter);
+            cacheWriter->write(samplerCreate.minFilter);
+            cacheWriter->write(samplerCreate.mipmapMode);
+        }
     }
 }
 
-// VERY SLOW
+// Decoding runs on the worker pool while the main thread stages the images that are already
+// decoded, flushing the uploader every IMAGE_UPLOAD_BATCH_BYTES so that the copies overlap the
+// decoding. Only IMAGE_DECODES_PER_THREAD images per worker are in flight, the next one is
+// submitted as each is staged, so decoded pixels never pile up in memory. Images keep the glTF
+// order, so the texture indices stored in SurfaceStorage stay valid
 void GLTFLoader::load_images(const fastgltf::Asset &asset, std::shared_ptr<GLTFObj> &scene)
 {
-    scene->images.reserve(asset.images.size());
-    scene->imageQueue.reserve(scene->imageQueue.size() + asset.images.size());
-    // const auto start = std::chrono::system_clock::now();
-    for (const fastgltf::Image &im : asset.images) {
-        const auto image = load_image(asset, im);
-        if (image.has_value()) {
-            scene->images.emplace_back(image.value());
-            scene->imageQueue.emplace_back(image.value());
-        } else {
+    const size_t numImages = asset.images.size();
+    scene->images.resize(numImages, checkerboardImage);
+    scene->imageQueue.reserve(scene->imageQueue.size() + numImages);
+
+    const std::vector<TextureEncoding> encodings = texture_encodings(asset);
+    const bool compress = compressTextures;
+    const size_t window = std::max<size_t>(1, IMAGE_DECODES_PER_THREAD * threadPool->size());
+    std::deque<std::future<DecodedImage>> decoded;
+    size_t submitted = 0;
+    const auto submit_next = [&]() {
+        const fastgltf::Image &im = asset.images[submitted];
+        const TextureEncoding encoding = encodings[submitted];
+        decoded.emplace_back(threadPool->submit([&asset, &im, encoding, compress]() {
+            return decode_image(asset, im, encoding, compress);
+        }));
+        submitted++;
+    };
+    while (submitted < std::min(window, numImages))
+        submit_next();
+
+    if (cacheWriter)
+        cacheWriter->write<uint64_t>(numImages);
+    vk::DeviceSize batchBytes = 0;
+    for (size_t i = 0; i < numImages; i++) {
+        DecodedImage image = decoded.front().get();
+        decoded.pop_front();
+        if (submitted < numImages)
+            submit_next();
+        if (cacheWriter) {
+            cacheWriter->write(image.extent);
+            cacheWriter->write(image.format);
+            cacheWriter->write(image.swizzle);
+            cacheWriter->write_array(image.mipOffsets.data(), image.mipOffsets.size());
+            cacheWriter->write_array(image.data.data(), image.data.size());
+        }
+        if (image.data.empty()) {
             std::println("Load image error. Emplacing default image.");
-            scene->images.emplace_back(checkerboardImage);
+            continue;
+        }
+        image.index = static_cast<uint32_t>(i);
+        batchBytes += image.size();
+        upload_image(image, scene);
+        if (batchBytes >= IMAGE_UPLOAD_BATCH_BYTES) {
+            uploader.flush();
+            batchBytes = 0;
         }
     }
+    uploader.flush();
 }
 
-// stbi_load_from_memory IS VERY SLOW
-std::optional<ImageData> GLTFLoader::load_image(const fastgltf::Asset &asset,
-                                                const fastgltf::Image &fgltfImage)
+void GLTFLoader::upload_image(const DecodedImage &im, std::shared_ptr<GLTFObj> &scene)
 {
-    ImageData image{};
-    int w, h, nChannels;
-
-    const auto create_image_from_data = [&](unsigned char *imData) {
-        // std::println("image creation");
-        if (imData) {
-            vk::Extent3D imSize{};
-            imSize.setWidth(w);
-            imSize.setHeight(h);
-            imSize.setDepth(1);
+    // The pixels are copied into the staging ring, so they can be freed right away
+    const ImageData image = create_texture(im.extent,
+                                           im.format,
+                                           im.data.data(),
+                                           im.size(),
+                                           im.mipOffsets,
+                                           im.swizzle);
+    scene->images[im.index] = image;
+    scene->imageQueue.emplace_back(image);
+}
 
-            image = utils::create_image(device,
-                                        allocator,
-                                        gltfCmd,
-                                        gltfFence,
-                                        queue,
-                                        vk::Format::eR8G8B8A8Unorm,
-                                        vk::ImageUsageFlagBits::eSampled,
-                                        imSize,
-                                        imData);
-            // std::println("Image created.");
+// Raw bytes of an embedded or already loaded source
+static std::span<const std::byte> source_bytes(const fastgltf::DataSource &data)
+{
+    if (const auto *vector = std::get_if<fastgltf::sources::Vector>(&data))
+        return {vector->bytes.data(), vector->bytes.size()};
+    if (const auto *array = std::get_if<fastgltf::sources::Array>(&data))
+        return {array->bytes.data(), array->bytes.size()};
+    if (const auto *byteView = std::get_if<fastgltf::sources::ByteView>(&data))
+        return {byteView->bytes.data(), byteView->bytes.size()};
+    return {};
+}
 
-            stbi_image_free(imData);
+// Runs on the worker threads: only reads the asset and does not touch any Vulkan object
+DecodedImage GLTFLoader::decode_image(const fastgltf::Asset &asset,
+                                      const fastgltf::Image &fgltfImage,
+                                      const TextureEncoding encoding,
+                                      const bool compress)
+{
+    std::vector<std::byte> fileBytes;
+    std::span<const std::byte> encoded = source_bytes(fgltfImage.data);
+
+    if (const auto *view = std::get_if<fastgltf::sources::BufferView>(&fgltfImage.data)) {
+        // We specify LoadExternalBuffers, so all the buffers are already loaded in memory
+        const fastgltf::BufferView &bufferView = asset.bufferViews[view->bufferViewIndex];
+        const std::span<const std::byte> buffer = source_bytes(
+            asset.buffers[bufferView.bufferIndex].data);
+        if (bufferView.byteOffset + bufferView.byteLength <= buffer.size())
+            encoded = buffer.subspan(bufferView.byteOffset, bufferView.byteLength);
+    } else if (const auto *filePath = std::get_if<fastgltf::sources::URI>(&fgltfImage.data)) {
+        assert(filePath->uri.isLocalPath()); // We're only capable of loading local files.
+        std::ifstream file(filePath->uri.fspath(), std::ios::binary | std::ios::ate);
+        if (file) {
+            const std::streamsize size = file.tellg();
+            const std::streamsize offset = static_cast<std::streamsize>(filePath->fileByteOffset);
+            if (size > offset) {
+                fileBytes.resize(size - offset);
+                file.seekg(offset);
+                file.read(reinterpret_cast<char *>(fileBytes.data()), size - offset);
+                encoded = fileBytes;
+            }
         }
-    };
-
-    const auto read_from_uri = [&](const fastgltf::sources::URI &filePath) {
-        assert(filePath.fileByteOffset == 0); // Stbi doesn't support files with offset.
-        assert(filePath.uri.isLocalPath());   // We're only capable of loading local files.
-        // std::println("uri");
-
-        const std::filesystem::path fsPath = filePath.uri.fspath();
-        unsigned char *imData = stbi_load(fsPath.c_str(), &w, &h, &nChannels, 4);
-        create_image_from_data(imData);
-    };
-    const auto read_from_vector = [&](const fastgltf::sources::Vector &vector,
-                                      const size_t bufferViewOffset = 0) {
-        unsigned char *imData = stbi_load_from_memory(reinterpret_cast<const stbi_uc *>(
-                                                          vector.bytes.data() + bufferViewOffset),
-                                                      static_cast<int>(vector.bytes.size()),
-                                                      &w,
-                                                      &h,
-                                                      &nChannels,
-                                                      4);
-        // std::println("vector");
-        create_image_from_data(imData);
-    };
-    const auto read_from_array = [&](const fastgltf::sources::Array &array,
-                                     const size_t bufferViewOffset = 0) {
-        unsigned char *imData = stbi_load_from_memory(reinterpret_cast<const stbi_uc *>(
-                                                          array.bytes.data() + bufferViewOffset),
-                                                      static_cast<int>(array.bytes.size()),
-                                                      &w,
-                                                      &h,
-                                                      &nChannels,
-                                                      4);
-        // std::println("array");
-
-        create_image_from_data(imData);
-    };
-    const auto read_from_buffer_view = [&](const fastgltf::sources::BufferView &view) {
-        const auto &bufferView = asset.bufferViews[view.bufferViewIndex];
-        const auto &buffer = asset.buffers[bufferView.bufferIndex];
-        const size_t offset = bufferView.byteOffset;
-        // std::println("bufferview");
-
-        // Nested visit
-        std::visit(fastgltf::visitor{// We only care about VectorWithMime here, because we
-                                     // specify LoadExternalBuffers, meaning all buffers
-                                     // are already loaded into a vector.
-                                     [](auto &arg) {
-                                         std::println("Image read error: Unknown source");
-                                     },
-                                     [&](const fastgltf::sources::Vector &vector) {
-                                         read_from_vector(vector, offset);
-                                     },
-                                     [&](const fastgltf::sources::Array &array) {
-                                         read_from_array(array, offset);
-                                     }},
-                   buffer.data);
-    };
-    const auto read_from_byte_view = [&](const fastgltf::sources::ByteView &byteView) {
-        unsigned char *imData = stbi_load_from_memory(reinterpret_cast<const stbi_uc *>(
-                                                          byteView.bytes.data()),
-                                                      static_cast<int>(byteView.bytes.size()),
-                                                      &w,
-                                                      &h,
-                                                      &nChannels,
-                                                      4);
-        // std::println("byteview");
-        create_image_from_data(imData);
-    };
+    }
 
-    fastgltf::visitor visitor{[](const auto &arg) {
-                                  std::println("Image Read error: Image in unknown mode.");
-                              },
-                              [&](const fastgltf::sources::CustomBuffer &cBuffer) {
-                                  std::println("Image Read error: Image in custom Buffer mode.");
-                              },
-                              [&](const fastgltf::sources::Fallback &fallback) {
-                                  std::println("Image Read error: Image in fallback mode.");
-                              },
-                              read_from_uri,
-                              read_from_vector,
-                              read_from_array,
-                              read_from_buffer_view,
-                              read_from_byte_view};
-    std::visit(visitor, fgltfImage.data);
-    if (image.image)
-        return image;
-    else
+    if (encoded.empty()) {
+        std::println("Image read error: Image in unknown mode.");
         return {};
+    }
+    return decode_texture(encoded, encoding, compress);
 }
 
 void GLTFLoader::load_materials(const fastgltf::Asset &asset,
@@ -329,39 +502,20 @@ void GLTFLoader::load_materials(const fastgltf::Asset &asset,
                                 std::vector<std::shared_ptr<GLTFMaterial>> &vMaterials)
 {
     vMaterials.reserve(asset.materials.size());
-    scene->bufferQueue.reserve(scene->bufferQueue.size() + asset.materials.size());
+    scene->materialTable.reserve(std::max<size_t>(asset.materials.size(), 1));
     for (size_t i = 0; i < asset.materials.size(); i++) {
         const fastgltf::Material &m = asset.materials[i];
         std::shared_ptr<GLTFMaterial> matTmp = std::make_shared<GLTFMaterial>();
+        matTmp->index = static_cast<uint32_t>(scene->materialTable.size());
 
-        // Write constants to material buffer
-        GLTFMaterial::MaterialConstants materialConstants;
-        materialConstants.baseColorFactor.x = m.pbrData.baseColorFactor.x();
-        materialConstants.baseColorFactor.y = m.pbrData.baseColorFactor.y();
-        materialConstants.baseColorFactor.z = m.pbrData.baseColorFactor.z();
-        materialConstants.baseColorFactor.w = m.pbrData.baseColorFactor.w();
-        materialConstants.metallicFactor = m.pbrData.metallicFactor;
-        materialConstants.roughnessFactor = m.pbrData.roughnessFactor;
-
-        std::shared_ptr<Buffer> materialConstantsBuffer = std::make_shared<Buffer>();
-        *materialConstantsBuffer
-            = utils::create_buffer(device,
-                                   allocator,
-                                   sizeof(GLTFMaterial::MaterialConstants),
-                                   vk::BufferUsageFlagBits::eStorageBuffer
-                                       | vk::BufferUsageFlagBits::eShaderDeviceAddress
-                                       | vk::BufferUsageFlagBits::eTransferDst,
-                                   VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE);
-        matTmp->materialResources.dataBuffer = *materialConstantsBuffer;
-        scene->bufferQueue.emplace_back(materialConstantsBuffer);
-        utils::copy_to_device_buffer(matTmp->materialResources.dataBuffer,
-                                     device,
-                                     allocator,
-                                     gltfCmd,
-                                     queue,
-                                     gltfFence,
-                                     &materialConstants,
-                                     sizeof(GLTFMaterial::MaterialConstants));
+        // Write constants to the material table entry
+        MaterialData materialData;
+        materialData.baseColorFactor.x = m.pbrData.baseColorFactor.x();
+        materialData.baseColorFactor.y = m.pbrData.baseColorFactor.y();
+        materialData.baseColorFactor.z = m.pbrData.baseColorFactor.z();
+        materialData.baseColorFactor.w = m.pbrData.baseColorFactor.w();
+        materialData.metallicFactor = m.pbrData.metallicFactor;
+        materialData.roughnessFactor = m.pbrData.roughnessFactor;
 
         // Material type
         matTmp->materialPass = (m.alphaMode == fastgltf::AlphaMode::Blend)
@@ -369,31 +523,77 @@ void GLTFLoader::load_materials(const fastgltf::Asset &asset,
                                    : GLTFMaterial::MaterialPass::MainColor;
         // Fill materials[i]:
         if (m.pbrData.baseColorTexture.has_value()) {
-            size_t imgIndex = asset.textures[m.pbrData.baseColorTexture->textureIndex]
-                                  .imageIndex.value();
+            size_t imgIndex = texture_image_index(
+                asset.textures[m.pbrData.baseColorTexture->textureIndex]);
             size_t samplerIndex = asset.textures[m.pbrData.baseColorTexture->textureIndex]
                                       .samplerIndex.value_or(0);
-            matTmp->materialResources.colorImageIndex = imgIndex;
-            matTmp->materialResources.colorSamplerIndex = samplerIndex;
+            materialData.colorImageIndex = imgIndex;
+            materialData.colorSamplerIndex = samplerIndex;
         }
         if (m.pbrData.metallicRoughnessTexture.has_value()) {
-            size_t matIndex = asset.textures[m.pbrData.metallicRoughnessTexture->textureIndex]
-                                  .imageIndex.value();
+            size_t matIndex = texture_image_index(
+                asset.textures[m.pbrData.metallicRoughnessTexture->textureIndex]);
             size_t matSamplerIndex = asset
                                          .textures[m.pbrData.metallicRoughnessTexture->textureIndex]
                                          .samplerIndex.value_or(0);
-            matTmp->materialResources.materialImageIndex = matIndex;
-            matTmp->materialResources.materialSamplerIndex = matSamplerIndex;
+            materialData.materialImageIndex = matIndex;
+            materialData.materialSamplerIndex = matSamplerIndex;
         }
         if (m.normalTexture.has_value()) {
-            matTmp->materialResources.normalMapIndex = asset.textures[m.normalTexture->textureIndex]
-                                                           .imageIndex.value();
-            matTmp->materialResources.normalSamplerIndex
+            materialData.normalMapIndex = texture_image_index(
+                asset.textures[m.normalTexture->textureIndex]);
+            materialData.normalSamplerIndex
                 = asset.textures[m.normalTexture->textureIndex].samplerIndex.value_or(0);
         }
+        scene->materialTable.emplace_back(materialData);
         vMaterials.emplace_back(std::move(matTmp));
         scene->materials[m.name.c_str()] = vMaterials.back();
     }
+    // Primitives without a material use the first one, so there has to be at least one
+    if (vMaterials.empty()) {
+        std::shared_ptr<GLTFMaterial> matTmp = std::make_shared<GLTFMaterial>();
+        matTmp->materialPass = GLTFMaterial::MaterialPass::MainColor;
+        scene->materialTable.emplace_back(MaterialData{});
+        vMaterials.emplace_back(std::move(matTmp));
+    }
+
+    if (cacheWriter) {
+        std::vector<GLTFMaterial::MaterialPass> passes;
+        passes.reserve(vMaterials.size());
+        for (const auto &m : vMaterials)
+            passes.push_back(m->materialPass);
+        cacheWriter->write_array(scene->materialTable.data(), scene->materialTable.size());
+        cacheWriter->write_array(passes.data(), passes.size());
+        cacheWriter->write<uint64_t>(asset.materials.size());
+        for (const fastgltf::Material &m : asset.materials)
+            cacheWriter->write_string(std::string(m.name.c_str()));
+    }
+
+    upload_material_table(scene);
+}
+
+void GLTFLoader::upload_material_table(std::shared_ptr<GLTFObj> &scene)
+{
+    // The whole table in a single upload
+    const vk::DeviceSize tableSize = scene->materialTable.size() * sizeof(MaterialData);
+    std::shared_ptr<Buffer> materialBuffer = std::make_shared<Buffer>();
+    *materialBuffer = utils::create_buffer(device,
+                                           allocator,
+                                           tableSize,
+                                           vk::BufferUsageFlagBits::eStorageBuffer
+                                               | vk::BufferUsageFlagBits::eTransferDst,
+                                           VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE);
+    uploader.upload_buffer(*materialBuffer, scene->materialTable.data(), tableSize);
+    scene->materialBuffer = *materialBuffer;
+    scene->bufferQueue.emplace_back(materialBuffer);
+}
+
+// Non indexed primitives get one index per vertex
+static size_t primitive_index_count(const fastgltf::Asset &asset, const fastgltf::Primitive &p)
+{
+    if (p.indicesAccessor.has_value())
+        return asset.accessors[p.indicesAccessor.value()].count;
+    return asset.accessors[p.findAttribute("POSITION")->accessorIndex].count;
 }
 
 void GLTFLoader::load_meshes(const fastgltf::Asset &asset,
@@ -401,184 +601,217 @@ void GLTFLoader::load_meshes(const fastgltf::Asset &asset,
                              std::shared_ptr<GLTFObj> &scene,
                              std::vector<std::shared_ptr<Mesh>> &meshes)
 {
-    std::vector<uint32_t> indices;
-    std::vector<Vertex> vertices;
-    scene->surfaceCount = 0;
-    meshes.reserve(asset.meshes.size());
-    for (const fastgltf::Mesh &m : asset.meshes) {
-        std::shared_ptr<Mesh> meshTmp = std::make_shared<Mesh>();
-        meshTmp->name = m.name.c_str();
-
-        // If we already filled the mesh buffers of a given object, do not do it again
-        const bool meshBuffersExist = scene->meshes.contains(meshTmp->name);
-
-        // Load primitives
-        // Do a first pass over the primitives for efficiently reserve memory
-        indices.clear();
-        vertices.clear();
+    // Size every mesh first, then load each primitive in place on the worker pool
+    struct MeshGeometry
+    {
+        std::vector<uint32_t> indices;
+        std::vector<Vertex> vertices;
+        std::vector<std::future<void>> jobs;
+        uint64_t shape{0}; // Vertex and surface index counts, all a match can have
+        size_t lastSameShape{0}; // Last mesh that could be compared against this one
+    };
+    std::vector<MeshGeometry> geometry(asset.meshes.size());
+    for (size_t i = 0; i < asset.meshes.size(); i++) {
+        const fastgltf::Mesh &m = asset.meshes[i];
+        MeshGeometry &g = geometry[i];
         size_t indexCount = 0;
         size_t vertexCount = 0;
-        size_t tangentCount = 0;
-        // Add indices and vertices only if we have not visited that mesh yet
-        if (!meshBuffersExist) {
-            for (const fastgltf::Primitive &p : m.primitives) {
-                const fastgltf::Accessor &indicesAccessor
-                    = asset.accessors[p.indicesAccessor.value()];
-                const fastgltf::Accessor &verticesAccessor
-                    = asset.accessors[p.findAttribute("POSITION")->accessorIndex];
-                const fastgltf::Accessor &tangentsAccessor
-                    = asset.accessors[p.findAttribute("TANGENT")->accessorIndex];
-                indexCount += indicesAccessor.count;
-                vertexCount += verticesAccessor.count;
-                tangentCount += tangentsAccessor.count;
-            }
-            // assert(vertexCount == tangentCount && "nTangents != nVertices");
-            indices.reserve(indexCount);
-            vertices.resize(vertexCount);
+        for (const fastgltf::Primitive &p : m.primitives) {
+            indexCount += primitive_index_count(asset, p);
+            vertexCount += asset.accessors[p.findAttribute("POSITION")->accessorIndex].count;
+            g.shape = hash_combine(g.shape, primitive_index_count(asset, p));
         }
+        g.shape = hash_combine(g.shape, vertexCount);
+        g.indices.resize(indexCount);
+        g.vertices.resize(vertexCount);
 
-        // Access the data of each primitive
-        size_t initialVtx = 0;
-        meshTmp->surfaces.reserve(m.primitives.size());
+        size_t firstIndex = 0;
+        size_t firstVertex = 0;
+        g.jobs.reserve(m.primitives.size());
         for (const fastgltf::Primitive &p : m.primitives) {
-            // We are going to fill the surface and the i&v buffers in this loop
-            Surface surface;
-            const fastgltf::Accessor &indicesAccessor = asset.accessors[p.indicesAccessor.value()];
+            const std::span<uint32_t> indices(g.indices.data() + firstIndex,
+                                              primitive_index_count(asset, p));
+            const std::span<Vertex> vertices(
+                g.vertices.data() + firstVertex,
+                asset.accessors[p.findAttribute("POSITION")->accessorIndex].count);
+            const uint32_t baseVertex = static_cast<uint32_t>(firstVertex);
+            g.jobs.emplace_back(threadPool->submit([&asset, &p, indices, vertices, baseVertex]() {
+                load_primitive(asset, p, indices, vertices, baseVertex);
+            }));
+            firstIndex += indices.size();
+            firstVertex += vertices.size();
+        }
+    }
 
-            surface.startIndex = static_cast<uint32_t>(indices.size());
-            surface.count = static_cast<uint32_t>(indicesAccessor.count);
+    std::unordered_map<uint64_t, size_t> lastOfShape;
+    for (size_t i = 0; i < geometry.size(); i++)
+        lastOfShape[geometry[i].shape] = i;
+    for (MeshGeometry &g : geometry)
+        g.lastSameShape = lastOfShape[g.shape];
+
+    // Consume the meshes in order while the later ones are still loading. Meshes with the same
+    // content as an earlier one share its buffers, and therefore its BLAS. The hash only finds the
+    // candidates, which keep their host copy to be compared exactly until the last mesh of their
+    // shape. A match has the same counts, so a freed candidate can only fail the size check
+    std::vector<std::vector<uint32_t>> releaseAfter(asset.meshes.size());
+    struct GeometrySource
+    {
+        uint32_t meshIndex;
+        glm::vec3 origin; // First vertex, to place translated copies
+    };
+    std::unordered_multimap<uint64_t, GeometrySource> uniqueGeometry;
+    scene->surfaceCount = 0;
+    meshes.reserve(asset.meshes.size());
+    if (cacheWriter)
+        cacheWriter->write<uint64_t>(asset.meshes.size());
+    // The jobs write into geometry, none can outlive it if a mesh fails
+    try {
+        for (size_t i = 0; i < asset.meshes.size(); i++) {
+            const fastgltf::Mesh &m = asset.meshes[i];
+            std::shared_ptr<Mesh> meshTmp = std::make_shared<Mesh>();
+            meshTmp->name = m.name.c_str();
+
+            uint32_t startIndex = 0;
+            meshTmp->surfaces.reserve(m.primitives.size());
+            for (const fastgltf::Primitive &p : m.primitives) {
+                Surface surface;
+                surface.startIndex = startIndex;
+                surface.count = static_cast<uint32_t>(primitive_index_count(asset, p));
+                startIndex += surface.count;
+
+                // Load material by index
+                if (p.materialIndex.has_value())
+                    surface.material = materials[p.materialIndex.value()];
+                else
+                    surface.material = materials[0];
+
+                meshTmp->surfaces.emplace_back(surface);
+                scene->surfaceCount++;
+            }
 
-            // Load material by index
-            if (p.materialIndex.has_value())
-                surface.material = materials[p.materialIndex.value()];
+            MeshGeometry &g = geometry[i];
+            for (std::future<void> &job : g.jobs)
+                job.get();
+
+            uint64_t hash = geometry_hash(g.indices, g.vertices, dedupTranslatedMeshes);
+            for (const Surface &s : meshTmp->surfaces)
+                hash = hash_combine(hash, s.count);
+            const glm::vec3 origin = g.vertices.empty() ? glm::vec3(0.f)
+                                                        : g.vertices.front().position;
+            const auto [first, last] = uniqueGeometry.equal_range(hash);
+            auto source = std::find_if(first, last, [&](const auto &candidate) {
+                const uint32_t c = candidate.second.meshIndex;
+                return std::ranges::equal(meshes[c]->surfaces,
+                                          meshTmp->surfaces,
+                                          {},
+                                          &Surface::count,
+                                          &Surface::count)
+                       && same_geometry(geometry[c].indices,
+                                        geometry[c].vertices,
+                                        g.indices,
+                                        g.vertices,
+                                        dedupTranslatedMeshes);
+            });
+            const bool ownsGeometry = source == last;
+            if (ownsGeometry)
+                source = uniqueGeometry.emplace(hash,
+                                                GeometrySource{static_cast<uint32_t>(i), origin});
             else
-                surface.material = materials[0];
-
-            meshTmp->surfaces.emplace_back(surface);
-            scene->surfaceCount++;
-
-            // Reuse the previous
-            if (!meshBuffersExist) {
-                // Load indices
-                fastgltf::iterateAccessor<uint32_t>(asset, indicesAccessor, [&](uint32_t index) {
-                    indices.emplace_back(index + initialVtx);
-                });
-
-                // Load vertex positions. No need to check since gltf 2 standard requires POSITION to be
-                // always present
-                const fastgltf::Accessor &verticesAccessor
-                    = asset.accessors[p.findAttribute("POSITION")->accessorIndex];
-                fastgltf::iterateAccessorWithIndex<glm::vec3>(
-                    asset, verticesAccessor, [&](const glm::vec3 &v, const size_t idx) {
-                        vertices[initialVtx + idx].position = v;
-                    });
-
-                // Load per-vertex normals
-                const fastgltf::Attribute *normalAttrib = p.findAttribute("NORMAL");
-                if (normalAttrib != p.attributes.end()) {
-                    const fastgltf::Accessor &normalsAccessor
-                        = asset.accessors[normalAttrib->accessorIndex];
-                    fastgltf::iterateAccessorWithIndex<glm::vec3>(
-                        asset, normalsAccessor, [&](const glm::vec3 &n, const size_t idx) {
-                            vertices[initialVtx + idx].normal = n;
-                        });
+                meshTmp->geometryTransform = glm::translate(glm::mat4(1.f),
+                                                            origin - source->second.origin);
+
+            if (cacheWriter) {
+                std::vector<CachedSurface> cachedSurfaces;
+                cachedSurfaces.reserve(meshTmp->surfaces.size());
+                for (const Surface &s : meshTmp->surfaces)
+                    cachedSurfaces.push_back({s.startIndex, s.count, s.material->index});
+                cacheWriter->write_string(meshTmp->name);
+                cacheWriter->write_array(cachedSurfaces.data(), cachedSurfaces.size());
+                cacheWriter->write(source->second.meshIndex);
+                cacheWriter->write(meshTmp->geometryTransform);
+                if (ownsGeometry) {
+                    cacheWriter->write_array(g.vertices.data(), g.vertices.size());
+                    cacheWriter->write_array(g.indices.data(), g.indices.size());
                 }
-
-                // Load per-vertex UVs
-                const fastgltf::Attribute *uvAttrib = p.findAttribute("TEXCOORD_0");
-                if (uvAttrib != p.attributes.end()) {
-                    const fastgltf::Accessor &uvAccessor = asset.accessors[uvAttrib->accessorIndex];
-                    fastgltf::iterateAccessorWithIndex<glm::vec2>(
-                        asset, uvAccessor, [&](const glm::vec2 &uv, const size_t idx) {
-                            vertices[initialVtx + idx].uv = uv;
-                        });
-                }
-
-                // Load vertex colors
-                const fastgltf::Attribute *colorAttrib = p.findAttribute("COLOR_0");
-                if (colorAttrib != p.attributes.end()) {
-                    const fastgltf::Accessor &colorAccessor
-                        = asset.accessors[colorAttrib->accessorIndex];
-                    fastgltf::iterateAccessorWithIndex<glm::vec4>(
-                        asset, colorAccessor, [&](const glm::vec4 &c, const size_t idx) {
-                            vertices[initialVtx + idx].color = c;
-                        });
-                }
-                // Load tangents
-                // Load vertex colors
-                const fastgltf::Attribute *tangentAttrib = p.findAttribute("TANGENT");
-                if (tangentAttrib != p.attributes.end()) {
-                    const fastgltf::Accessor &tangentAccessor
-                        = asset.accessors[tangentAttrib->accessorIndex];
-                    fastgltf::iterateAccessorWithIndex<glm::vec4>(
-                        asset, tangentAccessor, [&](const glm::vec4 &t, const size_t idx) {
-                            vertices[initialVtx + idx].tangent = t;
-                        });
-                }
-                initialVtx += verticesAccessor.count;
             }
-        }
-        // Fill meshTmp index and vertex buffers
-        if (!meshBuffersExist) {
-            create_mesh_buffers(indices, vertices, meshTmp);
-            scene->bufferQueue.reserve(scene->bufferQueue.size() + 2);
-            scene->bufferQueue.emplace_back(meshTmp->indexBuffer);
-            scene->bufferQueue.emplace_back(meshTmp->vertexBuffer);
 
-        } else {
-            const auto &sameMesh = scene->meshes.find(meshTmp->name)->second;
-            meshTmp->indexBuffer = sameMesh->indexBuffer;
-            meshTmp->vertexBuffer = sameMesh->vertexBuffer;
+            // Fill meshTmp index and vertex buffers
+            if (ownsGeometry)
+                create_mesh_buffers(g.indices, g.vertices, scene, meshTmp);
+            else
+                share_mesh_buffers(meshes.at(source->second.meshIndex), meshTmp);
+            if (!ownsGeometry || g.lastSameShape == i)
+                g = {}; // No later mesh compares against it, the host copy is not needed anymore
+            else
+                releaseAfter[g.lastSameShape].push_back(static_cast<uint32_t>(i));
+            for (const uint32_t c : releaseAfter[i])
+                geometry[c] = {};
+            meshes.emplace_back(std::move(meshTmp));
+            scene->meshes.insert({m.name.c_str(), meshes.back()});
         }
-        meshes.emplace_back(std::move(meshTmp));
-        scene->meshes.insert({m.name.c_str(), meshes.back()});
+    } catch (...) {
+        for (MeshGeometry &g : geometry)
+            for (std::future<void> &job : g.jobs)
+                if (job.valid())
+                    job.wait();
+        throw;
     }
+    geometry.clear();
+    if (uniqueGeometry.size() < meshes.size())
+        std::println("Deduplicated {} of {} meshes",
+                     meshes.size() - uniqueGeometry.size(),
+                     meshes.size());
 
-    // Create the per-surface uniform buffers
-    scene->surfaceUniformBuffers.reserve(scene->surfaceCount);
-    uint32_t surfaceId = 0;
+    create_surface_storages(meshes, scene);
+}
+
+void GLTFLoader::create_surface_storages(const std::vector<std::shared_ptr<Mesh>> &meshes,
+                                         std::shared_ptr<GLTFObj> &scene)
+{
+    // Pack every surface into a single storage buffer. The surfaces of a mesh are contiguous, so
+    // the closest hit shader finds them at the instance custom index plus the geometry index
+    std::vector<SurfaceStorage> surfaceStorages;
+    surfaceStorages.reserve(scene->surfaceCount);
+    scene->surfaceClasses.reserve(scene->surfaceCount);
     for (const auto &m : meshes) {
         for (auto &s : m->surfaces) {
-            std::shared_ptr<Buffer> surfaceUniformBuffer = std::make_shared<Buffer>();
-            *surfaceUniformBuffer = create_surface_buffer(m, s);
-            scene->surfaceUniformBuffers.emplace_back(*surfaceUniformBuffer);
-            s.bufferIndex = surfaceId;
-            surfaceId++;
-            scene->bufferQueue.emplace_back(surfaceUniformBuffer);
+            s.bufferIndex = static_cast<uint32_t>(surfaceStorages.size());
+            surfaceStorages.emplace_back(create_surface_storage(m, s));
+            scene->surfaceClasses.push_back(
+                material_class(scene->materialTable[s.material->index]));
+            // The wavefront backend bins its hits by class straight from the surface record
+            surfaceStorages.back().flags |= scene->surfaceClasses.back() << SURFACE_CLASS_SHIFT;
         }
     }
+    std::shared_ptr<Buffer> surfaceStorageBuffer = std::make_shared<Buffer>();
+    *surfaceStorageBuffer = utils::create_buffer(device,
+                                                 allocator,
+                                                 surfaceStorages.size() * sizeof(SurfaceStorage),
+                                                 vk::BufferUsageFlagBits::eStorageBuffer
+                                                     | vk::BufferUsageFlagBits::eTransferDst,
+                                                 VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE);
+    uploader.upload_buffer(*surfaceStorageBuffer,
+                           surfaceStorages.data(),
+                           surfaceStorages.size() * sizeof(SurfaceStorage));
+    scene->surfaceStorageBuffer = *surfaceStorageBuffer;
+    scene->bufferQueue.emplace_back(surfaceStorageBuffer);
 }
 
-Buffer GLTFLoader::create_surface_buffer(const std::shared_ptr<Mesh> &mesh, const Surface &surface)
+SurfaceStorage GLTFLoader::create_surface_storage(const std::shared_ptr<Mesh> &mesh,
+                                                  const Surface &surface)
 {
     SurfaceStorage surfaceStorage;
-    surfaceStorage.indexBufferAddress = mesh->indexBuffer->bufferAddress;
-    surfaceStorage.vertexBufferAddress = mesh->vertexBuffer->bufferAddress;
-    surfaceStorage.materialConstantsBufferAddress = surface.material->materialResources.dataBuffer
-                                                        .bufferAddress;
-    surfaceStorage.colorImageIndex = surface.material->materialResources.colorImageIndex;
-    surfaceStorage.colorSamplerIndex = surface.material->materialResources.colorSamplerIndex;
-    surfaceStorage.materialImageIndex = surface.material->materialResources.materialImageIndex;
-    surfaceStorage.materialSamplerIndex = surface.material->materialResources.materialSamplerIndex;
-    surfaceStorage.normalMapIndex = surface.material->materialResources.normalMapIndex;
-    surfaceStorage.normalSamplerIndex = surface.material->materialResources.normalSamplerIndex;
+    surfaceStorage.indexBufferAddress = mesh->indices.address;
+    surfaceStorage.vertexBufferAddress = mesh->vertices.address;
+    surfaceStorage.positionBufferAddress = mesh->positions.address;
+    if (mesh->compactVertices)
+        surfaceStorage.flags |= eCompactVertices;
+    if (mesh->indexType == vk::IndexType::eUint16)
+        surfaceStorage.flags |= eIndices16;
+    surfaceStorage.materialIndex = surface.material->index;
     surfaceStorage.startIndex = surface.startIndex;
     surfaceStorage.count = surface.count;
-    Buffer surfaceUniformBuffer = utils::create_buffer(device,
-                                                       allocator,
-                                                       sizeof(SurfaceStorage),
-                                                       vk::BufferUsageFlagBits::eUniformBuffer
-                                                           | vk::BufferUsageFlagBits::eTransferDst,
-                                                       VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE);
-    utils::copy_to_device_buffer(surfaceUniformBuffer,
-                                 device,
-                                 allocator,
-                                 gltfCmd,
-                                 queue,
-                                 gltfFence,
-                                 &surfaceStorage,
-                                 sizeof(SurfaceStorage));
-    return surfaceUniformBuffer;
+    return surfaceStorage;
 }
 
 void GLTFLoader::load_nodes(const fastgltf::Asset &asset,
@@ -588,11 +821,7 @@ void GLTFLoader::load_nodes(const fastgltf::Asset &asset,
 {
     nodes.reserve(asset.nodes.size());
     // Define the lambda that will load the node and the local transform
-    uint32_t surfaceId = 0;
     scene->meshNodes.reserve(asset.nodes.size());
-    std::vector<Buffer> surfaceBuffersTmp{scene->surfaceUniformBuffers};
-    scene->surfaceUniformBuffers.clear();
-    scene->surfaceUniformBuffers.reserve(scene->surfaceCount);
 
     // For now, we will consider that all nodes belong to the same scene
     for (const auto &n : asset.nodes) {
@@ -602,10 +831,6 @@ void GLTFLoader::load_nodes(const fastgltf::Asset &asset,
             const std::shared_ptr<Mesh> &mesh = meshes[n.meshIndex.value()];
             meshNodeTmp->mesh = mesh;
 
-            // Set the correspondent buffer for every mesh surface
-            for (const auto &s : mesh->surfaces)
-                scene->surfaceUniformBuffers.emplace_back(surfaceBuffersTmp[s.bufferIndex]);
-
             // Add the node to our structures
             scene->meshNodes.emplace_back(std::move(meshNodeTmp));
             nodes.emplace_back(scene->meshNodes.back());
@@ -642,72 +867,178 @@ void GLTFLoader::load_nodes(const fastgltf::Asset &asset,
             n->refreshTransform(glm::mat4(1.f));
         }
     }
+
+    // GPU instances need the world transforms
+    for (size_t i = 0; i < nodes.size(); i++) {
+        const fastgltf::Node &n = asset.nodes[i];
+        if (n.meshIndex.has_value() && !n.instancingAttributes.empty())
+            load_gpu_instances(asset, n, scene, static_cast<MeshNode &>(*nodes[i]));
+    }
+
+    if (cacheWriter) {
+        cacheWriter->write<uint64_t>(scene->meshNodes.size());
+        for (size_t i = 0; i < nodes.size(); i++) {
+            const fastgltf::Node &n = asset.nodes[i];
+            if (!n.meshIndex.has_value())
+                continue;
+            const MeshNode &meshNode = static_cast<const MeshNode &>(*nodes[i]);
+            cacheWriter->write_string(std::string(n.name.c_str()));
+            cacheWriter->write(static_cast<uint32_t>(n.meshIndex.value()));
+            cacheWriter->write(nodes[i]->worldTransform);
+            cacheWriter->write_array(scene->gpuInstances.data() + meshNode.firstInstance,
+                                     meshNode.instanceCount);
+        }
+    }
 }
 
-void GLTFLoader::create_mesh_buffers(const std::vector<uint32_t> &indices,
-                                     const std::vector<Vertex> &vertices,
+void GLTFLoader::load_gpu_instances(const fastgltf::Asset &asset,
+                                    const fastgltf::Node &node,
+                                    std::shared_ptr<GLTFObj> &scene,
+                                    MeshNode &meshNode)
+{
+    // Every attribute is optional, but all of them have one element per copy
+    const fastgltf::Accessor *translations = nullptr, *rotations = nullptr, *scales = nullptr;
+    size_t count = 0;
+    for (const fastgltf::Attribute &attrib : node.instancingAttributes) {
+        const fastgltf::Accessor &accessor = asset.accessors[attrib.accessorIndex];
+        if (attrib.name == "TRANSLATION")
+            translations = &accessor;
+        else if (attrib.name == "ROTATION")
+            rotations = &accessor;
+        else if (attrib.name == "SCALE")
+            scales = &accessor;
+        else
+            continue;
+        count = std::max(count, accessor.count);
+    }
+    if (count == 0)
+        return;
+
+    std::vector<glm::vec3> t(count, glm::vec3(0.f)), s(count, glm::vec3(1.f));
+    std::vector<glm::vec4> r(count, glm::vec4(0.f, 0.f, 0.f, 1.f));
+    if (translations)
+        fastgltf::copyFromAccessor<glm::vec3>(asset, *translations, t.data());
+    if (rotations)
+        fastgltf::copyFromAccessor<glm::vec4>(asset, *rotations, r.data());
+    if (scales)
+        fastgltf::copyFromAccessor<glm::vec3>(asset, *scales, s.data());
+
+    // Copies are placed in the node space: world * TRS * geometry
+    const glm::mat4 &world = meshNode.worldTransform;
+    const glm::mat4 &geometry = meshNode.mesh->geometryTransform;
+    const uint32_t customIndex = meshNode.mesh->surfaces.front().bufferIndex;
+    meshNode.firstInstance = static_cast<uint32_t>(scene->gpuInstances.size());
+    meshNode.instanceCount = static_cast<uint32_t>(count);
+    scene->gpuInstances.reserve(scene->gpuInstances.size() + count);
+    for (size_t i = 0; i < count; i++) {
+        const glm::mat4 trs = glm::translate(glm::mat4(1.f), t[i])
+                              * glm::mat4_cast(glm::quat(r[i].w, r[i].x, r[i].y, r[i].z))
+                              * glm::scale(glm::mat4(1.f), s[i]);
+        scene->gpuInstances.emplace_back(tlas_instance(world * trs * geometry, customIndex));
+    }
+}
+
+void GLTFLoader::share_mesh_buffers(const std::shared_ptr<Mesh> &sameMesh,
+                                    std::shared_ptr<Mesh> &mesh)
+{
+    mesh->indices = sameMesh->indices;
+    mesh->vertices = sameMesh->vertices;
+    mesh->positions = sameMesh->positions;
+    mesh->vertexCount = sameMesh->vertexCount;
+    mesh->indexType = sameMesh->indexType;
+    mesh->compactVertices = sameMesh->compactVertices;
+}
+
+void GLTFLoader::create_mesh_buffers(const std::span<const uint32_t> indices,
+                                     const std::span<const Vertex> vertices,
+                                     std::shared_ptr<GLTFObj> &scene,
                                      std::shared_ptr<Mesh> &mesh)
 {
-    mesh->indexBuffer = std::make_shared<Buffer>();
-    mesh->vertexBuffer = std::make_shared<Buffer>();
-
-    const vk::DeviceSize verticesSize = vertices.size() * sizeof(Vertex);
-    const vk::DeviceSize indicesSize = indices.size() * sizeof(uint32_t);
-
-    *mesh->vertexBuffer = utils::create_buffer(
-        device,
-        allocator,
-        verticesSize,
-        vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eShaderDeviceAddress
-            | vk::BufferUsageFlagBits::eTransferDst
-            | vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR,
-        VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE);
-
-    *mesh->indexBuffer = utils::create_buffer(
-        device,
-        allocator,
-        indicesSize,
-        vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eShaderDeviceAddress
-            | vk::BufferUsageFlagBits::eTransferDst
-            | vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR,
-        VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE);
-
-    Buffer stagingBuffer = utils::create_buffer(device,
-                                                allocator,
-                                                verticesSize + indicesSize,
-                                                vk::BufferUsageFlagBits::eTransferSrc,
-                                                VMA_MEMORY_USAGE_AUTO,
-                                                VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT
-                                                    | VMA_ALLOCATION_CREATE_MAPPED_BIT);
-
-    utils::copy_to_buffer(stagingBuffer, allocator, vertices.data(), verticesSize);
-    utils::copy_to_buffer(stagingBuffer, allocator, indices.data(), indicesSize, verticesSize);
-
-    utils::cmd_submit(device, queue, gltfFence, gltfCmd, [&](const vk::CommandBuffer &cmd) {
-        // Set info structures to copy from staging to vertex & index buffers
-        vk::BufferCopy2 vertexCopy{};
-        vertexCopy.setSrcOffset(0);
-        vertexCopy.setDstOffset(0);
-        vertexCopy.setSize(verticesSize);
-        vk::CopyBufferInfo2 vertexCopyInfo{};
-        vertexCopyInfo.setSrcBuffer(stagingBuffer.buffer);
-        vertexCopyInfo.setDstBuffer(mesh->vertexBuffer->buffer);
-        vertexCopyInfo.setRegions(vertexCopy);
-
-        vk::BufferCopy2 indexCopy{};
-        indexCopy.setSrcOffset(verticesSize);
-        indexCopy.setDstOffset(0);
-        indexCopy.setSize(indicesSize);
-        vk::CopyBufferInfo2 indexCopyInfo{};
-        indexCopyInfo.setSrcBuffer(stagingBuffer.buffer);
-        indexCopyInfo.setDstBuffer(mesh->indexBuffer->buffer);
-        indexCopyInfo.setRegions(indexCopy);
-
-        cmd.copyBuffer2(vertexCopyInfo);
-        cmd.copyBuffer2(indexCopyInfo);
-    });
-
-    utils::destroy_buffer(allocator, stagingBuffer);
+    mesh->vertexCount = static_cast<uint32_t>(vertices.size());
+    mesh->compactVertices = compactVertices;
+    if (!compactVertices) {
+        mesh->vertices = scene->vertexArena->upload(vertices.data(),
+                                                    vertices.size() * sizeof(Vertex));
+        mesh->indices = scene->indexArena->upload(indices.data(), indices.size() * sizeof(uint32_t));
+        return;
+    }
+
+    std::vector<glm::vec3> positions(vertices.size());
+    std::vector<CompactVertex> attributes(vertices.size());
+    for (size_t i = 0; i < vertices.size(); i++) {
+        positions[i] = vertices[i].position;
+        attributes[i] = compact_vertex(vertices[i]);
+    }
+    mesh->positions = scene->vertexArena->upload(positions.data(),
+                                                 positions.size() * sizeof(glm::vec3));
+    mesh->vertices = scene->vertexArena->upload(attributes.data(),
+                                                attributes.size() * sizeof(CompactVertex));
+
+    if (vertices.size() <= 0x10000) {
+        // The shaders read the indices as words, pad to an even count
+        std::vector<uint16_t> indices16(indices.begin(), indices.end());
+        if (indices16.size() % 2 != 0)
+            indices16.push_back(0);
+        mesh->indices = scene->indexArena->upload(indices16.data(),
+                                                  indices16.size() * sizeof(uint16_t));
+        mesh->indexType = vk::IndexType::eUint16;
+    } else {
+        mesh->indices = scene->indexArena->upload(indices.data(), indices.size() * sizeof(uint32_t));
+    }
+}
+
+// Octahedral mapping of a unit vector to [-1, 1]^2
+static glm::vec2 oct_encode(const glm::vec3 &n)
+{
+    const float l1 = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+    if (l1 == 0.f)
+        return glm::vec2{0.f};
+    const glm::vec3 p = n / l1;
+    if (p.z >= 0.f)
+        return glm::vec2{p.x, p.y};
+    return glm::vec2{(1.f - std::abs(p.y)) * (p.x >= 0.f ? 1.f : -1.f),
+                     (1.f - std::abs(p.x)) * (p.y >= 0.f ? 1.f : -1.f)};
+}
+
+CompactVertex compact_vertex(const Vertex &v)
+{
+    CompactVertex c;
+    c.normal = glm::packSnorm2x16(oct_encode(v.normal));
+    const glm::vec2 t = glm::clamp(oct_encode(glm::vec3{v.tangent}) * 0.5f + 0.5f, 0.f, 1.f);
+    c.tangent = static_cast<uint32_t>(std::round(t.x * 32767.f))
+                | (static_cast<uint32_t>(std::round(t.y * 32767.f)) << 15)
+                | (v.tangent.w < 0.f ? 1u << 31 : 0u);
+    c.uv = glm::packHalf2x16(v.uv);
+    c.color = glm::packUnorm4x8(v.color);
+    return c;
+}
+
+MaterialClass material_class(const MaterialData &material)
+{
+    // Runtime edits only touch the factors, so the class of a material never changes
+    if (material.colorImageIndex == -1 && material.materialImageIndex == -1
+        && material.normalMapIndex == -1)
+        return eUntextured;
+    if (material.materialImageIndex == -1 && material.normalMapIndex == -1)
+        return eBaseColorTexture;
+    return eFullPbr;
+}
+
+vk::AccelerationStructureInstanceKHR tlas_instance(const glm::mat4 &transform,
+                                                   const uint32_t customIndex)
+{
+    // VkTransformMatrixKHR is row-major 3x4
+    const glm::mat3x4 rows = glm::mat3x4(glm::transpose(transform));
+    vk::TransformMatrixKHR transformVk;
+    std::memcpy(&transformVk.matrix, glm::value_ptr(rows), sizeof(transformVk.matrix));
+    vk::AccelerationStructureInstanceKHR instance{};
+    instance.setTransform(transformVk);
+    // gl_InstanceCustomIndexEXT: first surface record of the mesh, the geometry index adds the rest
+    instance.setInstanceCustomIndex(customIndex);
+    instance.setMask(0xFF); //  Only be hit if rayMask & instance.mask != 0
+    // The SBT has one hit record per surface, in the same order as the surface storages
+    instance.setInstanceShaderBindingTableRecordOffset(customIndex);
+    return instance;
 }
 
 vk::Filter extract_filter(const fastgltf::Filter &filter)
@@ -742,6 +1073,46 @@ vk::SamplerMipmapMode extract_mipmap_mode(const fastgltf::Filter &filter)
     }
 }
 
+void GLTFObj::set_material(const uint32_t index, const MaterialData &data)
+{
+    materialTable.at(index) = data;
+    if (std::find(dirtyMaterials.begin(), dirtyMaterials.end(), index) == dirtyMaterials.end())
+        dirtyMaterials.push_back(index);
+}
+
+void GLTFObj::record_material_updates(const vk::CommandBuffer &cmd,
+                                      const vk::PipelineStageFlags2 &traceStages)
+{
+    if (dirtyMaterials.empty())
+        return;
+
+    // Previous frames may still be reading the table
+    vk::MemoryBarrier2 readBarrier{};
+    readBarrier.setSrcStageMask(traceStages);
+    readBarrier.setDstStageMask(vk::PipelineStageFlagBits2::eTransfer);
+    readBarrier.setDstAccessMask(vk::AccessFlagBits2::eTransferWrite);
+    vk::DependencyInfo readDepInfo{};
+    readDepInfo.setMemoryBarriers(readBarrier);
+    cmd.pipelineBarrier2(readDepInfo);
+
+    // One cache line each, small enough to go inline in the command buffer
+    for (const uint32_t i : dirtyMaterials)
+        cmd.updateBuffer(materialBuffer.buffer,
+                         i * sizeof(MaterialData),
+                         sizeof(MaterialData),
+                         &materialTable[i]);
+    dirtyMaterials.clear();
+
+    vk::MemoryBarrier2 writeBarrier{};
+    writeBarrier.setSrcStageMask(vk::PipelineStageFlagBits2::eTransfer);
+    writeBarrier.setSrcAccessMask(vk::AccessFlagBits2::eTransferWrite);
+    writeBarrier.setDstStageMask(traceStages);
+    writeBarrier.setDstAccessMask(vk::AccessFlagBits2::eShaderStorageRead);
+    vk::DependencyInfo writeDepInfo{};
+    writeDepInfo.setMemoryBarriers(writeBarrier);
+    cmd.pipelineBarrier2(writeDepInfo);
+}
+
 void GLTFObj::destroy(const vk::Device &device, const VmaAllocator &allocator)
 {
     for (const vk::Sampler &s : samplerQueue)
@@ -751,4 +1122,8 @@ void GLTFObj::destroy(const vk::Device &device, const VmaAllocator &allocator)
     }
     for (const auto &b : bufferQueue)
         utils::destroy_buffer(allocator, *b);
+    if (vertexArena)
+        vertexArena->destroy();
+    if (indexArena)
+        indexArena->destroy();
 }
@@ -5,43 +5,44 @@
 import vulkan;
 #endif
 
+#include "geometry_arena.hpp"
+#include "scene_cache.hpp"
+#include "texture_codec.hpp"
+#include "thread_pool.hpp"
 #include "types.hpp"
+#include "upload_manager.hpp"
 #include <fastgltf/core.hpp>
 #include <fastgltf/types.hpp>
 
-struct GLTFMaterial
+// Entry of the scene material table. Padded to a cache line so that a hit touches a single one
+struct MaterialData
 {
-    struct MaterialConstants
-    {
-        glm::vec4 baseColorFactor;
-        float metallicFactor;
-        float roughnessFactor;
-    };
-
-    struct MaterialResources
-    {
-        int colorImageIndex{-1};
-        int colorSamplerIndex{-1};
-        int materialImageIndex{-1};
-        int materialSamplerIndex{-1};
-        int normalMapIndex{-1};
-        int normalSamplerIndex{-1};
-        Buffer dataBuffer;
-    };
+    glm::vec4 baseColorFactor{1.f};
+    float metallicFactor{1.f};
+    float roughnessFactor{1.f};
+    int colorImageIndex{-1};
+    int colorSamplerIndex{-1};
+    int materialImageIndex{-1};
+    int materialSamplerIndex{-1};
+    int normalMapIndex{-1};
+    int normalSamplerIndex{-1};
+    uint32_t pad[4]{};
+};
+static_assert(sizeof(MaterialData) == 64);
 
+struct GLTFMaterial
+{
     enum struct MaterialPass : uint8_t { MainColor, Transparent, Other };
 
-    // Having the buffer in materialResources, the material constants are probably not needed here anymore
-    // MaterialConstants materialConstants;
     MaterialPass materialPass;
-    MaterialResources materialResources;
+    uint32_t index{0}; // Entry in GLTFObj::materialTable
 };
 
 struct Surface
 {
     uint32_t startIndex;
     uint32_t count;
-    uint32_t bufferIndex;
+    uint32_t bufferIndex; // Record in the scene surface storage buffer
     std::shared_ptr<GLTFMaterial> material;
 };
 
@@ -50,7 +51,14 @@ struct Mesh
     std::string name;
 
     std::vector<Surface> surfaces;
-    std::shared_ptr<Buffer> indexBuffer, vertexBuffer;
+    // Suballocated from the scene geometry arenas. Surface indices are relative to the slices.
+    // With compact vertices, vertices holds CompactVertex and positions the BLAS input
+    BufferSlice indices, vertices, positions;
+    uint32_t vertexCount{0};
+    vk::IndexType indexType{vk::IndexType::eUint32};
+    bool compactVertices{false};
+    // Object to mesh space. Not identity when the buffers belong to a translated copy
+    glm::mat4 geometryTransform{1.f};
 };
 
 struct Node
@@ -75,20 +83,19 @@ struct SurfaceStorage
 {
     vk::DeviceAddress indexBufferAddress;
     vk::DeviceAddress vertexBufferAddress;
-    vk::DeviceAddress materialConstantsBufferAddress;
-    int colorSamplerIndex{-1};
-    int colorImageIndex{-1};
-    int materialSamplerIndex{-1};
-    int materialImageIndex{-1};
-    int normalMapIndex{-1};
-    int normalSamplerIndex{-1};
+    vk::DeviceAddress positionBufferAddress{0};
+    uint32_t materialIndex{0};
     uint32_t startIndex{0};
     uint32_t count{0};
+    uint32_t flags{0}; // SurfaceFlags
 };
 
 struct MeshNode : Node
 {
     std::shared_ptr<Mesh> mesh;
+    // EXT_mesh_gpu_instancing: range of GLTFObj::gpuInstances. The node itself is not drawn then
+    uint32_t firstInstance{0};
+    uint32_t instanceCount{0};
 };
 
 struct GLTFObj
@@ -105,16 +112,37 @@ struct GLTFObj
     std::vector<std::shared_ptr<Node>> topNodes;
     std::vector<std::shared_ptr<MeshNode>> meshNodes;
 
-    std::vector<Buffer> surfaceUniformBuffers;
+    // Copies of the EXT_mesh_gpu_instancing nodes, expanded straight into TLAS records with their
+    // world transform and custom index. buildTLAS only fills in the BLAS reference, and releases
+    // them once copied
+    std::vector<vk::AccelerationStructureInstanceKHR> gpuInstances;
+
+    // One SurfaceStorage per mesh surface, indexed by Surface::bufferIndex
+    Buffer surfaceStorageBuffer;
+    // MaterialClass of every surface, same indexing. Picks the hit group of its SBT record
+    std::vector<MaterialClass> surfaceClasses;
 
     size_t surfaceCount{0};
 
+    // Material table, indexed by GLTFMaterial::index. The host copy is kept for runtime edits
+    std::vector<MaterialData> materialTable;
+    Buffer materialBuffer;
+    std::vector<uint32_t> dirtyMaterials;
+
+    // Edits the host entry. The device one is patched on the next record_material_updates
+    void set_material(const uint32_t index, const MaterialData &data);
+    // Patches the edited entries in place. Record it before the ray tracing commands, which run in
+    // traceStages
+    void record_material_updates(const vk::CommandBuffer &cmd,
+                                 const vk::PipelineStageFlags2 &traceStages);
+
     std::vector<vk::Sampler> samplers;
     std::vector<ImageData> images;
 
     void destroy(const vk::Device &device, const VmaAllocator &allocator);
 
     std::vector<std::shared_ptr<Buffer>> bufferQueue;
+    std::unique_ptr<GeometryArena> vertexArena, indexArena;
     std::vector<vk::Sampler> samplerQueue;
     std::vector<ImageData> imageQueue;
 };
@@ -123,12 +151,19 @@ vk::Filter extract_filter(const fastgltf::Filter &filter);
 
 vk::SamplerMipmapMode extract_mipmap_mode(const fastgltf::Filter &filter);
 
+// Quantizes the attributes of v, without its position
+CompactVertex compact_vertex(const Vertex &v);
+
+MaterialClass material_class(const MaterialData &material);
+
+// TLAS record of a mesh copy, without its BLAS reference
+vk::AccelerationStructureInstanceKHR tlas_instance(const glm::mat4 &transform,
+                                                   const uint32_t customIndex);
+
 class GLTFLoader
 {
 public:
-    GLTFLoader(const vk::Device &device,
-               const VmaAllocator &allocator,
-               const uint32_t queueFamilyIndex);
+    GLTFLoader(const vk::Device &device, const VmaAllocator &allocator, UploadManager &uploader);
 
     ~GLTFLoader() = default;
 
@@ -136,34 +171,87 @@ public:
 
     std::optional<std::shared_ptr<GLTFObj>> load_gltf_asset(const std::filesystem::path &path);
 
+    // Opt-in (--compact-vertices): position stream, quantized attributes and 16-bit indices when they fit
+    bool compactVertices{COMPACT_VERTICES};
+
+    // Opt-in (--dedup-translated): also merge meshes whose positions only differ by a translation
+    bool dedupTranslatedMeshes{DEDUP_TRANSLATED_MESHES};
+
+    // Read unchanged assets from their binary snapshot under cache/, and write it otherwise
+    bool useSceneCache{SCENE_CACHE};
+
+    // Set if the device samples BC formats. KTX2 textures are transcoded to BC7/BC5 then
+    bool bcTextures{false};
+    // Opt-in (--compress-textures): also encode PNG/JPEG textures to BC7/BC5 at import. Slow, but cached with the scene
+    bool compressTextures{COMPRESS_TEXTURES};
+
 private:
     const vk::Device &device;
     const VmaAllocator &allocator;
-    vk::Queue queue;
-    vk::CommandPool gltfCmdPool;
-    vk::CommandBuffer gltfCmd;
-    vk::Fence gltfFence;
+    UploadManager &uploader;
     ImageData checkerboardImage, whiteImage, blackImage, greyImage;
     vk::Sampler samplerLinear, samplerNearest;
-    fastgltf::Parser parser{};
+    fastgltf::Parser parser{fastgltf::Extensions::KHR_texture_basisu
+                            | fastgltf::Extensions::EXT_mesh_gpu_instancing};
+    std::unique_ptr<ThreadPool> threadPool;
+    std::unique_ptr<SceneCacheWriter> cacheWriter; // Only while loading a scene that missed the cache
+
+    // Empty scene with its geometry arenas
+    std::shared_ptr<GLTFObj> create_scene();
+
+    // Files referenced by URI, whose changes invalidate the cache
+    std::vector<CacheDependency> collect_dependencies(const std::filesystem::path &path);
+
+    // Rebuilds the scene from a cache snapshot. Throws std::runtime_error if it is corrupt
+    void load_cached_scene(SceneCacheReader &reader, std::shared_ptr<GLTFObj> &scene);
 
     void load_samplers(const fastgltf::Asset &asset, std::shared_ptr<GLTFObj> &scene);
 
     void load_images(const fastgltf::Asset &asset, std::shared_ptr<GLTFObj> &scene);
 
-    std::optional<ImageData> load_image(const fastgltf::Asset &asset,
-                                        const fastgltf::Image &fgltfImage);
+    // Target format of every image, from the material slots that sample it
+    std::vector<TextureEncoding> texture_encodings(const fastgltf::Asset &asset) const;
+
+    static DecodedImage decode_image(const fastgltf::Asset &asset,
+                                     const fastgltf::Image &fgltfImage,
+                                     const TextureEncoding encoding,
+                                     const bool compress);
+
+    // Stages a decoded image into the uploader, without flushing it
+    void upload_image(const DecodedImage &im, std::shared_ptr<GLTFObj> &scene);
+
+    // RGBA8 sampled image, filled through the uploader
+    ImageData create_texture(const vk::Extent3D &extent, const void *pixels);
+    // Same with any format and a mip chain, mipOffsets holding the offset of each level in data
+    ImageData create_texture(const vk::Extent3D &extent,
+                             const vk::Format format,
+                             const void *data,
+                             const vk::DeviceSize size,
+                             const std::span<const vk::DeviceSize> mipOffsets = {},
+                             const vk::ComponentMapping &swizzle = {});
 
     void load_materials(const fastgltf::Asset &asset,
                         std::shared_ptr<GLTFObj> &scene,
                         std::vector<std::shared_ptr<GLTFMaterial>> &vMaterials);
 
+    void upload_material_table(std::shared_ptr<GLTFObj> &scene);
+
     void load_meshes(const fastgltf::Asset &asset,
                      const std::vector<std::shared_ptr<GLTFMaterial>> &materials,
                      std::shared_ptr<GLTFObj> &scene,
                      std::vector<std::shared_ptr<Mesh>> &meshes);
 
-    Buffer create_surface_buffer(const std::shared_ptr<Mesh> &mesh, const Surface &surface);
+    // Packs the surfaces of every mesh into the scene surface storage buffer
+    void create_surface_storages(const std::vector<std::shared_ptr<Mesh>> &meshes,
+                                 std::shared_ptr<GLTFObj> &scene);
+
+    SurfaceStorage create_surface_storage(const std::shared_ptr<Mesh> &mesh, const Surface &surface);
+
+    // Appends the TRS copies of an EXT_mesh_gpu_instancing node to scene->gpuInstances
+    void load_gpu_instances(const fastgltf::Asset &asset,
+                            const fastgltf::Node &node,
+                            std::shared_ptr<GLTFObj> &scene,
+                            MeshNode &meshNode);
 
     // We will need to modify the meshes in order to accomodate each surface id.
     void load_nodes(const fastgltf::Asset &asset,
@@ -171,7 +259,12 @@ private:
                     std::shared_ptr<GLTFObj> &scene,
                     std::vector<std::shared_ptr<Node>> &nodes);
 
-    void create_mesh_buffers(const std::vector<uint32_t> &indices,
-                             const std::vector<Vertex> &vertices,
+    // Suballocates the mesh data from the scene arenas
+    void create_mesh_buffers(const std::span<const uint32_t> indices,
+                             const std::span<const Vertex> vertices,
+                             std::shared_ptr<GLTFObj> &scene,
                              std::shared_ptr<Mesh> &mesh);
+
+    // Reuses the buffers of an already loaded mesh with the same content
+    void share_mesh_buffers(const std::shared_ptr<Mesh> &sameMesh, std::shared_ptr<Mesh> &mesh);
 };
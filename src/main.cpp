@@ -9,10 +9,15 @@ VULKAN_HPP_DEFAULT_DISPATCH_LOADER_DYNAMIC_STORAGE
 #endif
 
 #include "engine.hpp"
+#include <chrono>
+#include <cstdio>
+#include <fstream>
 #include <print>
 
 int main(int argc, char *argv[])
 {
+    const auto startTime = std::chrono::steady_clock::now();
+
     // Load the basic functionality of the dynamic dispatcher
     VULKAN_HPP_DEFAULT_DISPATCHER.init();
 #ifndef USE_CXX20_MODULES
@@ -23,18 +28,100 @@ int main(int argc, char *argv[])
     VULKAN_HPP_DEFAULT_DISPATCHER.init(getInstanceProcAddr);
 #endif
 
-    // Read gltf filepath
+    // Read gltf filepath and the headless options
     std::filesystem::path gltfPath{std::string{PROJECT_DIR}
                                    + std::string{"/assets/ABeautifulGame.glb"}};
-    if (argc == 2) {
-        gltfPath = std::filesystem::path(argv[1]);
-    } else {
-        std::println("Correct usage: \'lrt <GLTF filepath>\'. Using default file {}",
+    bool headless{false}, gltfGiven{false};
+    OfflineRenderSettings settings{};
+    SceneOptions sceneOptions{};
+    std::filesystem::path benchmarkPath{}, tracePath{};
+    for (int i = 1; i < argc; i++) {
+        const std::string arg{argv[i]};
+        const bool hasValue = i + 1 < argc;
+        if (arg == "--headless") {
+            headless = true;
+        } else if (arg == "--benchmark" && hasValue) {
+            benchmarkPath = std::filesystem::path(argv[++i]);
+        } else if (arg == "--trace" && hasValue) {
+            tracePath = std::filesystem::path(argv[++i]);
+        } else if (arg == "--compact-blas") {
+            sceneOptions.compactBLAS = true;
+        } else if (arg == "--compact-vertices") {
+            sceneOptions.compactVertices = true;
+        } else if (arg == "--compress-textures") {
+            sceneOptions.compressTextures = true;
+        } else if (arg == "--dedup-translated") {
+            sceneOptions.dedupTranslatedMeshes = true;
+        } else if (arg == "--samples" && hasValue) {
+            settings.samples = static_cast<uint32_t>(std::stoul(argv[++i]));
+        } else if (arg == "--output" && hasValue) {
+            settings.output = std::filesystem::path(argv[++i]);
+        } else if (arg == "--size" && hasValue) {
+            if (std::sscanf(argv[++i], "%ux%u", &settings.extent.width, &settings.extent.height)
+                != 2)
+                throw std::runtime_error("--size expects <width>x<height>");
+        } else if (arg == "--camera" && hasValue) {
+            glm::vec3 &p = settings.cameraPosition, &t = settings.cameraTarget;
+            if (std::sscanf(argv[++i], "%f,%f,%f,%f,%f,%f", &p.x, &p.y, &p.z, &t.x, &t.y, &t.z)
+                != 6)
+                throw std::runtime_error("--camera expects <ex>,<ey>,<ez>,<tx>,<ty>,<tz>");
+            settings.customCamera = true;
+        } else if (arg == "--integrator" && hasValue) {
+            settings.integrator = parse_integrator(argv[++i]);
+        } else if (arg == "--backend" && hasValue) {
+            settings.backend = parse_backend(argv[++i]);
+        } else if (arg == "--depth" && hasValue) {
+            settings.pathDepth = static_cast<uint32_t>(std::stoul(argv[++i]));
+        } else if (!arg.starts_with("--") && !gltfGiven) {
+            gltfPath = std::filesystem::path(arg);
+            gltfGiven = true;
+        } else {
+            throw std::runtime_error("Unknown argument " + arg);
+        }
+    }
+    if (!gltfGiven) {
+        std::println("Correct usage: \'lrt <GLTF filepath> [--headless [--samples N] [--size WxH] "
+                     "[--output file.(png|exr|pfm)] [--camera ex,ey,ez,tx,ty,tz] "
+                     "[--integrator iterative|recursive] [--depth N] "
+                     "[--backend rt|wavefront|rayquery]] "
+                     "[--benchmark script] [--trace file.json] [--compact-blas] "
+                     "[--compact-vertices] [--compress-textures] [--dedup-translated]\'. "
+                     "Using default file {}",
                      gltfPath.c_str());
     }
 
-    std::unique_ptr<Engine> engine = std::make_unique<Engine>(gltfPath);
-    engine->run();
+    if (!benchmarkPath.empty()) {
+        // Benchmarks always run headless, without vsync nor UI in the measurements
+        const BenchmarkScript script{benchmarkPath};
+        std::unique_ptr<Engine> engine = std::make_unique<Engine>(gltfPath,
+                                                                   true,
+                                                                   script.extent,
+                                                                   sceneOptions);
+        if (!tracePath.empty())
+            engine->enable_trace(tracePath);
+        const std::chrono::duration<float> startup = std::chrono::steady_clock::now() - startTime;
+
+        BenchmarkResults results = engine->run_benchmark(script);
+        results.startupSeconds = startup.count();
+        const std::string report = benchmark_report(script, gltfPath, results);
+        std::print("{}", report);
+        if (!script.report.empty()) {
+            std::ofstream file(script.report);
+            file << report;
+        }
+        return 0;
+    }
+
+    std::unique_ptr<Engine> engine = std::make_unique<Engine>(gltfPath,
+                                                               headless,
+                                                               settings.extent,
+                                                               sceneOptions);
+    if (!tracePath.empty())
+        engine->enable_trace(tracePath);
+    if (headless)
+        engine->render_offline(settings);
+    else
+        engine->run();
 
     return 0;
 }
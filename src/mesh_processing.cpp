@@ -0,0 +1,219 @@
+#include "mesh_processing.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <fastgltf/glm_element_traits.hpp>
+#include <fastgltf/tools.hpp>
+#include <numeric>
+
+namespace {
+// Copies an accessor into one member of every vertex. Float accessors are read straight from the
+// buffer with fixed size copies, which the compiler turns into plain vector loads and stores.
+// Normalized integers and sparse accessors go through the converting fastgltf iterator
+template<typename T>
+void copy_attribute(const fastgltf::Asset &asset,
+                    const fastgltf::Accessor &accessor,
+                    const std::span<Vertex> vertices,
+                    T Vertex::*member)
+{
+    const size_t count = std::min(accessor.count, vertices.size());
+    if (accessor.componentType == fastgltf::ComponentType::Float && !accessor.normalized
+        && !accessor.sparse.has_value() && accessor.bufferViewIndex.has_value()
+        && fastgltf::getNumComponents(accessor.type) * sizeof(float) == sizeof(T)) {
+        const size_t viewIndex = accessor.bufferViewIndex.value();
+        const std::byte *src = fastgltf::DefaultBufferDataAdapter{}(asset, viewIndex).data()
+                               + accessor.byteOffset;
+        const size_t stride = asset.bufferViews[viewIndex].byteStride.value_or(sizeof(T));
+        for (size_t i = 0; i < count; i++)
+            std::memcpy(&(vertices[i].*member), src + i * stride, sizeof(T));
+        return;
+    }
+    fastgltf::iterateAccessorWithIndex<T>(asset, accessor, [&](const T &v, const size_t i) {
+        if (i < count)
+            vertices[i].*member = v;
+    });
+}
+
+// 64-bit multiply-xor over whole words, the tail is zero padded
+uint64_t hash_bytes(uint64_t hash, const void *data, const size_t size)
+{
+    const unsigned char *bytes = static_cast<const unsigned char *>(data);
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, bytes + i, 8);
+        hash = (hash ^ word) * 0x9E3779B97F4A7C15ull;
+        hash ^= hash >> 29;
+    }
+    if (i < size) {
+        uint64_t word = 0;
+        std::memcpy(&word, bytes + i, size - i);
+        hash = (hash ^ word) * 0x9E3779B97F4A7C15ull;
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
+
+// Any unit vector perpendicular to n, for vertices without a usable UV gradient
+glm::vec3 perpendicular(const glm::vec3 &n)
+{
+    const glm::vec3 t = std::abs(n.x) < 0.9f ? glm::cross(n, glm::vec3(1.f, 0.f, 0.f))
+                                             : glm::cross(n, glm::vec3(0.f, 1.f, 0.f));
+    const float length = glm::length(t);
+    return length > 1e-6f ? t / length : glm::vec3(1.f, 0.f, 0.f);
+}
+
+float corner_angle(const glm::vec3 &e1, const glm::vec3 &e2)
+{
+    const float lengths = glm::length(e1) * glm::length(e2);
+    if (lengths < 1e-12f)
+        return 0.f;
+    return std::acos(std::clamp(glm::dot(e1, e2) / lengths, -1.f, 1.f));
+}
+
+// Relative positions are hashed and compared at 2^-16 of the largest extent
+float snap_cell(const std::span<const Vertex> vertices)
+{
+    glm::vec3 lo = vertices.front().position, hi = lo;
+    for (const Vertex &v : vertices) {
+        lo = glm::min(lo, v.position);
+        hi = glm::max(hi, v.position);
+    }
+    const float extent = std::max({hi.x - lo.x, hi.y - lo.y, hi.z - lo.z});
+    return extent > 0.f ? extent / 65536.f : 1.f;
+}
+} // namespace
+
+void load_primitive(const fastgltf::Asset &asset,
+                    const fastgltf::Primitive &primitive,
+                    const std::span<uint32_t> indices,
+                    const std::span<Vertex> vertices,
+                    const uint32_t baseVertex)
+{
+    // Indices. Non indexed primitives draw their vertices in order
+    if (primitive.indicesAccessor.has_value())
+        fastgltf::copyFromAccessor<uint32_t>(asset,
+                                             asset.accessors[primitive.indicesAccessor.value()],
+                                             indices.data());
+    else
+        std::iota(indices.begin(), indices.end(), 0u);
+
+    // POSITION is always present in glTF 2
+    const auto copy = [&]<typename T>(const char *name, T Vertex::*member) {
+        const fastgltf::Attribute *attrib = primitive.findAttribute(name);
+        if (attrib == primitive.attributes.end())
+            return false;
+        copy_attribute(asset, asset.accessors[attrib->accessorIndex], vertices, member);
+        return true;
+    };
+    copy("POSITION", &Vertex::position);
+    copy("NORMAL", &Vertex::normal);
+    copy("TEXCOORD_0", &Vertex::uv);
+    copy("COLOR_0", &Vertex::color);
+    if (!copy("TANGENT", &Vertex::tangent))
+        generate_tangents(indices, vertices);
+
+    // Rebase after the tangents, which need the indices relative to this primitive
+    if (baseVertex != 0)
+        for (uint32_t &index : indices)
+            index += baseVertex;
+}
+
+void generate_tangents(const std::span<const uint32_t> indices, const std::span<Vertex> vertices)
+{
+    std::vector<glm::vec3> tangents(vertices.size(), glm::vec3(0.f));
+    std::vector<glm::vec3> bitangents(vertices.size(), glm::vec3(0.f));
+
+    for (size_t f = 0; f + 2 < indices.size(); f += 3) {
+        const uint32_t corners[3] = {indices[f], indices[f + 1], indices[f + 2]};
+        if (std::max({corners[0], corners[1], corners[2]}) >= vertices.size())
+            continue;
+        const Vertex &v0 = vertices[corners[0]];
+        const Vertex &v1 = vertices[corners[1]];
+        const Vertex &v2 = vertices[corners[2]];
+
+        const glm::vec3 e1 = v1.position - v0.position;
+        const glm::vec3 e2 = v2.position - v0.position;
+        const glm::vec2 d1 = v1.uv - v0.uv;
+        const glm::vec2 d2 = v2.uv - v0.uv;
+        const float det = d1.x * d2.y - d2.x * d1.y;
+        if (std::abs(det) < 1e-12f)
+            continue;
+        const glm::vec3 t = (e1 * d2.y - e2 * d1.y) / det;
+        const glm::vec3 b = (e2 * d1.x - e1 * d2.x) / det;
+        const float tLength = glm::length(t), bLength = glm::length(b);
+        if (tLength < 1e-12f || bLength < 1e-12f)
+            continue;
+
+        // Weighting by the corner angle makes the result independent of the triangulation
+        const glm::vec3 p[3] = {v0.position, v1.position, v2.position};
+        for (uint32_t c = 0; c < 3; c++) {
+            const float angle = corner_angle(p[(c + 1) % 3] - p[c], p[(c + 2) % 3] - p[c]);
+            tangents[corners[c]] += angle * t / tLength;
+            bitangents[corners[c]] += angle * b / bLength;
+        }
+    }
+
+    for (size_t i = 0; i < vertices.size(); i++) {
+        const glm::vec3 &n = vertices[i].normal;
+        // Gram-Schmidt against the normal
+        glm::vec3 t = tangents[i] - n * glm::dot(n, tangents[i]);
+        const float length = glm::length(t);
+        t = length > 1e-6f ? t / length : perpendicular(n);
+        const float handedness = glm::dot(glm::cross(n, t), bitangents[i]) < 0.f ? -1.f : 1.f;
+        vertices[i].tangent = glm::vec4(t, handedness);
+    }
+}
+
+uint64_t geometry_hash(const std::span<const uint32_t> indices,
+                       const std::span<const Vertex> vertices,
+                       const bool translationInvariant)
+{
+    const uint64_t counts[2] = {indices.size(), vertices.size()};
+    uint64_t hash = hash_bytes(0xcbf29ce484222325ull, counts, sizeof(counts));
+    hash = hash_bytes(hash, indices.data(), indices.size_bytes());
+    if (vertices.empty())
+        return hash;
+
+    // Everything after the position, which Vertex stores first and without padding
+    static_assert(offsetof(Vertex, position) == 0 && offsetof(Vertex, normal) == sizeof(glm::vec3));
+    constexpr size_t attributesSize = sizeof(Vertex) - sizeof(glm::vec3);
+    if (!translationInvariant)
+        return hash_bytes(hash, vertices.data(), vertices.size_bytes());
+
+    const glm::vec3 origin = vertices.front().position;
+    const float cell = snap_cell(vertices);
+    for (const Vertex &v : vertices) {
+        const glm::ivec3 snapped = glm::ivec3(glm::round((v.position - origin) / cell));
+        hash = hash_bytes(hash, &snapped, sizeof(snapped));
+        hash = hash_bytes(hash, &v.normal, attributesSize);
+    }
+    return hash;
+}
+
+bool same_geometry(const std::span<const uint32_t> indicesA,
+                   const std::span<const Vertex> verticesA,
+                   const std::span<const uint32_t> indicesB,
+                   const std::span<const Vertex> verticesB,
+                   const bool translationInvariant)
+{
+    if (indicesA.size() != indicesB.size() || verticesA.size() != verticesB.size()
+        || std::memcmp(indicesA.data(), indicesB.data(), indicesA.size_bytes()) != 0)
+        return false;
+    if (!translationInvariant || verticesA.empty())
+        return std::memcmp(verticesA.data(), verticesB.data(), verticesA.size_bytes()) == 0;
+
+    constexpr size_t attributesSize = sizeof(Vertex) - sizeof(glm::vec3);
+    // Instances placed by a float translation differ in the last bits of their positions
+    const float cell = snap_cell(verticesA);
+    const glm::vec3 originA = verticesA.front().position, originB = verticesB.front().position;
+    for (size_t v = 0; v < verticesA.size(); v++) {
+        const glm::vec3 relativeA = verticesA[v].position - originA;
+        const glm::vec3 relativeB = verticesB[v].position - originB;
+        if (glm::any(glm::greaterThan(glm::abs(relativeA - relativeB), glm::vec3(cell)))
+            || std::memcmp(&verticesA[v].normal, &verticesB[v].normal, attributesSize) != 0)
+            return false;
+    }
+    return true;
+}
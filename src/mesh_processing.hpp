@@ -0,0 +1,35 @@
+#pragma once
+
+#include "types.hpp"
+#include <fastgltf/types.hpp>
+#include <span>
+
+// Fills the index and vertex ranges of a single primitive. indices gets baseVertex added, so
+// that the primitives of a mesh share its vertex array. Missing tangents are generated.
+// Thread safe, it only reads the asset and writes the given ranges
+void load_primitive(const fastgltf::Asset &asset,
+                    const fastgltf::Primitive &primitive,
+                    const std::span<uint32_t> indices,
+                    const std::span<Vertex> vertices,
+                    const uint32_t baseVertex);
+
+// MikkTSpace style tangents: per face tangent frames from the UV gradients, accumulated on the
+// vertices weighted by the corner angle, then orthogonalized against the normal. The handedness
+// goes in w. indices are relative to vertices
+void generate_tangents(const std::span<const uint32_t> indices, const std::span<Vertex> vertices);
+
+// Content hash of the mesh geometry, for deduplication. Translation invariant hashes the
+// positions relative to the first vertex, snapped to 2^-16 of the mesh extent, so that copies
+// placed at different spots in world space hash the same. The other attributes hash bitwise.
+// Only a bucket key, matches have to be confirmed with same_geometry
+uint64_t geometry_hash(const std::span<const uint32_t> indices,
+                       const std::span<const Vertex> vertices,
+                       const bool translationInvariant);
+
+// Exact comparison of two meshes: bitwise indices and vertices. Translation invariant compares
+// the positions relative to the first vertex of each mesh instead, within the hash snapping cell
+bool same_geometry(const std::span<const uint32_t> indicesA,
+                   const std::span<const Vertex> verticesA,
+                   const std::span<const uint32_t> indicesB,
+                   const std::span<const Vertex> verticesB,
+                   const bool translationInvariant);
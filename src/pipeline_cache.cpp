@@ -0,0 +1,75 @@
+#include "pipeline_cache.hpp"
+#include <cstring>
+#include <format>
+#include <fstream>
+#include <print>
+
+namespace {
+std::filesystem::path pipeline_cache_path(const vk::PhysicalDeviceProperties &properties)
+{
+    std::string uuid;
+    for (const uint8_t b : properties.pipelineCacheUUID)
+        uuid += std::format("{:02x}", b);
+    return std::filesystem::path(std::string(PROJECT_DIR)) / "cache"
+           / std::format("pipelines_{}_{:08x}.bin", uuid, properties.driverVersion);
+}
+
+// Same device and driver build as the one that wrote the data
+bool header_matches(const std::vector<char> &data, const vk::PhysicalDeviceProperties &properties)
+{
+    VkPipelineCacheHeaderVersionOne header{};
+    if (data.size() < sizeof(header))
+        return false;
+    std::memcpy(&header, data.data(), sizeof(header));
+    return header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE
+           && header.vendorID == properties.vendorID && header.deviceID == properties.deviceID
+           && std::memcmp(header.pipelineCacheUUID,
+                          properties.pipelineCacheUUID.data(),
+                          VK_UUID_SIZE)
+                  == 0;
+}
+} // namespace
+
+PipelineCache::PipelineCache(const vk::Device &device,
+                             const vk::PhysicalDeviceProperties &properties)
+    : device{device}
+    , path{pipeline_cache_path(properties)}
+{
+    std::vector<char> data;
+    if (std::ifstream file{path, std::ios::binary | std::ios::ate}) {
+        data.resize(static_cast<size_t>(file.tellg()));
+        file.seekg(0);
+        file.read(data.data(), static_cast<std::streamsize>(data.size()));
+        if (!file || !header_matches(data, properties)) {
+            std::println("Ignoring the pipeline cache {}", path.string());
+            data.clear();
+        }
+    }
+
+    vk::PipelineCacheCreateInfo createInfo{};
+    createInfo.setInitialDataSize(data.size());
+    createInfo.setPInitialData(data.empty() ? nullptr : data.data());
+    cache = device.createPipelineCache(createInfo);
+}
+
+void PipelineCache::destroy()
+{
+    const std::vector<uint8_t> data = device.getPipelineCacheData(cache);
+    device.destroyPipelineCache(cache);
+
+    // Written next to the final path and renamed, a crash never leaves half a cache behind
+    std::error_code ec;
+    std::filesystem::create_directories(path.parent_path(), ec);
+    const std::filesystem::path tmpPath = path.string() + ".tmp";
+    {
+        std::ofstream file{tmpPath, std::ios::binary | std::ios::trunc};
+        file.write(reinterpret_cast<const char *>(data.data()),
+                   static_cast<std::streamsize>(data.size()));
+        if (!file) {
+            std::println("Could not write the pipeline cache {}", path.string());
+            std::filesystem::remove(tmpPath, ec);
+            return;
+        }
+    }
+    std::filesystem::rename(tmpPath, path, ec);
+}
@@ -0,0 +1,29 @@
+#pragma once
+#ifndef USE_CXX20_MODULES
+#include <vulkan/vulkan.hpp>
+#else
+import vulkan;
+#endif
+
+#include "types.hpp"
+#include <filesystem>
+
+// vk::PipelineCache persisted under cache/. The file is named after the pipeline cache UUID and
+// the driver version, and its header is checked against the device before handing it to the
+// driver, so a driver update or another GPU starts from an empty cache instead of a rejected one
+class PipelineCache
+{
+public:
+    PipelineCache(const vk::Device &device, const vk::PhysicalDeviceProperties &properties);
+    ~PipelineCache() = default;
+
+    // Writes the cache back to disk and destroys it
+    void destroy();
+
+    // Internally synchronized, pipelines can be created from several threads at once
+    vk::PipelineCache cache;
+
+private:
+    const vk::Device &device;
+    std::filesystem::path path;
+};
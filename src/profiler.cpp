@@ -0,0 +1,296 @@
+#include "profiler.hpp"
+#include <algorithm>
+#include <format>
+#include <fstream>
+#include <imgui.h>
+#include <print>
+
+thread_local GpuProfiler::Section *GpuProfiler::Section::active = nullptr;
+
+GpuProfiler::GpuProfiler(const vk::Device &device,
+                         const vk::PhysicalDevice &physicalDevice,
+                         const float timestampPeriod)
+    : device{device}
+    , timestampPeriod{timestampPeriod}
+{
+    // Queues without valid bits cannot write timestamps at all
+    for (const auto &family : physicalDevice.getQueueFamilyProperties())
+        timestampValidBits.push_back(family.timestampValidBits);
+    timestampsSupported = timestampPeriod > 0.f;
+    if (!timestampsSupported)
+        std::println("GPU timestamps not supported, profiler disabled");
+}
+
+void GpuProfiler::destroy(std::vector<FrameData> &frames)
+{
+    for (auto &f : frames) {
+        if (f.queryPool)
+            device.destroyQueryPool(f.queryPool);
+        f.queryPool = nullptr;
+    }
+    for (const auto &[family, pool] : asyncPools)
+        device.destroyQueryPool(pool.queryPool);
+    asyncPools.clear();
+    finish_trace();
+}
+
+void GpuProfiler::create_frame_pools(std::vector<FrameData> &frames, const uint32_t queueFamilyIndex)
+{
+    if (!supported(queueFamilyIndex))
+        return;
+    frameQueueFamily = queueFamilyIndex;
+    vk::QueryPoolCreateInfo poolInfo{};
+    poolInfo.setQueryType(vk::QueryType::eTimestamp);
+    poolInfo.setQueryCount(2 * MAX_TIMESTAMP_SCOPES);
+    for (auto &f : frames)
+        f.queryPool = device.createQueryPool(poolInfo);
+}
+
+bool GpuProfiler::supported(const uint32_t queueFamilyIndex) const
+{
+    return timestampsSupported && queueFamilyIndex < timestampValidBits.size()
+           && timestampValidBits[queueFamilyIndex] > 0;
+}
+
+void GpuProfiler::begin_frame(const vk::CommandBuffer &cmd, FrameData &frame)
+{
+    if (!frame.queryPool)
+        return;
+
+    const uint32_t numScopes = static_cast<uint32_t>(frame.timestampScopes.size());
+    if (numScopes > 0) {
+        // The frame fence has been waited, so this does not block
+        std::vector<uint64_t> ticks(2 * numScopes);
+        const vk::Result res = device.getQueryPoolResults(frame.queryPool,
+                                                          0,
+                                                          2 * numScopes,
+                                                          ticks.size() * sizeof(uint64_t),
+                                                          ticks.data(),
+                                                          sizeof(uint64_t),
+                                                          vk::QueryResultFlagBits::e64);
+        if (res == vk::Result::eSuccess) {
+            for (uint32_t i = 0; i < numScopes; i++) {
+                const TraceEvent event{frame.timestampScopes[i],
+                                       frameQueueFamily,
+                                       ticks[2 * i],
+                                       ticks[2 * i + 1]};
+                scopeStats[event.name].add(static_cast<float>(event.end - event.begin)
+                                           * timestampPeriod * 1e-6f);
+                record(event, false);
+            }
+        }
+        frame.timestampScopes.clear();
+    }
+    cmd.resetQueryPool(frame.queryPool, 0, 2 * MAX_TIMESTAMP_SCOPES);
+}
+
+uint32_t GpuProfiler::begin_scope(const vk::CommandBuffer &cmd,
+                                  FrameData &frame,
+                                  const std::string &name)
+{
+    if (!frame.queryPool || frame.timestampScopes.size() >= MAX_TIMESTAMP_SCOPES)
+        return MAX_TIMESTAMP_SCOPES;
+    const uint32_t scope = static_cast<uint32_t>(frame.timestampScopes.size());
+    frame.timestampScopes.push_back(name);
+    cmd.writeTimestamp2(vk::PipelineStageFlagBits2::eAllCommands, frame.queryPool, 2 * scope);
+    return scope;
+}
+
+void GpuProfiler::end_scope(const vk::CommandBuffer &cmd,
+                            const FrameData &frame,
+                            const uint32_t scope)
+{
+    if (scope >= MAX_TIMESTAMP_SCOPES)
+        return;
+    cmd.writeTimestamp2(vk::PipelineStageFlagBits2::eAllCommands, frame.queryPool, 2 * scope + 1);
+}
+
+uint32_t GpuProfiler::begin_async(const vk::CommandBuffer &cmd, const uint32_t queueFamilyIndex)
+{
+    if (!supported(queueFamilyIndex))
+        return NO_TIMESTAMPS;
+    const auto [it, created] = asyncPools.try_emplace(queueFamilyIndex);
+    AsyncPool &pool = it->second;
+    if (created) {
+        vk::QueryPoolCreateInfo poolInfo{};
+        poolInfo.setQueryType(vk::QueryType::eTimestamp);
+        poolInfo.setQueryCount(2 * MAX_ASYNC_TIMESTAMP_PAIRS);
+        pool.queryPool = device.createQueryPool(poolInfo);
+        for (uint32_t p = MAX_ASYNC_TIMESTAMP_PAIRS; p > 0; p--)
+            pool.freePairs.push_back(p - 1);
+    }
+    if (pool.freePairs.empty())
+        return NO_TIMESTAMPS;
+    const uint32_t pair = pool.freePairs.back();
+    pool.freePairs.pop_back();
+    // Host reset, like the sections: the pair is not in use by any submission
+    device.resetQueryPool(pool.queryPool, 2 * pair, 2);
+    cmd.writeTimestamp2(vk::PipelineStageFlagBits2::eAllCommands, pool.queryPool, 2 * pair);
+    return pair;
+}
+
+void GpuProfiler::end_async(const vk::CommandBuffer &cmd,
+                            const uint32_t queueFamilyIndex,
+                            const uint32_t pair)
+{
+    if (pair == NO_TIMESTAMPS)
+        return;
+    cmd.writeTimestamp2(vk::PipelineStageFlagBits2::eAllCommands,
+                        asyncPools.at(queueFamilyIndex).queryPool,
+                        2 * pair + 1);
+}
+
+void GpuProfiler::collect_async(const std::string &name,
+                                const uint32_t queueFamilyIndex,
+                                const uint32_t pair)
+{
+    if (pair == NO_TIMESTAMPS)
+        return;
+    AsyncPool &pool = asyncPools.at(queueFamilyIndex);
+    pool.freePairs.push_back(pair);
+    std::array<uint64_t, 2> ticks{};
+    const vk::Result res = device.getQueryPoolResults(pool.queryPool,
+                                                      2 * pair,
+                                                      2,
+                                                      sizeof(ticks),
+                                                      ticks.data(),
+                                                      sizeof(uint64_t),
+                                                      vk::QueryResultFlagBits::e64);
+    if (res != vk::Result::eSuccess)
+        return;
+    scopeStats[name].add(static_cast<float>(ticks[1] - ticks[0]) * timestampPeriod * 1e-6f);
+    record(TraceEvent{name, queueFamilyIndex, ticks[0], ticks[1]}, true);
+}
+
+void GpuProfiler::record(const TraceEvent &event, const bool section)
+{
+    if (traceFile.is_open())
+        write_event(event);
+    // Sections are rare, keep a few in case a trace is enabled later. Frame scopes are not kept
+    else if (section && pendingEvents.size() < MAX_PENDING_TRACE_EVENTS)
+        pendingEvents.push_back(event);
+}
+
+void GpuProfiler::ScopeStats::add(const float ms)
+{
+    samples[count % WINDOW] = ms;
+    count++;
+    lastMs = ms;
+}
+
+float GpuProfiler::ScopeStats::average() const
+{
+    const size_t n = std::min(count, WINDOW);
+    if (n == 0)
+        return 0.f;
+    float sum = 0.f;
+    for (size_t i = 0; i < n; i++)
+        sum += samples[i];
+    return sum / static_cast<float>(n);
+}
+
+void GpuProfiler::draw_imgui() const
+{
+    if (!timestampsSupported)
+        return;
+    for (const auto &[name, s] : scopeStats)
+        ImGui::Text("%s: %.3f ms", name.c_str(), s.average());
+}
+
+void GpuProfiler::enable_trace(const std::filesystem::path &path)
+{
+    traceFile.open(path);
+    if (!traceFile.is_open()) {
+        std::println("Could not write the GPU trace to {}", path.c_str());
+        return;
+    }
+    traceFile << "{\"traceEvents\":[\n";
+    // The earliest pending timestamp of each queue is its origin
+    for (const TraceEvent &e : pendingEvents) {
+        const auto [origin, inserted] = traceOrigins.try_emplace(e.queueFamilyIndex, e.begin);
+        origin->second = std::min(origin->second, e.begin);
+    }
+    for (const TraceEvent &e : pendingEvents)
+        write_event(e);
+    pendingEvents.clear();
+    std::println("Writing the GPU trace to {}", path.c_str());
+}
+
+void GpuProfiler::write_event(const TraceEvent &e)
+{
+    // Timestamps are relative to the first one of their queue
+    const uint64_t origin = traceOrigins.try_emplace(e.queueFamilyIndex, e.begin).first->second;
+    const float usPerTick = timestampPeriod * 1e-3f;
+    traceFile << std::format("{}{{\"name\":\"{}\",\"ph\":\"X\",\"pid\":0,\"tid\":{},"
+                             "\"ts\":{:.3f},\"dur\":{:.3f}}}\n",
+                             (tracedEvents > 0) ? "," : "",
+                             e.name,
+                             e.queueFamilyIndex,
+                             static_cast<double>(static_cast<int64_t>(e.begin - origin)) * usPerTick,
+                             static_cast<double>(e.end - e.begin) * usPerTick);
+    tracedEvents++;
+}
+
+void GpuProfiler::finish_trace()
+{
+    if (!traceFile.is_open())
+        return;
+    traceFile << "],\n\"displayTimeUnit\":\"ms\"}\n";
+    traceFile.close();
+    std::println("GPU trace written, {} events", tracedEvents);
+}
+
+GpuProfiler::Section::Section(GpuProfiler *profiler,
+                              const std::string &name,
+                              const uint32_t queueFamilyIndex)
+    : profiler{(profiler && profiler->supported(queueFamilyIndex)) ? profiler : nullptr}
+    , name{name}
+    , queueFamilyIndex{queueFamilyIndex}
+    , previous{active}
+{
+    if (!this->profiler)
+        return;
+    vk::QueryPoolCreateInfo poolInfo{};
+    poolInfo.setQueryType(vk::QueryType::eTimestamp);
+    poolInfo.setQueryCount(2);
+    queryPool = this->profiler->device.createQueryPool(poolInfo);
+    active = this;
+}
+
+GpuProfiler::Section::~Section()
+{
+    if (!profiler)
+        return;
+    active = previous;
+    profiler->device.destroyQueryPool(queryPool);
+    profiler->scopeStats[name].add(totalMs);
+}
+
+void GpuProfiler::Section::begin(const vk::CommandBuffer &cmd)
+{
+    // Host reset: vkCmdResetQueryPool is not available on transfer-only queues. The previous
+    // submission has already been waited by utils::cmd_submit
+    profiler->device.resetQueryPool(queryPool, 0, 2);
+    cmd.writeTimestamp2(vk::PipelineStageFlagBits2::eAllCommands, queryPool, 0);
+}
+
+void GpuProfiler::Section::end(const vk::CommandBuffer &cmd)
+{
+    cmd.writeTimestamp2(vk::PipelineStageFlagBits2::eAllCommands, queryPool, 1);
+}
+
+void GpuProfiler::Section::collect()
+{
+    std::array<uint64_t, 2> ticks{};
+    const vk::Result res = profiler->device.getQueryPoolResults(queryPool,
+                                                                0,
+                                                                2,
+                                                                sizeof(ticks),
+                                                                ticks.data(),
+                                                                sizeof(uint64_t),
+                                                                vk::QueryResultFlagBits::e64);
+    if (res != vk::Result::eSuccess)
+        return;
+    totalMs += static_cast<float>(ticks[1] - ticks[0]) * profiler->timestampPeriod * 1e-6f;
+    profiler->record(TraceEvent{name, queueFamilyIndex, ticks[0], ticks[1]}, true);
+}
@@ -0,0 +1,126 @@
+#pragma once
+#ifndef USE_CXX20_MODULES
+#include <vulkan/vulkan.hpp>
+#else
+import vulkan;
+#endif
+
+#include "types.hpp"
+#include <array>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+// GPU timestamp profiler. Frame scopes are written into the per-frame query pool and read back
+// when the frame slot is reused, after its fence, so reading them never stalls.
+// One-off blocking submissions (AS builds) are timed with a Section. Asynchronous ones (upload
+// batches) take a timestamp pair from the pool of their queue family and give it back once done
+class GpuProfiler
+{
+public:
+    GpuProfiler(const vk::Device &device,
+                const vk::PhysicalDevice &physicalDevice,
+                const float timestampPeriod);
+    ~GpuProfiler() = default;
+
+    void destroy(std::vector<FrameData> &frames);
+
+    void create_frame_pools(std::vector<FrameData> &frames, const uint32_t queueFamilyIndex);
+
+    // Reads back the scopes of the last use of this frame slot and resets its pool.
+    // Must be recorded before any scope, once the frame fence has been waited
+    void begin_frame(const vk::CommandBuffer &cmd, FrameData &frame);
+    uint32_t begin_scope(const vk::CommandBuffer &cmd, FrameData &frame, const std::string &name);
+    void end_scope(const vk::CommandBuffer &cmd, const FrameData &frame, const uint32_t scope);
+
+    // Timestamps around an asynchronous submission. Returns the pair to end and collect it with,
+    // or NO_TIMESTAMPS if the queue cannot write them or every pair is in use
+    static constexpr uint32_t NO_TIMESTAMPS = ~0u;
+    uint32_t begin_async(const vk::CommandBuffer &cmd, const uint32_t queueFamilyIndex);
+    void end_async(const vk::CommandBuffer &cmd,
+                   const uint32_t queueFamilyIndex,
+                   const uint32_t pair);
+    // Once the submission has completed: records it as a scope and frees the pair
+    void collect_async(const std::string &name,
+                       const uint32_t queueFamilyIndex,
+                       const uint32_t pair);
+
+    // Times every utils::cmd_submit issued on its queue family while it is alive
+    class Section
+    {
+    public:
+        Section(GpuProfiler *profiler, const std::string &name, const uint32_t queueFamilyIndex);
+        ~Section();
+
+        void begin(const vk::CommandBuffer &cmd);
+        void end(const vk::CommandBuffer &cmd);
+        // After the submission fence
+        void collect();
+
+        static thread_local Section *active;
+
+    private:
+        GpuProfiler *profiler;
+        std::string name;
+        uint32_t queueFamilyIndex;
+        vk::QueryPool queryPool;
+        Section *previous;
+        float totalMs{0.f};
+    };
+
+    struct ScopeStats
+    {
+        static constexpr size_t WINDOW = 64;
+        std::array<float, WINDOW> samples{};
+        size_t count{0};
+        float lastMs{0.f};
+
+        void add(const float ms);
+        float average() const;
+    };
+
+    bool enabled() const { return timestampsSupported; }
+    const std::map<std::string, ScopeStats> &stats() const { return scopeStats; }
+
+    // Rolling averages, to be called inside an imgui window
+    void draw_imgui() const;
+
+    // Streams every scope to a chrome://tracing file, finished on destroy(). The sections timed
+    // before the call are written too
+    void enable_trace(const std::filesystem::path &path);
+
+private:
+    const vk::Device &device;
+    float timestampPeriod; // ns per tick
+    bool timestampsSupported{false};
+    std::vector<uint32_t> timestampValidBits; // per queue family
+
+    std::map<std::string, ScopeStats> scopeStats;
+
+    struct AsyncPool
+    {
+        vk::QueryPool queryPool;
+        std::vector<uint32_t> freePairs;
+    };
+    std::map<uint32_t, AsyncPool> asyncPools; // Per queue family, created on first use
+
+    struct TraceEvent
+    {
+        std::string name;
+        uint32_t queueFamilyIndex; // The tid in the trace
+        uint64_t begin, end;       // ticks
+    };
+    uint32_t frameQueueFamily{0};
+    std::ofstream traceFile;
+    size_t tracedEvents{0};
+    std::vector<TraceEvent> pendingEvents; // Sections timed before enable_trace
+    // First timestamp of each queue family. Different queues may not share a time base
+    std::map<uint32_t, uint64_t> traceOrigins;
+
+    bool supported(const uint32_t queueFamilyIndex) const;
+    void record(const TraceEvent &event, const bool section);
+    void write_event(const TraceEvent &event);
+    void finish_trace();
+};
@@ -0,0 +1,112 @@
+#include "ray_query.hpp"
+#include "utils.hpp"
+#include <array>
+#include <cstddef>
+#include <utility>
+
+namespace {
+// Specialization data of the kernel, the miss and closest-hit constants it shares
+struct RayQueryConstants
+{
+    vk::Bool32 envMap;
+    vk::Bool32 presampled;
+};
+} // namespace
+
+RayQueryRenderer::RayQueryRenderer(const vk::Device &device,
+                                   const vk::PipelineCache &pipelineCache,
+                                   const std::vector<vk::DescriptorSetLayout> &descSetLayouts)
+    : device{device}
+    , pipelineCache{pipelineCache}
+{
+    module = utils::load_shader(device, RAY_QUERY_SHADER);
+
+    vk::PushConstantRange pushConstantRange{};
+    pushConstantRange.setOffset(0);
+    pushConstantRange.setSize(sizeof(RayPush));
+    pushConstantRange.setStageFlags(vk::ShaderStageFlagBits::eCompute);
+
+    vk::PipelineLayoutCreateInfo pipelineLayoutCreateInfo{};
+    pipelineLayoutCreateInfo.setPushConstantRanges(pushConstantRange);
+    pipelineLayoutCreateInfo.setSetLayouts(descSetLayouts);
+    pipelineLayout = device.createPipelineLayout(pipelineLayoutCreateInfo);
+}
+
+void RayQueryRenderer::build_pipeline(const SpecializationConstantsClosestHit &constantsCH,
+                                      const SpecializationConstantsMiss &constantsMiss)
+{
+    if (pipeline)
+        device.destroyPipeline(pipeline);
+    pipeline = create_pipeline(constantsCH, constantsMiss);
+}
+
+vk::Pipeline RayQueryRenderer::create_pipeline(
+    const SpecializationConstantsClosestHit &constantsCH,
+    const SpecializationConstantsMiss &constantsMiss) const
+{
+    const RayQueryConstants constants{constantsMiss.envMap, constantsCH.presampled};
+    std::array<vk::SpecializationMapEntry, 2> specMapEntries
+        = {vk::SpecializationMapEntry{0,
+                                      offsetof(RayQueryConstants, envMap),
+                                      sizeof(vk::Bool32)},
+           vk::SpecializationMapEntry{3,
+                                      offsetof(RayQueryConstants, presampled),
+                                      sizeof(vk::Bool32)}};
+    vk::SpecializationInfo specInfo{};
+    specInfo.setMapEntries(specMapEntries);
+    specInfo.setDataSize(sizeof(RayQueryConstants));
+    specInfo.setPData(&constants);
+
+    vk::PipelineShaderStageCreateInfo stage{};
+    stage.setPName("main");
+    stage.setStage(vk::ShaderStageFlagBits::eCompute);
+    stage.setModule(module);
+    stage.setPSpecializationInfo(&specInfo);
+
+    vk::ComputePipelineCreateInfo pipelineInfo{};
+    pipelineInfo.setStage(stage);
+    pipelineInfo.setLayout(pipelineLayout);
+
+    auto [res, val] = device.createComputePipeline(pipelineCache, pipelineInfo);
+    VK_CHECK_RES(res);
+    return val;
+}
+
+vk::Pipeline RayQueryRenderer::set_pipeline(const vk::Pipeline &newPipeline)
+{
+    return std::exchange(pipeline, newPipeline);
+}
+
+void RayQueryRenderer::record(const vk::CommandBuffer &cmd,
+                              const std::vector<vk::DescriptorSet> &descriptorSets,
+                              const RayPush &rayPush,
+                              const vk::Extent2D &extent) const
+{
+    cmd.bindPipeline(vk::PipelineBindPoint::eCompute, pipeline);
+
+    vk::BindDescriptorSetsInfo bindSetsInfo{};
+    bindSetsInfo.setDescriptorSets(descriptorSets);
+    bindSetsInfo.setStageFlags(vk::ShaderStageFlagBits::eCompute);
+    bindSetsInfo.setLayout(pipelineLayout);
+    bindSetsInfo.setFirstSet(0);
+    cmd.bindDescriptorSets2(bindSetsInfo);
+
+    vk::PushConstantsInfo pushInfo{};
+    pushInfo.setLayout(pipelineLayout);
+    pushInfo.setStageFlags(vk::ShaderStageFlagBits::eCompute);
+    pushInfo.setSize(sizeof(RayPush));
+    pushInfo.setValues<RayPush>(rayPush);
+    pushInfo.setOffset(0);
+    cmd.pushConstants2(pushInfo);
+
+    // 8x8 groups
+    cmd.dispatch((extent.width + 7) / 8, (extent.height + 7) / 8, 1);
+}
+
+void RayQueryRenderer::destroy()
+{
+    if (pipeline)
+        device.destroyPipeline(pipeline);
+    device.destroyShaderModule(module);
+    device.destroyPipelineLayout(pipelineLayout);
+}
@@ -0,0 +1,49 @@
+#pragma once
+#ifndef USE_CXX20_MODULES
+#include <vulkan/vulkan.hpp>
+#else
+import vulkan;
+#endif
+
+#include "types.hpp"
+#include <vector>
+
+// Path tracer in a single compute kernel with inline ray queries, one invocation per pixel. Reuses
+// the TLAS, the descriptor sets and the shading code of the RT pipeline without an SBT or any
+// recursion, so it only needs VK_KHR_ray_query. The fallback when the device has no
+// VK_KHR_ray_tracing_pipeline. Always runs the iterative integrator, up to RayPush::pathDepth vertices
+class RayQueryRenderer
+{
+public:
+    // descSetLayouts are the ones of the RT pipeline: {rt, UAB}
+    RayQueryRenderer(const vk::Device &device,
+                     const vk::PipelineCache &pipelineCache,
+                     const std::vector<vk::DescriptorSetLayout> &descSetLayouts);
+    ~RayQueryRenderer() = default;
+
+    // Same constants as the RT pipeline. Not in use by any frame in flight
+    void build_pipeline(const SpecializationConstantsClosestHit &constantsCH = {},
+                        const SpecializationConstantsMiss &constantsMiss = {});
+
+    // Compiles a variant without touching the current one. Thread safe
+    vk::Pipeline create_pipeline(const SpecializationConstantsClosestHit &constantsCH,
+                                 const SpecializationConstantsMiss &constantsMiss) const;
+    // Makes a variant current and returns the previous one, which frames in flight may still use
+    vk::Pipeline set_pipeline(const vk::Pipeline &newPipeline);
+
+    // One sample per pixel into the draw and accumulation images
+    void record(const vk::CommandBuffer &cmd,
+                const std::vector<vk::DescriptorSet> &descriptorSets,
+                const RayPush &rayPush,
+                const vk::Extent2D &extent) const;
+
+    void destroy();
+
+private:
+    const vk::Device &device;
+    const vk::PipelineCache pipelineCache;
+
+    vk::PipelineLayout pipelineLayout;
+    vk::ShaderModule module;
+    vk::Pipeline pipeline;
+};
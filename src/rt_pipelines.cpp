@@ -20,10 +20,11 @@ void RtPipelineBuilder::create_shader_stages()
     stage.setModule(utils::load_shader(device, SIMPLE_SHADOW_SHADER));
     stage.setStage(vk::ShaderStageFlagBits::eMissKHR);
     shaderStages[eShadow] = stage;
-    // Hit Group - Closest Hit
+    // Hit Groups - Closest Hit, specialized per material class in buildPipeline
     stage.setModule(utils::load_shader(device, SIMPLE_RCHIT_SHADER));
     stage.setStage(vk::ShaderStageFlagBits::eClosestHitKHR);
-    shaderStages[eClosestHit] = stage;
+    for (uint32_t c = 0; c < eMaterialClassCount; c++)
+        shaderStages[eClosestHit + c] = stage;
 }
 
 void RtPipelineBuilder::create_shader_groups()
@@ -50,11 +51,13 @@ void RtPipelineBuilder::create_shader_groups()
     group.setGeneralShader(eShadow);
     shaderGroups.push_back(group);
 
-    // closest hit shader
+    // closest hit shaders, one hit group per material class
     group.setType(vk::RayTracingShaderGroupTypeKHR::eTrianglesHitGroup);
     group.setGeneralShader(vk::ShaderUnusedKHR);
-    group.setClosestHitShader(eClosestHit);
-    shaderGroups.push_back(group);
+    for (uint32_t c = 0; c < eMaterialClassCount; c++) {
+        group.setClosestHitShader(eClosestHit + c);
+        shaderGroups.push_back(group);
+    }
 }
 
 // The first descriptor should be the one with the AS and the output image!
@@ -78,9 +81,12 @@ vk::PipelineLayout RtPipelineBuilder::buildPipelineLayout(
 
 vk::Pipeline RtPipelineBuilder::buildPipeline(const vk::PipelineLayout &pipelineLayout,
                                               const SpecializationConstantsClosestHit &constantsCH,
-                                              const SpecializationConstantsMiss &constantsMiss)
+                                              const SpecializationConstantsMiss &constantsMiss) const
 {
-    std::array<vk::SpecializationMapEntry, 4> specMapEntriesCH
+    // Local copy, the specialization pointers differ per build
+    std::array<vk::PipelineShaderStageCreateInfo, eShaderStageCount> stages = shaderStages;
+
+    std::array<vk::SpecializationMapEntry, 5> specMapEntriesCH
         = {vk::SpecializationMapEntry{0,
                                       offsetof(SpecializationConstantsClosestHit, recursionDepth),
                                       sizeof(uint32_t)}, // constantID 0
@@ -92,13 +98,20 @@ vk::Pipeline RtPipelineBuilder::buildPipeline(const vk::PipelineLayout &pipeline
                                       sizeof(vk::Bool32)},
            vk::SpecializationMapEntry{3,
                                       offsetof(SpecializationConstantsClosestHit, presampled),
-                                      sizeof(vk::Bool32)}};
-    vk::SpecializationInfo specInfoCH{};
-    specInfoCH.setMapEntries(specMapEntriesCH);
-    specInfoCH.setDataSize(sizeof(SpecializationConstantsClosestHit));
-    specInfoCH.setPData(&constantsCH);
-
-    shaderStages[eClosestHit].setPSpecializationInfo(&specInfoCH);
+                                      sizeof(vk::Bool32)},
+           vk::SpecializationMapEntry{4,
+                                      offsetof(SpecializationConstantsClosestHit, materialClass),
+                                      sizeof(uint32_t)}};
+    std::array<SpecializationConstantsClosestHit, eMaterialClassCount> classConstantsCH;
+    std::array<vk::SpecializationInfo, eMaterialClassCount> specInfosCH;
+    for (uint32_t c = 0; c < eMaterialClassCount; c++) {
+        classConstantsCH[c] = constantsCH;
+        classConstantsCH[c].materialClass = c;
+        specInfosCH[c].setMapEntries(specMapEntriesCH);
+        specInfosCH[c].setDataSize(sizeof(SpecializationConstantsClosestHit));
+        specInfosCH[c].setPData(&classConstantsCH[c]);
+        stages[eClosestHit + c].setPSpecializationInfo(&specInfosCH[c]);
+    }
 
     std::array<vk::SpecializationMapEntry, 1> specMapEntriesMiss = {
         vk::SpecializationMapEntry{0,
@@ -109,12 +122,11 @@ vk::Pipeline RtPipelineBuilder::buildPipeline(const vk::PipelineLayout &pipeline
     specInfoMiss.setDataSize(sizeof(SpecializationConstantsMiss));
     specInfoMiss.setPData(&constantsMiss);
 
-    shaderStages[eMiss].setPSpecializationInfo(&specInfoMiss);
+    stages[eMiss].setPSpecializationInfo(&specInfoMiss);
 
     vk::RayTracingPipelineCreateInfoKHR rtPipelineInfo{};
-    rtPipelineInfo.setStages(shaderStages); // Stages are shaders
-    // In this case, shaderGroups.size() == 3: we have one raygen group,
-    // one miss shader group, and one hit group.
+    rtPipelineInfo.setStages(stages); // Stages are shaders
+    // One raygen group, two miss groups and one hit group per material class
     rtPipelineInfo.setGroups(shaderGroups);
 
     rtPipelineInfo.setMaxPipelineRayRecursionDepth(constantsCH.recursionDepth
@@ -122,7 +134,7 @@ vk::Pipeline RtPipelineBuilder::buildPipeline(const vk::PipelineLayout &pipeline
 
     rtPipelineInfo.setLayout(pipelineLayout);
 
-    auto [res, val] = device.createRayTracingPipelinesKHR(nullptr, nullptr, rtPipelineInfo);
+    auto [res, val] = device.createRayTracingPipelinesKHR(nullptr, pipelineCache, rtPipelineInfo);
     VK_CHECK_RES(res);
 
     return val[0];
@@ -130,6 +142,7 @@ vk::Pipeline RtPipelineBuilder::buildPipeline(const vk::PipelineLayout &pipeline
 
 void RtPipelineBuilder::destroy()
 {
-    for (const auto &s : shaderStages)
-        device.destroyShaderModule(s.module);
+    // The closest-hit stages share their module
+    for (uint32_t s = 0; s <= eClosestHit; s++)
+        device.destroyShaderModule(shaderStages[s].module);
 }
@@ -12,10 +12,18 @@ SimplePipelineData get_simple_rt_pipeline(const vk::Device &device);
 class RtPipelineBuilder
 {
 public:
-    enum StageIndices { eRaygen, eMiss, eShadow, eClosestHit, eShaderStageCount };
-
-    RtPipelineBuilder(const vk::Device &device)
+    // One closest-hit stage per MaterialClass, all from the same module
+    enum StageIndices {
+        eRaygen,
+        eMiss,
+        eShadow,
+        eClosestHit,
+        eShaderStageCount = eClosestHit + eMaterialClassCount
+    };
+
+    RtPipelineBuilder(const vk::Device &device, const vk::PipelineCache &pipelineCache = nullptr)
         : device{device}
+        , pipelineCache{pipelineCache}
     {}
     ~RtPipelineBuilder() = default;
 
@@ -26,14 +34,16 @@ public:
     vk::PipelineLayout buildPipelineLayout(
         const std::vector<vk::DescriptorSetLayout> &descSetLayouts);
 
+    // Const and thread safe once the stages and groups exist, so variants can build off-thread
     vk::Pipeline buildPipeline(const vk::PipelineLayout &pipelineLayout,
                                const SpecializationConstantsClosestHit &constantsCH = {},
-                               const SpecializationConstantsMiss &constantsMiss = {});
+                               const SpecializationConstantsMiss &constantsMiss = {}) const;
 
     void destroy();
 
 private:
     const vk::Device &device;
+    const vk::PipelineCache pipelineCache;
     std::array<vk::PipelineShaderStageCreateInfo, eShaderStageCount> shaderStages;
     std::vector<vk::RayTracingShaderGroupCreateInfoKHR> shaderGroups;
     std::vector<vk::Pipeline> pipelineQueue;
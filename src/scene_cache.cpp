@@ -0,0 +1,203 @@
+#include "scene_cache.hpp"
+#include <cstring>
+#include <fcntl.h>
+#include <format>
+#include <print>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+constexpr uint64_t CACHE_MAGIC = 0x4548434143594152; // "RAYCACHE"
+constexpr size_t CACHE_ALIGNMENT = 16;
+
+// Read-only mapping of a whole file
+struct MappedFile
+{
+    const unsigned char *data{nullptr};
+    size_t size{0};
+
+    explicit MappedFile(const std::filesystem::path &path)
+    {
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return;
+        struct stat st{};
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                data = static_cast<const unsigned char *>(p);
+                size = static_cast<size_t>(st.st_size);
+                // Everything is read front to back once
+                madvise(p, size, MADV_SEQUENTIAL);
+            }
+        }
+        ::close(fd);
+    }
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+    ~MappedFile()
+    {
+        if (data)
+            munmap(const_cast<unsigned char *>(data), size);
+    }
+
+    // Hands the mapping over to its new owner
+    std::pair<const unsigned char *, size_t> release_ownership()
+    {
+        const auto r = std::make_pair(data, size);
+        data = nullptr;
+        size = 0;
+        return r;
+    }
+};
+} // namespace
+
+uint64_t hash_file(const std::filesystem::path &path)
+{
+    const MappedFile file{path};
+    uint64_t hash = 0xcbf29ce484222325;
+    for (size_t i = 0; i < file.size; i++) {
+        hash ^= file.data[i];
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+uint64_t hash_combine(const uint64_t hash, const uint64_t value)
+{
+    uint64_t h = hash;
+    for (int i = 0; i < 8; i++) {
+        h ^= (value >> (8 * i)) & 0xFF;
+        h *= 0x100000001b3;
+    }
+    return h;
+}
+
+std::filesystem::path scene_cache_path(const uint64_t sourceHash)
+{
+    return std::filesystem::path(std::string(PROJECT_DIR)) / "cache"
+           / std::format("{:016x}.scene", sourceHash);
+}
+
+CacheDependency make_dependency(const std::filesystem::path &path)
+{
+    CacheDependency dep;
+    dep.path = path.string();
+    std::error_code ec;
+    dep.size = std::filesystem::file_size(path, ec);
+    dep.modified = std::filesystem::last_write_time(path, ec).time_since_epoch().count();
+    return dep;
+}
+
+SceneCacheWriter::SceneCacheWriter(const std::filesystem::path &cachePath,
+                                   const uint64_t sourceHash,
+                                   const std::vector<CacheDependency> &dependencies)
+    : cachePath{cachePath}
+    , tmpPath{cachePath.string() + ".tmp"}
+{
+    std::error_code ec;
+    std::filesystem::create_directories(cachePath.parent_path(), ec);
+    file.open(tmpPath, std::ios::binary | std::ios::trunc);
+
+    write(CACHE_MAGIC);
+    write(SCENE_CACHE_VERSION);
+    write(sourceHash);
+    write<uint64_t>(dependencies.size());
+    for (const CacheDependency &d : dependencies) {
+        write_string(d.path);
+        write(d.size);
+        write(d.modified);
+    }
+}
+
+SceneCacheWriter::~SceneCacheWriter()
+{
+    // An unfinished cache (loading threw) is never renamed into place
+    if (!finished) {
+        file.close();
+        std::error_code ec;
+        std::filesystem::remove(tmpPath, ec);
+    }
+}
+
+void SceneCacheWriter::write_bytes(const void *data, const size_t size)
+{
+    file.write(static_cast<const char *>(data), static_cast<std::streamsize>(size));
+    written += size;
+}
+
+void SceneCacheWriter::pad()
+{
+    static constexpr char zeros[CACHE_ALIGNMENT]{};
+    const size_t padding = (CACHE_ALIGNMENT - written % CACHE_ALIGNMENT) % CACHE_ALIGNMENT;
+    write_bytes(zeros, padding);
+}
+
+bool SceneCacheWriter::finish()
+{
+    finished = true;
+    file.close();
+    std::error_code ec;
+    if (file.fail())
+        std::filesystem::remove(tmpPath, ec);
+    else
+        std::filesystem::rename(tmpPath, cachePath, ec);
+    if (file.fail() || ec) {
+        std::println("Could not write the scene cache {}", cachePath.string());
+        return false;
+    }
+    return true;
+}
+
+std::unique_ptr<SceneCacheReader> SceneCacheReader::open(const std::filesystem::path &cachePath,
+                                                         const uint64_t sourceHash)
+{
+    MappedFile file{cachePath};
+    if (!file.data)
+        return nullptr;
+
+    std::unique_ptr<SceneCacheReader> reader{new SceneCacheReader()};
+    std::tie(reader->data, reader->size) = file.release_ownership();
+    try {
+        if (reader->read<uint64_t>() != CACHE_MAGIC
+            || reader->read<uint32_t>() != SCENE_CACHE_VERSION
+            || reader->read<uint64_t>() != sourceHash)
+            return nullptr;
+        const uint64_t numDependencies = reader->read<uint64_t>();
+        for (uint64_t i = 0; i < numDependencies; i++) {
+            CacheDependency stored;
+            stored.path = reader->read_string();
+            stored.size = reader->read<uint64_t>();
+            stored.modified = reader->read<int64_t>();
+            const CacheDependency current = make_dependency(stored.path);
+            if (current.size != stored.size || current.modified != stored.modified) {
+                std::println("Scene cache is stale: {} changed", stored.path);
+                return nullptr;
+            }
+        }
+    } catch (const std::runtime_error &) {
+        return nullptr;
+    }
+    return reader;
+}
+
+SceneCacheReader::~SceneCacheReader()
+{
+    if (data)
+        munmap(const_cast<unsigned char *>(data), size);
+}
+
+const unsigned char *SceneCacheReader::take(const size_t bytes)
+{
+    if (bytes > size - cursor)
+        throw std::runtime_error("Truncated scene cache");
+    const unsigned char *p = data + cursor;
+    cursor += bytes;
+    return p;
+}
+
+void SceneCacheReader::align()
+{
+    cursor = std::min(size, (cursor + CACHE_ALIGNMENT - 1) & ~(CACHE_ALIGNMENT - 1));
+}
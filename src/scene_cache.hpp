@@ -0,0 +1,130 @@
+#pragma once
+
+#include "types.hpp"
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// On-disk snapshot of a loaded glTF scene: sampler descriptions, decoded RGBA8 images, the
+// material table, the final vertex and index arrays of every mesh and the mesh nodes with their
+// world transforms. Device addresses are not stored, the surface records are rebuilt from the
+// meshes at load. The cache file is named after the hash of the source file combined with the
+// loader settings (texture formats, mesh dedup, vertex layout), so they never mix, and its header
+// holds SCENE_CACHE_VERSION plus the size and modification time of every external file the
+// source references, so any change on them makes the loader go through fastgltf again.
+
+// External file the scene depends on (buffers and images referenced by URI)
+struct CacheDependency
+{
+    std::string path;
+    uint64_t size{0};
+    int64_t modified{0};
+};
+
+// Surface of a cached mesh, the material is an index into the cached material table
+struct CachedSurface
+{
+    uint32_t startIndex;
+    uint32_t count;
+    uint32_t materialIndex;
+};
+
+// FNV-1a over the whole file, read through a memory mapping
+uint64_t hash_file(const std::filesystem::path &path);
+
+// Folds the loader settings that change its output into the key
+uint64_t hash_combine(const uint64_t hash, const uint64_t value);
+
+std::filesystem::path scene_cache_path(const uint64_t sourceHash);
+
+CacheDependency make_dependency(const std::filesystem::path &path);
+
+// Sequential writer to a temporary file, renamed to the final path on finish(). Arrays are
+// padded to 16 bytes so that the reader can hand out spans straight into the mapping
+class SceneCacheWriter
+{
+public:
+    SceneCacheWriter(const std::filesystem::path &cachePath,
+                     const uint64_t sourceHash,
+                     const std::vector<CacheDependency> &dependencies);
+    ~SceneCacheWriter();
+
+    template<typename T>
+    void write(const T &value)
+    {
+        static_assert(std::is_trivially_copyable_v<T>);
+        write_bytes(&value, sizeof(T));
+    }
+    template<typename T>
+    void write_array(const T *data, const size_t count)
+    {
+        static_assert(std::is_trivially_copyable_v<T>);
+        write<uint64_t>(count);
+        pad();
+        write_bytes(data, count * sizeof(T));
+    }
+    void write_string(const std::string &s) { write_array(s.data(), s.size()); }
+
+    // Returns false if the cache could not be written. Then nothing is left on disk
+    bool finish();
+
+private:
+    std::filesystem::path cachePath, tmpPath;
+    std::ofstream file;
+    uint64_t written{0};
+    bool finished{false};
+
+    void write_bytes(const void *data, const size_t size);
+    void pad();
+};
+
+// Maps a cache file and reads it sequentially. Throws std::runtime_error past its end
+class SceneCacheReader
+{
+public:
+    // nullptr if there is no cache for that hash, or if it is stale
+    static std::unique_ptr<SceneCacheReader> open(const std::filesystem::path &cachePath,
+                                                  const uint64_t sourceHash);
+    ~SceneCacheReader();
+
+    template<typename T>
+    T read()
+    {
+        static_assert(std::is_trivially_copyable_v<T>);
+        T value;
+        std::memcpy(&value, take(sizeof(T)), sizeof(T));
+        return value;
+    }
+    // Points into the mapping, valid while the reader lives
+    template<typename T>
+    std::span<const T> read_array()
+    {
+        static_assert(std::is_trivially_copyable_v<T>);
+        const uint64_t count = read<uint64_t>();
+        align();
+        // A corrupt count must not overflow the byte size past the bounds check of take()
+        if (count > (size - cursor) / sizeof(T))
+            throw std::runtime_error("Truncated scene cache");
+        return {reinterpret_cast<const T *>(take(count * sizeof(T))), count};
+    }
+    std::string read_string()
+    {
+        const std::span<const char> s = read_array<char>();
+        return {s.begin(), s.end()};
+    }
+
+private:
+    SceneCacheReader() = default;
+
+    const unsigned char *data{nullptr};
+    size_t size{0}, cursor{0};
+
+    const unsigned char *take(const size_t bytes);
+    void align();
+};
@@ -5,6 +5,16 @@
 import vulkan;
 #endif
 #include "types.hpp"
+#include <vector>
+
+// SBT buffer of a pipeline and its regions for traceRays
+struct ShaderBindingTable
+{
+    Buffer buffer;
+    vk::StridedDeviceAddressRegionKHR rgenRegion;
+    vk::StridedDeviceAddressRegionKHR missRegion;
+    vk::StridedDeviceAddressRegionKHR hitRegion;
+};
 
 // Mostly got from the NVIDIA rt tutorial https://nvpro-samples.github.io/vk_raytracing_tutorial_KHR/
 class SbtHelper
@@ -12,21 +22,21 @@ class SbtHelper
 public:
     SbtHelper(const vk::Device &device,
               const VmaAllocator &allocator,
-              const vk::PhysicalDeviceRayTracingPipelinePropertiesKHR &rtProperties)
+              const vk::PhysicalDeviceRayTracingPipelinePropertiesKHR &rtProperties,
+              const std::vector<MaterialClass> &surfaceClasses)
         : device{device}
         , allocator{allocator}
         , rtProperties{rtProperties}
+        , surfaceClasses{surfaceClasses}
     {}
     ~SbtHelper() = default;
 
-    Buffer create_shader_binding_table(const vk::Pipeline &rtPipeline);
-
-    vk::StridedDeviceAddressRegionKHR rgenRegion;
-    vk::StridedDeviceAddressRegionKHR missRegion;
-    vk::StridedDeviceAddressRegionKHR hitRegion;
+    // Does not touch the helper, so it can run on a worker thread
+    ShaderBindingTable create_shader_binding_table(const vk::Pipeline &rtPipeline) const;
 
 private:
     const vk::Device &device;
     const VmaAllocator &allocator;
     const vk::PhysicalDeviceRayTracingPipelinePropertiesKHR &rtProperties;
+    const std::vector<MaterialClass> surfaceClasses;
 };
@@ -0,0 +1,230 @@
+#include "texture_codec.hpp"
+#include "stb_image.h"
+#include <bit>
+#include <cstring>
+#include <ktx.h>
+#include <print>
+
+namespace {
+bool is_ktx2(const std::span<const std::byte> bytes)
+{
+    static constexpr unsigned char magic[12]
+        = {0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n'};
+    return bytes.size() >= sizeof(magic) && std::memcmp(bytes.data(), magic, sizeof(magic)) == 0;
+}
+
+ktx_transcode_fmt_e transcode_format(const TextureEncoding target)
+{
+    switch (target) {
+    case TextureEncoding::eBC7:
+        return KTX_TTF_BC7_RGBA;
+    case TextureEncoding::eBC5:
+        return KTX_TTF_BC5_RG;
+    case TextureEncoding::eRGBA8:
+    case TextureEncoding::eRGBA8Normal:
+    default:
+        return KTX_TTF_RGBA32;
+    }
+}
+
+bool is_bc_target(const TextureEncoding target)
+{
+    return target == TextureEncoding::eBC7 || target == TextureEncoding::eBC5;
+}
+
+bool is_block_compressed(const vk::Format format)
+{
+    return format >= vk::Format::eBc1RgbUnormBlock && format <= vk::Format::eBc7SrgbBlock;
+}
+
+// Every image is sampled as Unorm, like the PNG and JPEG paths, whatever the Basis color space
+vk::Format unorm_format(const vk::Format format)
+{
+    switch (format) {
+    case vk::Format::eR8G8B8A8Srgb:
+        return vk::Format::eR8G8B8A8Unorm;
+    case vk::Format::eBc1RgbSrgbBlock:
+        return vk::Format::eBc1RgbUnormBlock;
+    case vk::Format::eBc1RgbaSrgbBlock:
+        return vk::Format::eBc1RgbaUnormBlock;
+    case vk::Format::eBc2SrgbBlock:
+        return vk::Format::eBc2UnormBlock;
+    case vk::Format::eBc3SrgbBlock:
+        return vk::Format::eBc3UnormBlock;
+    case vk::Format::eBc7SrgbBlock:
+        return vk::Format::eBc7UnormBlock;
+    default:
+        return format;
+    }
+}
+
+// Appends the rest of the chain to a single level RGBA8 image, each level a 2x2 box filter of
+// the previous one. Odd sizes drop their last row or column
+void generate_mips(DecodedImage &image)
+{
+    const uint32_t levels = mip_level_count(image.extent);
+    image.mipOffsets.assign(1, 0);
+    uint32_t w = image.extent.width, h = image.extent.height;
+    for (uint32_t level = 1; level < levels; level++) {
+        const uint32_t nw = std::max(w / 2, 1u), nh = std::max(h / 2, 1u);
+        const size_t src = image.mipOffsets.back();
+        const size_t dst = image.data.size();
+        image.mipOffsets.emplace_back(dst);
+        image.data.resize(dst + size_t(nw) * nh * 4);
+        const unsigned char *in = image.data.data() + src;
+        unsigned char *out = image.data.data() + dst;
+        for (uint32_t y = 0; y < nh; y++) {
+            const uint32_t y0 = std::min(2 * y, h - 1), y1 = std::min(2 * y + 1, h - 1);
+            for (uint32_t x = 0; x < nw; x++) {
+                const uint32_t x0 = std::min(2 * x, w - 1), x1 = std::min(2 * x + 1, w - 1);
+                for (uint32_t c = 0; c < 4; c++) {
+                    const uint32_t sum = in[(size_t(y0) * w + x0) * 4 + c]
+                                         + in[(size_t(y0) * w + x1) * 4 + c]
+                                         + in[(size_t(y1) * w + x0) * 4 + c]
+                                         + in[(size_t(y1) * w + x1) * 4 + c];
+                    out[(size_t(y) * nw + x) * 4 + c] = static_cast<unsigned char>((sum + 2) / 4);
+                }
+            }
+        }
+        w = nw;
+        h = nh;
+    }
+}
+
+// Transcodes Basis payloads and copies every level out. Takes ownership of the texture
+DecodedImage extract_mips(ktxTexture2 *texture, const TextureEncoding target)
+{
+    DecodedImage image{};
+    const bool basis = ktxTexture2_NeedsTranscoding(texture);
+    if (basis) {
+        const KTX_error_code res = ktxTexture2_TranscodeBasis(texture, transcode_format(target), 0);
+        if (res != KTX_SUCCESS) {
+            std::println("KTX2 transcoding error: {}", ktxErrorString(res));
+            ktxTexture_Destroy(ktxTexture(texture));
+            return image;
+        }
+    }
+
+    const vk::Format format = unorm_format(static_cast<vk::Format>(texture->vkFormat));
+    if (is_block_compressed(format) && !is_bc_target(target)) {
+        std::println("KTX2 error: block compressed texture without device support");
+    } else {
+        image.extent = vk::Extent3D{texture->baseWidth, texture->baseHeight, 1};
+        image.format = format;
+        // An rrrg normal map transcoded to RGBA8 keeps y in alpha
+        if (basis && target == TextureEncoding::eRGBA8Normal)
+            image.swizzle.setG(vk::ComponentSwizzle::eA);
+        // libktx stores the smallest level first, the upload wants the base level first
+        for (ktx_uint32_t level = 0; level < texture->numLevels; level++) {
+            ktx_size_t offset = 0;
+            ktxTexture_GetImageOffset(ktxTexture(texture), level, 0, 0, &offset);
+            const ktx_size_t size = ktxTexture_GetImageSize(ktxTexture(texture), level);
+            const ktx_uint8_t *data = ktxTexture_GetData(ktxTexture(texture)) + offset;
+            image.mipOffsets.emplace_back(image.data.size());
+            image.data.insert(image.data.end(), data, data + size);
+        }
+        // The box filter reads 4 bytes per texel, other formats keep their single level
+        if (format == vk::Format::eR8G8B8A8Unorm && image.mip_levels() == 1)
+            generate_mips(image);
+    }
+    ktxTexture_Destroy(ktxTexture(texture));
+    return image;
+}
+
+DecodedImage decode_ktx2(const std::span<const std::byte> encoded, const TextureEncoding target)
+{
+    ktxTexture2 *texture = nullptr;
+    const KTX_error_code res
+        = ktxTexture2_CreateFromMemory(reinterpret_cast<const ktx_uint8_t *>(encoded.data()),
+                                       encoded.size(),
+                                       KTX_TEXTURE_CREATE_LOAD_IMAGE_DATA_BIT,
+                                       &texture);
+    if (res != KTX_SUCCESS) {
+        std::println("KTX2 read error: {}", ktxErrorString(res));
+        return {};
+    }
+    return extract_mips(texture, target);
+}
+
+// RGBA8 -> UASTC -> BC. UASTC keeps enough quality for BC7 and BC5, and reuses the transcoder
+DecodedImage encode_bc(const DecodedImage &rgba, const TextureEncoding target)
+{
+    ktxTextureCreateInfo createInfo{};
+    createInfo.vkFormat = static_cast<ktx_uint32_t>(vk::Format::eR8G8B8A8Unorm);
+    createInfo.baseWidth = rgba.extent.width;
+    createInfo.baseHeight = rgba.extent.height;
+    createInfo.baseDepth = 1;
+    createInfo.numDimensions = 2;
+    createInfo.numLevels = rgba.mip_levels();
+    createInfo.numLayers = 1;
+    createInfo.numFaces = 1;
+    createInfo.isArray = KTX_FALSE;
+    createInfo.generateMipmaps = KTX_FALSE;
+
+    ktxTexture2 *texture = nullptr;
+    if (ktxTexture2_Create(&createInfo, KTX_TEXTURE_CREATE_ALLOC_STORAGE, &texture) != KTX_SUCCESS)
+        return rgba;
+    for (uint32_t level = 0; level < rgba.mip_levels(); level++) {
+        const vk::DeviceSize begin = rgba.mipOffsets.empty() ? 0 : rgba.mipOffsets[level];
+        const vk::DeviceSize end = level + 1 < rgba.mipOffsets.size() ? rgba.mipOffsets[level + 1]
+                                                                       : rgba.size();
+        ktxTexture_SetImageFromMemory(ktxTexture(texture),
+                                      level,
+                                      0,
+                                      0,
+                                      rgba.data.data() + begin,
+                                      end - begin);
+    }
+
+    ktxBasisParams params{};
+    params.structSize = sizeof(params);
+    params.uastc = KTX_TRUE;
+    params.uastcFlags = KTX_PACK_UASTC_LEVEL_DEFAULT;
+    params.threadCount = 1; // Already on a worker
+    if (target == TextureEncoding::eBC5) {
+        // x to rgb and y to alpha, as toktx --normal_mode. BC5 transcoding reads r and alpha
+        params.normalMap = KTX_TRUE;
+        std::memcpy(params.inputSwizzle, "rrrg", sizeof(params.inputSwizzle));
+    }
+    const KTX_error_code res = ktxTexture2_CompressBasisEx(texture, &params);
+    if (res != KTX_SUCCESS) {
+        std::println("BC encoding error: {}. Keeping RGBA8", ktxErrorString(res));
+        ktxTexture_Destroy(ktxTexture(texture));
+        return rgba;
+    }
+    DecodedImage image = extract_mips(texture, target);
+    return image.data.empty() ? rgba : image;
+}
+} // namespace
+
+uint32_t mip_level_count(const vk::Extent3D &extent)
+{
+    return static_cast<uint32_t>(std::bit_width(std::max(extent.width, extent.height)));
+}
+
+DecodedImage decode_texture(const std::span<const std::byte> encoded,
+                            const TextureEncoding target,
+                            const bool compress)
+{
+    if (is_ktx2(encoded))
+        return decode_ktx2(encoded, target);
+
+    DecodedImage image{};
+    int w, h, nChannels;
+    stbi_uc *pixels = stbi_load_from_memory(reinterpret_cast<const stbi_uc *>(encoded.data()),
+                                            static_cast<int>(encoded.size()),
+                                            &w,
+                                            &h,
+                                            &nChannels,
+                                            4);
+    if (!pixels)
+        return image;
+    image.extent = vk::Extent3D{static_cast<uint32_t>(w), static_cast<uint32_t>(h), 1};
+    image.data.assign(pixels, pixels + size_t(w) * h * 4);
+    stbi_image_free(pixels);
+    generate_mips(image);
+
+    if (compress && is_bc_target(target))
+        return encode_bc(image, target);
+    return image;
+}
@@ -0,0 +1,48 @@
+#pragma once
+#ifndef USE_CXX20_MODULES
+#include <vulkan/vulkan.hpp>
+#else
+import vulkan;
+#endif
+
+#include <algorithm>
+#include <cstddef>
+#include <span>
+#include <vector>
+
+// Format a texture ends up in on the GPU, picked from the material slot that samples it
+enum struct TextureEncoding : uint8_t {
+    eRGBA8,       // No BC support on the device
+    eRGBA8Normal, // Same for normal maps, the view swizzle leaves xy in rg like eBC5
+    eBC7,         // Color and metallic-roughness
+    eBC5,         // Normal maps, only xy are stored
+};
+
+// Mip chain of a texture, decoded or transcoded on a worker thread and waiting for its upload
+struct DecodedImage
+{
+    uint32_t index{0}; // glTF image index
+    vk::Extent3D extent{};
+    vk::Format format{vk::Format::eR8G8B8A8Unorm};
+    vk::ComponentMapping swizzle{}; // Of the image view
+    std::vector<unsigned char> data; // Every level, tightly packed. Empty if it could not be decoded
+    std::vector<vk::DeviceSize> mipOffsets; // Offset of each level in data
+
+    vk::DeviceSize size() const { return data.size(); }
+    uint32_t mip_levels() const { return std::max<uint32_t>(1, mipOffsets.size()); }
+};
+
+// Levels of a full chain down to 1x1
+uint32_t mip_level_count(const vk::Extent3D &extent);
+
+// KTX2 inputs (KHR_texture_basisu) are transcoded to the target, or taken as they are if they
+// already hold a GPU format. PNG/JPEG inputs are decoded to RGBA8 and, if compress is set and
+// the target is a BC format, encoded to UASTC and transcoded to it.
+// Normal maps always end up with x in r and y in g: Basis normal maps are stored as rrrg
+// (toktx --normal_mode), which BC5 transcoding maps to rg and RGBA8 gets through its swizzle.
+// RGBA8 results always get a full mip chain, box filtered on the CPU. BC results keep the levels
+// of their source, which is a full chain unless a KTX2 file ships fewer.
+// Thread safe, it does not touch any Vulkan object
+DecodedImage decode_texture(const std::span<const std::byte> encoded,
+                            const TextureEncoding target,
+                            const bool compress);
@@ -0,0 +1,40 @@
+#include "thread_pool.hpp"
+#include <algorithm>
+
+ThreadPool::ThreadPool(const uint32_t numThreads)
+{
+    // hardware_concurrency() may return 0 if it is unknown
+    const uint32_t n = (numThreads > 0) ? numThreads
+                                        : std::max(1u, std::thread::hardware_concurrency());
+    workers.reserve(n);
+    for (uint32_t i = 0; i < n; i++)
+        workers.emplace_back([this]() { worker_loop(); });
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard lock(mutex);
+        stop = true;
+    }
+    condition.notify_all();
+    // Pending jobs are still executed before the workers exit
+    for (auto &w : workers)
+        w.join();
+}
+
+void ThreadPool::worker_loop()
+{
+    while (true) {
+        std::function<void()> job;
+        {
+            std::unique_lock lock(mutex);
+            condition.wait(lock, [this]() { return stop || !jobs.empty(); });
+            if (jobs.empty())
+                return;
+            job = std::move(jobs.front());
+            jobs.pop();
+        }
+        job();
+    }
+}
@@ -8,8 +8,10 @@ import vulkan;
 #define GLM_FORCE_RADIANS
 #define GLM_FORCE_LEFT_HANDED
 #define GLM_FORCE_DEPTH_ZERO_TO_ONE
+#include <filesystem>
 #include <glm/glm.hpp>
 #include <iostream>
+#include <string>
 #include <vk_mem_alloc.h>
 
 #define VK_CHECK_RES(x) \
@@ -41,7 +43,24 @@ const unsigned int FRAME_OVERLAP = 2;
 const uint64_t FENCE_TIMEOUT = 1000000000;
 const size_t SAMPLING_DISCRETIZATION = 100;
 
-const uint32_t MAX_LIGHTS = 10;
+const size_t LIGHT_BUFFER_CAPACITY = 16; // Initial lights per buffer, they grow on demand
+const uint32_t MAX_TIMESTAMP_SCOPES = 16; // GPU profiler scopes per frame
+const size_t MAX_PENDING_TRACE_EVENTS = 4096; // Profiler sections kept until a trace is enabled
+const uint32_t MAX_ASYNC_TIMESTAMP_PAIRS = 64; // Timed upload batches in flight per queue family
+const vk::DeviceSize STAGING_RING_SIZE = 64 * 1024 * 1024;        // Upload manager staging ring
+const vk::DeviceSize BLAS_STORAGE_BLOCK_SIZE = 128 * 1024 * 1024; // BLAS results suballocation
+const vk::DeviceSize BLAS_SCRATCH_BUDGET = 64 * 1024 * 1024;      // Scratch per BLAS build call
+const vk::DeviceSize GEOMETRY_ARENA_BLOCK_SIZE = 64 * 1024 * 1024; // Vertex and index arenas
+const vk::DeviceSize GEOMETRY_ALIGNMENT = 16;                      // Of every arena slice
+const bool SCENE_CACHE = true; // Binary snapshot of every loaded glTF under cache/
+const uint32_t SCENE_CACHE_VERSION = 7; // Bump on any change of the loader output
+const bool COMPRESS_TEXTURES = false; // Opt-in (--compress-textures) BC7/BC5 encoding at import
+const bool DEDUP_TRANSLATED_MESHES = false; // Opt-in (--dedup-translated), see GLTFLoader
+const bool COMPACT_VERTICES = false; // Opt-in (--compact-vertices) layout, see CompactVertex
+const bool BLAS_COMPACTION = false; // Opt-in (--compact-blas), costs a submission and a readback
+const vk::DeviceSize IMAGE_UPLOAD_BATCH_BYTES = 16 * 1024 * 1024; // Texture bytes per uploader flush
+const uint32_t IMAGE_DECODES_PER_THREAD = 2; // In flight image decodes per loader worker
+const uint32_t WAVEFRONT_DIRECTION_BINS = 8; // Ray direction octants in the wavefront shade sort
 
 #define SIMPLE_MESH_FRAG_SHADER "shaders/simple_mesh.frag.spv"
 #define SIMPLE_MESH_VERT_SHADER "shaders/simple_mesh.vert.spv"
@@ -49,6 +68,14 @@ const uint32_t MAX_LIGHTS = 10;
 #define SIMPLE_RGEN_SHADER "shaders/raytrace.rgen.spv"
 #define SIMPLE_RMISS_SHADER "shaders/raytrace.rmiss.spv"
 #define SIMPLE_SHADOW_SHADER "shaders/shadow.rmiss.spv"
+#define WAVEFRONT_GENERATE_SHADER "shaders/wavefront_generate.comp.spv"
+#define WAVEFRONT_CONTROL_SHADER "shaders/wavefront_control.comp.spv"
+#define WAVEFRONT_EXTEND_SHADER "shaders/wavefront_extend.comp.spv"
+#define WAVEFRONT_SCATTER_SHADER "shaders/wavefront_scatter.comp.spv"
+#define WAVEFRONT_SHADE_SHADER "shaders/wavefront_shade.comp.spv"
+#define WAVEFRONT_SHADOW_SHADER "shaders/wavefront_shadow.comp.spv"
+#define WAVEFRONT_ACCUMULATE_SHADER "shaders/wavefront_accumulate.comp.spv"
+#define RAY_QUERY_SHADER "shaders/ray_query.comp.spv"
 
 struct SimplePipelineData
 {
@@ -64,6 +91,7 @@ struct ImageData
     VmaAllocationInfo allocationInfo;
     vk::Extent3D extent;
     vk::Format format;
+    uint32_t mipLevels{1};
     vk::Sampler sampler = nullptr;
 };
 
@@ -77,7 +105,11 @@ struct FrameData
     vk::DescriptorSet descriptorSetRt;
     ImageData imageDraw;
     ImageData imageDepth;
-    size_t lightsCount{0};
+    vk::QueryPool queryPool;                  // GPU profiler timestamps, 2 per scope
+    std::vector<std::string> timestampScopes; // Scopes recorded in the last use of this frame
+    // Replaced while this frame was the last one recorded with them, destroyed after its fence
+    std::vector<vk::Pipeline> retiredPipelines;
+    std::vector<Buffer> retiredBuffers;
 };
 
 struct Buffer
@@ -97,6 +129,31 @@ struct Vertex
     glm::vec4 color;
 };
 
+// Quantized attributes of the compact layout. The positions go in their own tightly packed stream
+struct CompactVertex
+{
+    uint32_t normal;  // Octahedral, snorm 2x16
+    uint32_t tangent; // Octahedral, unorm 2x15, handedness in the top bit
+    uint32_t uv;      // Half 2x16
+    uint32_t color;   // RGBA8
+};
+
+// SurfaceStorage::flags
+enum SurfaceFlags : uint32_t { eCompactVertices = 1u << 0, eIndices16 = 1u << 1 };
+const uint32_t SURFACE_CLASS_SHIFT = 8; // MaterialClass in the flags bits above
+
+// Closest-hit specialization of a surface, from the textures its material samples. Each class has
+// its own hit group, and every surface its own SBT record pointing at it
+enum MaterialClass : uint32_t { eUntextured, eBaseColorTexture, eFullPbr, eMaterialClassCount };
+
+// Recursive: the closest-hit shader splits into BOUNCES recursive rays at every hit.
+// Iterative: the raygen shader follows a single path, one lobe per bounce, with Russian roulette.
+enum IntegratorType : uint32_t { eRecursive, eIterative };
+
+// RT pipeline: the megakernel, traceRays over the SBT. Wavefront: compute stages with ray queries,
+// see WavefrontRenderer. Ray query: a single compute kernel, see RayQueryRenderer
+enum RenderBackend : uint32_t { eRtPipeline, eWavefront, eRayQuery };
+
 // push constants for the raster pipeline
 struct MeshPush
 {
@@ -108,6 +165,10 @@ struct RayPush
     glm::vec4 clearColor{0.5f, 0.5f, 0.5f, 1.f};
     uint32_t nLights{0};
     float dScale{1.f};
+    uint32_t frame{0};              // Monotonic frame counter, decorrelates the RNG between frames
+    uint32_t accumulatedSamples{0}; // Samples already averaged into the accumulation image
+    uint32_t integrator{0};         // IntegratorType
+    uint32_t pathDepth{8};          // Maximum number of path vertices of the iterative integrator
 };
 
 struct SpecializationConstantsClosestHit
@@ -116,6 +177,7 @@ struct SpecializationConstantsClosestHit
     uint32_t numBounces{8};
     vk::Bool32 random{vk::True};
     vk::Bool32 presampled{vk::False};
+    uint32_t materialClass{eFullPbr}; // Set per hit group by the pipeline builder
 };
 
 struct SpecializationConstantsMiss
@@ -132,6 +194,29 @@ struct CameraData
     glm::mat4 projInverse{1.f};
 };
 
+// Headless render job, filled from the command line
+struct OfflineRenderSettings
+{
+    vk::Extent2D extent{W, H};
+    uint32_t samples{256};
+    std::filesystem::path output{"render.png"}; // .png, .exr or .pfm
+    bool customCamera{false};
+    glm::vec3 cameraPosition{0.f};
+    glm::vec3 cameraTarget{0.f};
+    uint32_t integrator{eIterative};
+    uint32_t pathDepth{8};
+    uint32_t backend{eRtPipeline};
+};
+
+// Scene import switches, from the command line. They default to the compile-time opt-ins
+struct SceneOptions
+{
+    bool compactBLAS{BLAS_COMPACTION};
+    bool compactVertices{COMPACT_VERTICES};
+    bool compressTextures{COMPRESS_TEXTURES};
+    bool dedupTranslatedMeshes{DEDUP_TRANSLATED_MESHES};
+};
+
 #ifdef NDEBUG
 const bool enableValidationLayers = false;
 #else
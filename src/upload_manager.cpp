@@ -0,0 +1,365 @@
+#include "upload_manager.hpp"
+#include "profiler.hpp"
+#include "utils.hpp"
+#include <algorithm>
+#include <cassert>
+
+// Buffer to image copies from the transfer queue need 4-byte aligned offsets, 16 covers any texel
+static constexpr vk::DeviceSize STAGING_ALIGNMENT = 16;
+
+UploadManager::UploadManager(const vk::Device &device,
+                             const VmaAllocator &allocator,
+                             const uint32_t transferQueueFamilyIndex,
+                             const uint32_t graphicsQueueFamilyIndex,
+                             const vk::DeviceSize ringSize)
+    : device{device}
+    , allocator{allocator}
+    , transferFamily{transferQueueFamilyIndex}
+    , graphicsFamily{graphicsQueueFamilyIndex}
+    , ringSize{ringSize}
+{
+    vk::DeviceQueueInfo2 queueInfo{};
+    queueInfo.setQueueIndex(0);
+    queueInfo.setQueueFamilyIndex(transferFamily);
+    transferQueue = device.getQueue2(queueInfo);
+    queueInfo.setQueueFamilyIndex(graphicsFamily);
+    graphicsQueue = device.getQueue2(queueInfo);
+
+    vk::CommandPoolCreateInfo poolInfo{};
+    poolInfo.setFlags(vk::CommandPoolCreateFlagBits::eResetCommandBuffer
+                      | vk::CommandPoolCreateFlagBits::eTransient);
+    poolInfo.setQueueFamilyIndex(transferFamily);
+    transferPool = device.createCommandPool(poolInfo);
+    poolInfo.setQueueFamilyIndex(graphicsFamily);
+    graphicsPool = device.createCommandPool(poolInfo);
+
+    vk::SemaphoreTypeCreateInfo timelineInfo{};
+    timelineInfo.setSemaphoreType(vk::SemaphoreType::eTimeline);
+    timelineInfo.setInitialValue(0);
+    vk::SemaphoreCreateInfo semaphoreInfo{};
+    semaphoreInfo.setPNext(&timelineInfo);
+    timeline = device.createSemaphore(semaphoreInfo);
+
+    // Persistently mapped, the host only ever writes to it
+    ring = utils::create_buffer(device,
+                                allocator,
+                                ringSize,
+                                vk::BufferUsageFlagBits::eTransferSrc,
+                                VMA_MEMORY_USAGE_AUTO,
+                                VMA_ALLOCATION_CREATE_MAPPED_BIT
+                                    | VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT);
+}
+
+void UploadManager::destroy()
+{
+    flush_and_wait();
+    assert(inFlight.empty());
+    utils::destroy_buffer(allocator, ring);
+    device.destroySemaphore(timeline);
+    // Frees the command buffers too
+    device.destroyCommandPool(transferPool);
+    device.destroyCommandPool(graphicsPool);
+}
+
+void UploadManager::begin_batch()
+{
+    if (isRecording)
+        return;
+
+    if (!freeBatches.empty()) {
+        recording = std::move(freeBatches.back());
+        freeBatches.pop_back();
+    } else {
+        vk::CommandBufferAllocateInfo allocInfo{};
+        allocInfo.setCommandBufferCount(1);
+        allocInfo.setLevel(vk::CommandBufferLevel::ePrimary);
+        allocInfo.setCommandPool(transferPool);
+        recording.transferCmd = device.allocateCommandBuffers(allocInfo)[0];
+        if (needs_ownership_transfer()) {
+            allocInfo.setCommandPool(graphicsPool);
+            recording.graphicsCmd = device.allocateCommandBuffers(allocInfo)[0];
+        }
+    }
+    recording.value = 0;
+    recording.ringBytes = 0;
+
+    vk::CommandBufferBeginInfo beginInfo{};
+    beginInfo.setFlags(vk::CommandBufferUsageFlagBits::eOneTimeSubmit);
+    recording.transferCmd.begin(beginInfo);
+    recording.timestamps = profiler ? profiler->begin_async(recording.transferCmd, transferFamily)
+                                    : GpuProfiler::NO_TIMESTAMPS;
+    isRecording = true;
+}
+
+uint64_t UploadManager::completed_value() const
+{
+    return device.getSemaphoreCounterValue(timeline);
+}
+
+void UploadManager::reclaim()
+{
+    const uint64_t completed = completed_value();
+    while (!inFlight.empty() && inFlight.front().value <= completed) {
+        Batch &batch = inFlight.front();
+        if (batch.ringBytes > 0) {
+            used -= batch.ringBytes;
+            tail = batch.ringEnd;
+        }
+        if (profiler)
+            profiler->collect_async("upload", transferFamily, batch.timestamps);
+        for (const Buffer &b : batch.dedicatedStaging)
+            utils::destroy_buffer(allocator, b);
+        batch.dedicatedStaging.clear();
+        freeBatches.emplace_back(std::move(batch));
+        inFlight.pop_front();
+    }
+}
+
+bool UploadManager::try_allocate(const vk::DeviceSize size, vk::DeviceSize &offset)
+{
+    reclaim();
+    if (used == 0)
+        head = tail = 0;
+
+    const vk::DeviceSize aligned = (head + STAGING_ALIGNMENT - 1) & ~(STAGING_ALIGNMENT - 1);
+    vk::DeviceSize consumed;
+    if (used == 0 || head > tail) {
+        // Free space in [head, ringSize) and [0, tail)
+        if (aligned + size <= ringSize) {
+            offset = aligned;
+            consumed = aligned + size - head;
+        } else if (size <= tail) {
+            offset = 0;
+            consumed = ringSize - head + size;
+        } else {
+            return false;
+        }
+    } else {
+        // Free space in [head, tail)
+        if (aligned + size > tail)
+            return false;
+        offset = aligned;
+        consumed = aligned + size - head;
+    }
+
+    head = offset + size;
+    used += consumed;
+    recording.ringBytes += consumed;
+    recording.ringEnd = head;
+    return true;
+}
+
+std::pair<vk::Buffer, vk::DeviceSize> UploadManager::stage(const void *data,
+                                                           const vk::DeviceSize size)
+{
+    begin_batch();
+
+    // Too big for the ring: temporary staging buffer, destroyed with its batch
+    if (size > ringSize) {
+        Buffer staging = utils::create_buffer(device,
+                                              allocator,
+                                              size,
+                                              vk::BufferUsageFlagBits::eTransferSrc,
+                                              VMA_MEMORY_USAGE_AUTO,
+                                              VMA_ALLOCATION_CREATE_MAPPED_BIT
+                                                  | VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT);
+        utils::copy_to_buffer(staging, allocator, data, size);
+        recording.dedicatedStaging.emplace_back(staging);
+        return {staging.buffer, 0};
+    }
+
+    vk::DeviceSize offset;
+    while (!try_allocate(size, offset)) {
+        if (recording.ringBytes > 0) {
+            // The ring is full of this batch: submit it and start a new one
+            flush();
+            begin_batch();
+        } else {
+            // Wait for the oldest batch to give its region back
+            assert(!inFlight.empty());
+            wait(inFlight.front().value);
+        }
+    }
+    utils::copy_to_buffer(ring, allocator, data, size, offset);
+    return {ring.buffer, offset};
+}
+
+void UploadManager::upload_buffer(const Buffer &dst,
+                                  const void *data,
+                                  const vk::DeviceSize size,
+                                  const vk::DeviceSize dstOffset)
+{
+    if (size == 0)
+        return;
+    const auto [src, srcOffset] = stage(data, size);
+
+    vk::BufferCopy2 region{};
+    region.setSrcOffset(srcOffset);
+    region.setDstOffset(dstOffset);
+    region.setSize(size);
+    vk::CopyBufferInfo2 copyInfo{};
+    copyInfo.setSrcBuffer(src);
+    copyInfo.setDstBuffer(dst.buffer);
+    copyInfo.setRegions(region);
+    recording.transferCmd.copyBuffer2(copyInfo);
+
+    if (needs_ownership_transfer()) {
+        vk::BufferMemoryBarrier2 ownership{};
+        ownership.setSrcQueueFamilyIndex(transferFamily);
+        ownership.setDstQueueFamilyIndex(graphicsFamily);
+        ownership.setBuffer(dst.buffer);
+        ownership.setOffset(dstOffset);
+        ownership.setSize(size);
+        bufferOwnership.emplace_back(ownership);
+    }
+}
+
+void UploadManager::upload_image(const ImageData &dst,
+                                 const void *data,
+                                 const vk::DeviceSize size,
+                                 const std::span<const vk::DeviceSize> mipOffsets)
+{
+    const auto [src, srcOffset] = stage(data, size);
+    const vk::CommandBuffer &cmd = recording.transferCmd;
+
+    utils::transition_image(cmd,
+                            dst,
+                            vk::ImageLayout::eUndefined,
+                            vk::ImageLayout::eGeneral,
+                            vk::PipelineStageFlagBits2::eNone,
+                            vk::PipelineStageFlagBits2::eCopy);
+
+    const uint32_t levels = std::max<uint32_t>(1, std::min<uint32_t>(mipOffsets.size(), dst.mipLevels));
+    std::vector<vk::BufferImageCopy2> copyRegions(levels);
+    for (uint32_t level = 0; level < levels; level++) {
+        vk::ImageSubresourceLayers subResource{};
+        subResource.setAspectMask(vk::ImageAspectFlagBits::eColor);
+        subResource.setMipLevel(level);
+        subResource.setLayerCount(1);
+        vk::BufferImageCopy2 &copyRegion = copyRegions[level];
+        copyRegion.setBufferOffset(srcOffset + (mipOffsets.empty() ? 0 : mipOffsets[level]));
+        copyRegion.setImageExtent(vk::Extent3D{std::max(dst.extent.width >> level, 1u),
+                                               std::max(dst.extent.height >> level, 1u),
+                                               std::max(dst.extent.depth >> level, 1u)});
+        copyRegion.setImageSubresource(subResource);
+    }
+    vk::CopyBufferToImageInfo2 copyInfo{};
+    copyInfo.setSrcBuffer(src);
+    copyInfo.setDstImage(dst.image);
+    copyInfo.setDstImageLayout(vk::ImageLayout::eGeneral);
+    copyInfo.setRegions(copyRegions);
+    cmd.copyBufferToImage2(copyInfo);
+
+    if (needs_ownership_transfer()) {
+        vk::ImageSubresourceRange range{};
+        range.setAspectMask(vk::ImageAspectFlagBits::eColor);
+        range.setLevelCount(vk::RemainingMipLevels);
+        range.setLayerCount(vk::RemainingArrayLayers);
+        vk::ImageMemoryBarrier2 ownership{};
+        ownership.setOldLayout(vk::ImageLayout::eGeneral);
+        ownership.setNewLayout(vk::ImageLayout::eGeneral);
+        ownership.setSrcQueueFamilyIndex(transferFamily);
+        ownership.setDstQueueFamilyIndex(graphicsFamily);
+        ownership.setImage(dst.image);
+        ownership.setSubresourceRange(range);
+        imageOwnership.emplace_back(ownership);
+    }
+}
+
+uint64_t UploadManager::flush()
+{
+    if (!isRecording)
+        return submittedValue;
+
+    if (profiler)
+        profiler->end_async(recording.transferCmd, transferFamily, recording.timestamps);
+    const bool transferOwnership = !bufferOwnership.empty() || !imageOwnership.empty();
+    if (transferOwnership) {
+        // Release: only the source half of the barrier
+        for (auto &b : bufferOwnership) {
+            b.setSrcStageMask(vk::PipelineStageFlagBits2::eCopy);
+            b.setSrcAccessMask(vk::AccessFlagBits2::eTransferWrite);
+        }
+        for (auto &b : imageOwnership) {
+            b.setSrcStageMask(vk::PipelineStageFlagBits2::eCopy);
+            b.setSrcAccessMask(vk::AccessFlagBits2::eTransferWrite);
+        }
+        vk::DependencyInfo releaseInfo{};
+        releaseInfo.setBufferMemoryBarriers(bufferOwnership);
+        releaseInfo.setImageMemoryBarriers(imageOwnership);
+        recording.transferCmd.pipelineBarrier2(releaseInfo);
+    }
+    recording.transferCmd.end();
+
+    vk::CommandBufferSubmitInfo cmdInfo{};
+    cmdInfo.setCommandBuffer(recording.transferCmd);
+    vk::SemaphoreSubmitInfo signalInfo{};
+    signalInfo.setSemaphore(timeline);
+    signalInfo.setValue(++submittedValue);
+    signalInfo.setStageMask(vk::PipelineStageFlagBits2::eAllCommands);
+    vk::SubmitInfo2 submitInfo{};
+    submitInfo.setCommandBufferInfos(cmdInfo);
+    submitInfo.setSignalSemaphoreInfos(signalInfo);
+    transferQueue.submit2(submitInfo);
+
+    if (transferOwnership) {
+        // Acquire: only the destination half, after the transfer submission
+        for (auto &b : bufferOwnership) {
+            b.setSrcStageMask(vk::PipelineStageFlagBits2::eNone);
+            b.setSrcAccessMask(vk::AccessFlagBits2::eNone);
+            b.setDstStageMask(vk::PipelineStageFlagBits2::eAllCommands);
+            b.setDstAccessMask(vk::AccessFlagBits2::eMemoryRead);
+        }
+        for (auto &b : imageOwnership) {
+            b.setSrcStageMask(vk::PipelineStageFlagBits2::eNone);
+            b.setSrcAccessMask(vk::AccessFlagBits2::eNone);
+            b.setDstStageMask(vk::PipelineStageFlagBits2::eAllCommands);
+            b.setDstAccessMask(vk::AccessFlagBits2::eMemoryRead);
+        }
+        vk::CommandBufferBeginInfo beginInfo{};
+        beginInfo.setFlags(vk::CommandBufferUsageFlagBits::eOneTimeSubmit);
+        recording.graphicsCmd.begin(beginInfo);
+        vk::DependencyInfo acquireInfo{};
+        acquireInfo.setBufferMemoryBarriers(bufferOwnership);
+        acquireInfo.setImageMemoryBarriers(imageOwnership);
+        recording.graphicsCmd.pipelineBarrier2(acquireInfo);
+        recording.graphicsCmd.end();
+
+        vk::SemaphoreSubmitInfo waitInfo = signalInfo;
+        signalInfo.setValue(++submittedValue);
+        cmdInfo.setCommandBuffer(recording.graphicsCmd);
+        submitInfo.setWaitSemaphoreInfos(waitInfo);
+        submitInfo.setCommandBufferInfos(cmdInfo);
+        submitInfo.setSignalSemaphoreInfos(signalInfo);
+        graphicsQueue.submit2(submitInfo);
+
+        bufferOwnership.clear();
+        imageOwnership.clear();
+    }
+
+    recording.value = submittedValue;
+    inFlight.emplace_back(std::move(recording));
+    recording = Batch{};
+    isRecording = false;
+    return submittedValue;
+}
+
+void UploadManager::wait(const uint64_t value)
+{
+    assert(value <= submittedValue && "Waiting on an upload that has not been flushed");
+    vk::SemaphoreWaitInfo waitInfo{};
+    waitInfo.setSemaphores(timeline);
+    waitInfo.setValues(value);
+    VK_CHECK_RES(device.waitSemaphores(waitInfo, FENCE_TIMEOUT));
+    reclaim();
+}
+
+vk::SemaphoreSubmitInfo UploadManager::wait_info(const uint64_t value,
+                                                 const vk::PipelineStageFlags2 &stage) const
+{
+    vk::SemaphoreSubmitInfo waitInfo{};
+    waitInfo.setSemaphore(timeline);
+    waitInfo.setValue(value);
+    waitInfo.setStageMask(stage);
+    return waitInfo;
+}
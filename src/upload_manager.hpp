@@ -0,0 +1,97 @@
+#pragma once
+#ifndef USE_CXX20_MODULES
+#include <vulkan/vulkan.hpp>
+#else
+import vulkan;
+#endif
+
+#include "types.hpp"
+#include <deque>
+#include <span>
+#include <vector>
+
+class GpuProfiler;
+
+// Host to device uploads through a persistently mapped staging ring on the transfer queue.
+// Copies are recorded into an open batch and only submitted on flush(). Completion is tracked
+// with a timeline semaphore: other submissions wait on it on the GPU and the host only blocks
+// when a ring region is needed again or on an explicit wait().
+// If the transfer and graphics families differ, every resource is released by the transfer
+// queue and acquired by the graphics queue before the flushed value is signaled.
+class UploadManager
+{
+public:
+    UploadManager(const vk::Device &device,
+                  const VmaAllocator &allocator,
+                  const uint32_t transferQueueFamilyIndex,
+                  const uint32_t graphicsQueueFamilyIndex,
+                  const vk::DeviceSize ringSize = STAGING_RING_SIZE);
+    ~UploadManager() = default;
+
+    void destroy();
+
+    // The data is copied into the ring straight away, so it can be freed after the call
+    void upload_buffer(const Buffer &dst,
+                       const void *data,
+                       const vk::DeviceSize size,
+                       const vk::DeviceSize dstOffset = 0);
+    // Moves the image from undefined to general and fills its mips with tightly packed texels.
+    // mipOffsets holds the byte offset of each level in data. Empty fills the first mip only
+    void upload_image(const ImageData &dst,
+                      const void *data,
+                      const vk::DeviceSize size,
+                      const std::span<const vk::DeviceSize> mipOffsets = {});
+
+    // Submits the recorded copies. Returns the timeline value signaled once the resources
+    // can be used from the graphics queue
+    uint64_t flush();
+    void wait(const uint64_t value);
+    void flush_and_wait() { wait(flush()); }
+
+    // To make a graphics queue submission wait on an upload
+    vk::SemaphoreSubmitInfo wait_info(const uint64_t value,
+                                      const vk::PipelineStageFlags2 &stage
+                                      = vk::PipelineStageFlagBits2::eAllCommands) const;
+
+    // If set, every batch is timed on the transfer queue as an "upload" scope
+    GpuProfiler *profiler{nullptr};
+
+private:
+    const vk::Device &device;
+    const VmaAllocator &allocator;
+    const uint32_t transferFamily, graphicsFamily;
+    vk::Queue transferQueue, graphicsQueue;
+    vk::CommandPool transferPool, graphicsPool;
+    vk::Semaphore timeline;
+    uint64_t submittedValue{0};
+
+    // Ring. Busy bytes go from tail to head, wrapping around
+    Buffer ring;
+    vk::DeviceSize ringSize;
+    vk::DeviceSize head{0}, tail{0}, used{0};
+
+    struct Batch
+    {
+        vk::CommandBuffer transferCmd, graphicsCmd;
+        uint64_t value{0};
+        vk::DeviceSize ringEnd{0}, ringBytes{0};
+        uint32_t timestamps{0}; // Pair of the profiler, if any
+        std::vector<Buffer> dedicatedStaging; // Uploads larger than the ring
+    };
+    Batch recording;
+    bool isRecording{false};
+    std::deque<Batch> inFlight;
+    std::vector<Batch> freeBatches;
+
+    // Ownership transfers to record on both queues at flush
+    std::vector<vk::BufferMemoryBarrier2> bufferOwnership;
+    std::vector<vk::ImageMemoryBarrier2> imageOwnership;
+
+    bool needs_ownership_transfer() const { return transferFamily != graphicsFamily; }
+    void begin_batch();
+    // Returns the buffer and offset to copy from
+    std::pair<vk::Buffer, vk::DeviceSize> stage(const void *data, const vk::DeviceSize size);
+    bool try_allocate(const vk::DeviceSize size, vk::DeviceSize &offset);
+    void reclaim();
+    uint64_t completed_value() const;
+};
@@ -1,8 +1,14 @@
 #include "utils.hpp"
+#include "profiler.hpp"
+#include <algorithm>
+#include <cstring>
+#include <format>
 #include <fstream>
 #include <functional>
 #include <iostream>
 #include <print>
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include <stb_image_write.h>
 
 namespace utils {
 void transition_image(const vk::CommandBuffer &cmd,
@@ -173,27 +179,24 @@ void copy_to_buffer(const Buffer &buffer,
     vmaCopyMemoryToAllocation(allocator, data, buffer.allocation, offset, s);
 }
 
-ImageData create_image(const vk::Device &device,
-                       const VmaAllocator &allocator,
-                       const vk::CommandBuffer &cmd,
-                       const vk::Fence &fence,
-                       const vk::Queue &queue,
-                       const vk::Format &format,
-                       const vk::ImageUsageFlags &flags,
-                       const vk::Extent3D &extent,
-                       const void *data)
+ImageData allocate_image(const vk::Device &device,
+                         const VmaAllocator &allocator,
+                         const vk::Format &format,
+                         const vk::ImageUsageFlags &flags,
+                         const vk::Extent3D &extent,
+                         const uint32_t mipLevels,
+                         const vk::ComponentMapping &swizzle)
 {
     ImageData image;
 
     image.format = format;
     image.extent = extent;
-
-    const vk::ImageUsageFlags usageFlags = (data) ? flags | vk::ImageUsageFlagBits::eTransferDst
-                                                  : flags;
+    image.mipLevels = mipLevels;
 
     const vk::ImageCreateInfo imageCreateInfo = utils::init::image_create_info(format,
-                                                                               usageFlags,
-                                                                               extent);
+                                                                               flags,
+                                                                               extent,
+                                                                               mipLevels);
 
     VmaAllocationCreateInfo allocationCreateInfo{};
     allocationCreateInfo.usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE;
@@ -212,10 +215,28 @@ ImageData create_image(const vk::Device &device,
                                                  : vk::ImageAspectFlagBits::eColor;
 
     // Create the handle vk::ImageView. Not possible to do this with VMA
-    const vk::ImageViewCreateInfo imageViewCreateInfo
-        = utils::init::image_view_create_info(image, aspectFlags);
+    vk::ImageViewCreateInfo imageViewCreateInfo = utils::init::image_view_create_info(image,
+                                                                                      aspectFlags);
+    imageViewCreateInfo.setComponents(swizzle);
     image.imageView = device.createImageView(imageViewCreateInfo);
 
+    return image;
+}
+
+ImageData create_image(const vk::Device &device,
+                       const VmaAllocator &allocator,
+                       const vk::CommandBuffer &cmd,
+                       const vk::Fence &fence,
+                       const vk::Queue &queue,
+                       const vk::Format &format,
+                       const vk::ImageUsageFlags &flags,
+                       const vk::Extent3D &extent,
+                       const void *data)
+{
+    const vk::ImageUsageFlags usageFlags = (data) ? flags | vk::ImageUsageFlagBits::eTransferDst
+                                                  : flags;
+    ImageData image = allocate_image(device, allocator, format, usageFlags, extent);
+
     // Thanks to the extension UINIFIED_IMAGE_LAYOUTS, we can safely move to
     // the layout General and forget about layout transitions without paying
     // any performance tax. Stage flags set to none since we already wait for fences.
@@ -292,11 +313,189 @@ void copy_to_image(const vk::Device &device,
     utils::destroy_buffer(allocator, tmpBuffer);
 }
 
+std::vector<float> read_image(const vk::Device &device,
+                              const VmaAllocator &allocator,
+                              const vk::CommandBuffer &cmd,
+                              const vk::Fence &fence,
+                              const vk::Queue &queue,
+                              const ImageData &image)
+{
+    assert(image.format == vk::Format::eR32G32B32A32Sfloat && "Only RGBA32F read back");
+
+    const size_t numFloats = image.extent.width * image.extent.height * 4;
+    const vk::DeviceSize dataSize = numFloats * sizeof(float);
+    Buffer tmpBuffer = create_buffer(device,
+                                     allocator,
+                                     dataSize,
+                                     vk::BufferUsageFlagBits::eTransferDst,
+                                     VMA_MEMORY_USAGE_AUTO,
+                                     VMA_ALLOCATION_CREATE_MAPPED_BIT
+                                         | VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT);
+
+    utils::cmd_submit(device, queue, fence, cmd, [&](const vk::CommandBuffer &cmd) {
+        // Make the last shader writes visible to the copy
+        vk::MemoryBarrier2 barrier{};
+        barrier.setSrcStageMask(vk::PipelineStageFlagBits2::eAllCommands);
+        barrier.setSrcAccessMask(vk::AccessFlagBits2::eMemoryWrite);
+        barrier.setDstStageMask(vk::PipelineStageFlagBits2::eCopy);
+        barrier.setDstAccessMask(vk::AccessFlagBits2::eTransferRead);
+        vk::DependencyInfo depInfo{};
+        depInfo.setMemoryBarriers(barrier);
+        cmd.pipelineBarrier2(depInfo);
+
+        vk::ImageSubresourceLayers subResource{};
+        subResource.setAspectMask(vk::ImageAspectFlagBits::eColor);
+        subResource.setLayerCount(1);
+        vk::BufferImageCopy2 copyRegion{};
+        copyRegion.setImageExtent(image.extent);
+        copyRegion.setImageSubresource(subResource);
+        vk::CopyImageToBufferInfo2 copyInfo{};
+        copyInfo.setSrcImage(image.image);
+        copyInfo.setSrcImageLayout(vk::ImageLayout::eGeneral);
+        copyInfo.setDstBuffer(tmpBuffer.buffer);
+        copyInfo.setRegions(copyRegion);
+
+        cmd.copyImageToBuffer2(copyInfo);
+    });
+
+    std::vector<float> pixels(numFloats);
+    vmaCopyAllocationToMemory(allocator, tmpBuffer.allocation, 0, pixels.data(), dataSize);
+    utils::destroy_buffer(allocator, tmpBuffer);
+    return pixels;
+}
+
+// Portable float map, bottom-to-top RGB rows. Negative scale means little endian
+static void save_pfm(const std::filesystem::path &path,
+                     const std::vector<float> &pixels,
+                     const vk::Extent2D &extent)
+{
+    std::ofstream file(path, std::ofstream::binary);
+    if (!file.is_open())
+        throw std::runtime_error("Could not open " + path.string());
+
+    const std::string header = std::format("PF\n{} {}\n-1.0\n", extent.width, extent.height);
+    file.write(header.data(), header.size());
+    std::vector<float> row(extent.width * 3);
+    for (int y = static_cast<int>(extent.height) - 1; y >= 0; y--) {
+        for (uint32_t x = 0; x < extent.width; x++)
+            std::memcpy(&row[3 * x], &pixels[4 * (y * extent.width + x)], 3 * sizeof(float));
+        file.write(reinterpret_cast<const char *>(row.data()), row.size() * sizeof(float));
+    }
+}
+
+// Minimal single-part scanline OpenEXR: uncompressed, one scanline per block, FLOAT B, G, R
+// channels (they must be sorted alphabetically). Assumes a little endian host
+static void save_exr(const std::filesystem::path &path,
+                     const std::vector<float> &pixels,
+                     const vk::Extent2D &extent)
+{
+    std::vector<char> header;
+    auto put = [&header](const void *data, const size_t size) {
+        header.insert(header.end(),
+                      static_cast<const char *>(data),
+                      static_cast<const char *>(data) + size);
+    };
+    auto put_i32 = [&put](const int32_t v) { put(&v, sizeof(v)); };
+    auto put_f32 = [&put](const float v) { put(&v, sizeof(v)); };
+    auto put_attribute = [&](const char *name, const char *type, const int32_t size) {
+        put(name, std::strlen(name) + 1);
+        put(type, std::strlen(type) + 1);
+        put_i32(size);
+    };
+
+    const int32_t w = static_cast<int32_t>(extent.width), h = static_cast<int32_t>(extent.height);
+    put_i32(20000630); // Magic number
+    put_i32(2);        // Version 2, single-part scanline file
+
+    put_attribute("channels", "chlist", 3 * 18 + 1);
+    for (const char *channel : {"B", "G", "R"}) {
+        put(channel, 2);
+        put_i32(2); // FLOAT
+        put_i32(0); // pLinear + reserved
+        put_i32(1); // xSampling
+        put_i32(1); // ySampling
+    }
+    header.push_back(0);
+    put_attribute("compression", "compression", 1);
+    header.push_back(0); // NO_COMPRESSION
+    for (const char *window : {"dataWindow", "displayWindow"}) {
+        put_attribute(window, "box2i", 16);
+        put_i32(0);
+        put_i32(0);
+        put_i32(w - 1);
+        put_i32(h - 1);
+    }
+    put_attribute("lineOrder", "lineOrder", 1);
+    header.push_back(0); // INCREASING_Y
+    put_attribute("pixelAspectRatio", "float", 4);
+    put_f32(1.f);
+    put_attribute("screenWindowCenter", "v2f", 8);
+    put_f32(0.f);
+    put_f32(0.f);
+    put_attribute("screenWindowWidth", "float", 4);
+    put_f32(1.f);
+    header.push_back(0); // End of header
+
+    // Offset table, one entry per scanline block
+    const int32_t rowBytes = 3 * w * sizeof(float);
+    const uint64_t blockBytes = 2 * sizeof(int32_t) + rowBytes;
+    const uint64_t firstBlock = header.size() + h * sizeof(uint64_t);
+    for (int32_t y = 0; y < h; y++) {
+        const uint64_t offset = firstBlock + y * blockBytes;
+        put(&offset, sizeof(offset));
+    }
+
+    std::ofstream file(path, std::ofstream::binary);
+    if (!file.is_open())
+        throw std::runtime_error("Could not open " + path.string());
+    file.write(header.data(), header.size());
+
+    std::vector<float> row(3 * w);
+    for (int32_t y = 0; y < h; y++) {
+        for (int32_t x = 0; x < w; x++) {
+            const float *p = &pixels[4 * (y * w + x)];
+            row[x] = p[2];         // B
+            row[w + x] = p[1];     // G
+            row[2 * w + x] = p[0]; // R
+        }
+        file.write(reinterpret_cast<const char *>(&y), sizeof(y));
+        file.write(reinterpret_cast<const char *>(&rowBytes), sizeof(rowBytes));
+        file.write(reinterpret_cast<const char *>(row.data()), rowBytes);
+    }
+}
+
+void save_image(const std::filesystem::path &path,
+                const std::vector<float> &pixels,
+                const vk::Extent2D &extent)
+{
+    const std::string extension = path.extension().string();
+    if (extension == ".exr") {
+        save_exr(path, pixels, extent);
+    } else if (extension == ".pfm") {
+        save_pfm(path, pixels, extent);
+    } else if (extension == ".png") {
+        // Same mapping as the blit into the UNORM swapchain: clamp, no tone mapping
+        std::vector<uint8_t> ldr(pixels.size());
+        for (size_t i = 0; i < pixels.size(); i++)
+            ldr[i] = static_cast<uint8_t>(std::clamp(pixels[i], 0.f, 1.f) * 255.f + 0.5f);
+        if (!stbi_write_png(path.c_str(),
+                            extent.width,
+                            extent.height,
+                            4,
+                            ldr.data(),
+                            extent.width * 4))
+            throw std::runtime_error("Could not write " + path.string());
+    } else {
+        throw std::runtime_error("Unsupported image extension: " + extension);
+    }
+}
+
 void cmd_submit(const vk::Device &device,
                 const vk::Queue &queue,
                 const vk::Fence &fence,
                 const vk::CommandBuffer &cmd,
-                std::function<void(const vk::CommandBuffer &cmd)> &&function)
+                std::function<void(const vk::CommandBuffer &cmd)> &&function,
+                const std::vector<vk::SemaphoreSubmitInfo> &waitInfos)
 {
     // We should be good to go without waitForFences() and reset() here
     device.resetFences(fence);
@@ -308,8 +507,13 @@ void cmd_submit(const vk::Device &device,
     cmdBegin.setFlags(vk::CommandBufferUsageFlagBits::eOneTimeSubmit);
     cmd.begin(cmdBegin);
 
-    // Function to record
+    // Function to record, timed if a profiler section is open
+    GpuProfiler::Section *section = GpuProfiler::Section::active;
+    if (section)
+        section->begin(cmd);
     function(cmd);
+    if (section)
+        section->end(cmd);
 
     // Do not record anything else
     cmd.end();
@@ -319,11 +523,15 @@ void cmd_submit(const vk::Device &device,
     cmdInfo.setDeviceMask(1);
     vk::SubmitInfo2 submitInfo{};
     submitInfo.setCommandBufferInfos(cmdInfo);
+    submitInfo.setWaitSemaphoreInfos(waitInfos);
 
     // submit command buffer to the queue and execute it.
     // Fence will block the host until the commands in cmd finish execution
     queue.submit2(submitInfo, fence);
     VK_CHECK_RES(device.waitForFences(fence, vk::True, FENCE_TIMEOUT));
+
+    if (section)
+        section->collect();
 }
 
 void copy_to_device_buffer(const Buffer &buffer,
@@ -408,14 +616,15 @@ void destroy_swapchain(const vk::Device &device,
 namespace init {
 vk::ImageCreateInfo image_create_info(const vk::Format &format,
                                       const vk::ImageUsageFlags &flags,
-                                      const vk::Extent3D &extent)
+                                      const vk::Extent3D &extent,
+                                      const uint32_t mipLevels)
 {
     vk::ImageCreateInfo imageCreateInfo{};
     imageCreateInfo.setImageType((extent.depth > 1) ? vk::ImageType::e3D : vk::ImageType::e2D);
     imageCreateInfo.setFormat(format);
     imageCreateInfo.setExtent(extent);
     imageCreateInfo.setUsage(flags);
-    imageCreateInfo.setMipLevels(1);
+    imageCreateInfo.setMipLevels(mipLevels);
     imageCreateInfo.setArrayLayers(1);
     imageCreateInfo.setSamples(vk::SampleCountFlagBits::e1);
     imageCreateInfo.setTiling(vk::ImageTiling::eOptimal);
@@ -434,7 +643,7 @@ vk::ImageViewCreateInfo image_view_create_info(const ImageData &image,
     vk::ImageSubresourceRange imSubResRan{};
     imSubResRan.setAspectMask(aspectMask);
     imSubResRan.setBaseMipLevel(0);
-    imSubResRan.setLevelCount(1);
+    imSubResRan.setLevelCount(image.mipLevels);
     imSubResRan.setBaseArrayLayer(0);
     imSubResRan.setLayerCount(1);
     imageViewCreateInfo.setSubresourceRange(imSubResRan);
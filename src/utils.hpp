@@ -36,6 +36,15 @@ Buffer create_buffer(const vk::Device &device,
                      const VmaAllocationCreateFlags &allocationFlags = 0,
                      const vk::DeviceSize alignment = 0);
 
+// Image and view only, left in the undefined layout
+ImageData allocate_image(const vk::Device &device,
+                         const VmaAllocator &allocator,
+                         const vk::Format &format,
+                         const vk::ImageUsageFlags &flags,
+                         const vk::Extent3D &extent,
+                         const uint32_t mipLevels = 1,
+                         const vk::ComponentMapping &swizzle = {});
+
 ImageData create_image(const vk::Device &device,
                        const VmaAllocator &allocator,
                        const vk::CommandBuffer &cmd,
@@ -55,6 +64,20 @@ void copy_to_image(const vk::Device &device,
                    const vk::Extent3D &extent,
                    const void *data);
 
+// Reads back a eR32G32B32A32Sfloat image into host memory. Row-major RGBA
+std::vector<float> read_image(const vk::Device &device,
+                              const VmaAllocator &allocator,
+                              const vk::CommandBuffer &cmd,
+                              const vk::Fence &fence,
+                              const vk::Queue &queue,
+                              const ImageData &image);
+
+// Writes row-major RGBA pixels. The format follows the extension: .png (clamped to 8 bits),
+// .exr or .pfm (32-bit float)
+void save_image(const std::filesystem::path &path,
+                const std::vector<float> &pixels,
+                const vk::Extent2D &extent);
+
 void destroy_buffer(const VmaAllocator &allocator, const Buffer &buffer);
 
 void destroy_image(const vk::Device &device, const VmaAllocator &allocator, const ImageData &image);
@@ -73,11 +96,13 @@ vk::ShaderModule load_shader(const vk::Device &device, const std::string &filePa
 
 uint32_t align_up(uint32_t x, uint32_t a);
 
+// Blocking one-off submission. It can also wait on semaphores, e.g. uploads still in flight
 void cmd_submit(const vk::Device &device,
                 const vk::Queue &queue,
                 const vk::Fence &fence,
                 const vk::CommandBuffer &cmd,
-                std::function<void(const vk::CommandBuffer &cmd)> &&function);
+                std::function<void(const vk::CommandBuffer &cmd)> &&function,
+                const std::vector<vk::SemaphoreSubmitInfo> &waitInfos = {});
 
 void copy_to_device_buffer(const Buffer &buffer,
                            const vk::Device &device,
@@ -94,7 +119,8 @@ std::filesystem::path load_file_from_window(const std::vector<nfdu8filteritem_t>
 namespace init {
 vk::ImageCreateInfo image_create_info(const vk::Format &format,
                                       const vk::ImageUsageFlags &flags,
-                                      const vk::Extent3D &extent);
+                                      const vk::Extent3D &extent,
+                                      const uint32_t mipLevels = 1);
 
 vk::ImageViewCreateInfo image_view_create_info(const ImageData &image,
                                                const vk::ImageAspectFlags &aspectMask);
@@ -0,0 +1,285 @@
+#include "wavefront.hpp"
+#include "utils.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <utility>
+
+namespace {
+// Every stage writes something the next one reads, some of it as indirect dispatch arguments
+void stage_barrier(const vk::CommandBuffer &cmd)
+{
+    vk::MemoryBarrier2 barrier{};
+    barrier.setSrcStageMask(vk::PipelineStageFlagBits2::eComputeShader);
+    barrier.setSrcAccessMask(vk::AccessFlagBits2::eShaderStorageWrite);
+    barrier.setDstStageMask(vk::PipelineStageFlagBits2::eComputeShader
+                            | vk::PipelineStageFlagBits2::eDrawIndirect);
+    barrier.setDstAccessMask(vk::AccessFlagBits2::eShaderStorageRead
+                             | vk::AccessFlagBits2::eShaderStorageWrite
+                             | vk::AccessFlagBits2::eIndirectCommandRead);
+    vk::DependencyInfo depInfo{};
+    depInfo.setMemoryBarriers(barrier);
+    cmd.pipelineBarrier2(depInfo);
+}
+
+uint32_t group_count(const uint32_t size, const uint32_t groupSize)
+{
+    return (size + groupSize - 1) / groupSize;
+}
+} // namespace
+
+WavefrontRenderer::WavefrontRenderer(const vk::Device &device,
+                                     const VmaAllocator &allocator,
+                                     const vk::PipelineCache &pipelineCache,
+                                     const std::vector<vk::DescriptorSetLayout> &descSetLayouts)
+    : device{device}
+    , allocator{allocator}
+    , pipelineCache{pipelineCache}
+{
+    modules[eGenerate] = utils::load_shader(device, WAVEFRONT_GENERATE_SHADER);
+    modules[eControl] = utils::load_shader(device, WAVEFRONT_CONTROL_SHADER);
+    modules[eExtend] = utils::load_shader(device, WAVEFRONT_EXTEND_SHADER);
+    modules[eScatter] = utils::load_shader(device, WAVEFRONT_SCATTER_SHADER);
+    modules[eShade] = utils::load_shader(device, WAVEFRONT_SHADE_SHADER);
+    for (uint32_t c = 1; c < eMaterialClassCount; c++)
+        modules[eShade + c] = modules[eShade];
+    modules[eShadow] = utils::load_shader(device, WAVEFRONT_SHADOW_SHADER);
+    modules[eAccumulate] = utils::load_shader(device, WAVEFRONT_ACCUMULATE_SHADER);
+
+    vk::PushConstantRange pushConstantRange{};
+    pushConstantRange.setOffset(0);
+    pushConstantRange.setSize(sizeof(WavefrontPush));
+    pushConstantRange.setStageFlags(vk::ShaderStageFlagBits::eCompute);
+
+    vk::PipelineLayoutCreateInfo pipelineLayoutCreateInfo{};
+    pipelineLayoutCreateInfo.setPushConstantRanges(pushConstantRange);
+    pipelineLayoutCreateInfo.setSetLayouts(descSetLayouts);
+    pipelineLayout = device.createPipelineLayout(pipelineLayoutCreateInfo);
+}
+
+void WavefrontRenderer::build_pipelines(const SpecializationConstantsClosestHit &constantsCH,
+                                        const SpecializationConstantsMiss &constantsMiss)
+{
+    destroy_pipelines();
+    pipelines = create_pipelines(constantsCH, constantsMiss);
+}
+
+WavefrontRenderer::Pipelines WavefrontRenderer::create_pipelines(
+    const SpecializationConstantsClosestHit &constantsCH,
+    const SpecializationConstantsMiss &constantsMiss) const
+{
+    // Extend: the environment, like the miss shader
+    std::array<vk::SpecializationMapEntry, 1> specMapEntriesMiss = {
+        vk::SpecializationMapEntry{0,
+                                   offsetof(SpecializationConstantsMiss, envMap),
+                                   sizeof(vk::Bool32)}};
+    vk::SpecializationInfo specInfoMiss{};
+    specInfoMiss.setMapEntries(specMapEntriesMiss);
+    specInfoMiss.setDataSize(sizeof(SpecializationConstantsMiss));
+    specInfoMiss.setPData(&constantsMiss);
+
+    // Shade: one pipeline per material class, like the hit groups
+    std::array<vk::SpecializationMapEntry, 2> specMapEntriesShade
+        = {vk::SpecializationMapEntry{3,
+                                      offsetof(SpecializationConstantsClosestHit, presampled),
+                                      sizeof(vk::Bool32)},
+           vk::SpecializationMapEntry{4,
+                                      offsetof(SpecializationConstantsClosestHit, materialClass),
+                                      sizeof(uint32_t)}};
+    std::array<SpecializationConstantsClosestHit, eMaterialClassCount> classConstants;
+    std::array<vk::SpecializationInfo, eMaterialClassCount> specInfosShade;
+
+    std::array<vk::ComputePipelineCreateInfo, eStageCount> pipelineInfos;
+    for (uint32_t s = 0; s < eStageCount; s++) {
+        vk::PipelineShaderStageCreateInfo stage{};
+        stage.setPName("main");
+        stage.setStage(vk::ShaderStageFlagBits::eCompute);
+        stage.setModule(modules[s]);
+        if (s == eExtend)
+            stage.setPSpecializationInfo(&specInfoMiss);
+        if (s >= eShade && s < eShadow) {
+            const uint32_t c = s - eShade;
+            classConstants[c] = constantsCH;
+            classConstants[c].materialClass = c;
+            specInfosShade[c].setMapEntries(specMapEntriesShade);
+            specInfosShade[c].setDataSize(sizeof(SpecializationConstantsClosestHit));
+            specInfosShade[c].setPData(&classConstants[c]);
+            stage.setPSpecializationInfo(&specInfosShade[c]);
+        }
+        pipelineInfos[s].setStage(stage);
+        pipelineInfos[s].setLayout(pipelineLayout);
+    }
+
+    auto [res, val] = device.createComputePipelines(pipelineCache, pipelineInfos);
+    VK_CHECK_RES(res);
+    Pipelines newPipelines{};
+    std::copy(val.begin(), val.end(), newPipelines.begin());
+    return newPipelines;
+}
+
+WavefrontRenderer::Pipelines WavefrontRenderer::set_pipelines(const Pipelines &newPipelines)
+{
+    return std::exchange(pipelines, newPipelines);
+}
+
+void WavefrontRenderer::resize(const vk::Extent2D &newExtent)
+{
+    destroy_streams();
+    extent = newExtent;
+    const vk::DeviceSize rays = vk::DeviceSize{extent.width} * extent.height;
+
+    // All the streams in one allocation, each one aligned to 16 bytes
+    vk::DeviceSize size = 0;
+    const auto suballocate = [&](const vk::DeviceSize elementSize) {
+        const vk::DeviceSize offset = size;
+        size += (rays * elementSize + 15) & ~vk::DeviceSize{15};
+        return offset;
+    };
+    WavefrontStreams streams{};
+    for (uint32_t q = 0; q < 2; q++) {
+        streams.rayOrigin[q] = suballocate(sizeof(glm::vec4));
+        streams.rayDirection[q] = suballocate(sizeof(glm::vec4));
+        streams.rayPixel[q] = suballocate(sizeof(uint32_t));
+    }
+    streams.pathThroughput = suballocate(sizeof(glm::vec4));
+    streams.pathRadiance = suballocate(sizeof(glm::vec4));
+    streams.pathRng = suballocate(sizeof(uint32_t));
+    streams.hitInfo = suballocate(sizeof(glm::uvec4));
+    streams.hitT = suballocate(sizeof(float));
+    streams.hitObjectToWorld = suballocate(sizeof(glm::mat4x3));
+    streams.hitBin = suballocate(sizeof(uint32_t));
+    streams.shadeQueue = suballocate(sizeof(uint32_t));
+    streams.shadowOrigin = suballocate(sizeof(glm::vec4));
+    streams.shadowDirection = suballocate(sizeof(glm::vec4));
+    streams.shadowContribution = suballocate(sizeof(glm::vec4));
+    streams.shadowPixel = suballocate(sizeof(uint32_t));
+
+    streamBuffer = utils::create_buffer(device,
+                                        allocator,
+                                        size,
+                                        vk::BufferUsageFlagBits::eStorageBuffer
+                                            | vk::BufferUsageFlagBits::eShaderDeviceAddress,
+                                        VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE);
+    counterBuffer = utils::create_buffer(device,
+                                         allocator,
+                                         sizeof(WavefrontCounters),
+                                         vk::BufferUsageFlagBits::eStorageBuffer
+                                             | vk::BufferUsageFlagBits::eIndirectBuffer
+                                             | vk::BufferUsageFlagBits::eShaderDeviceAddress,
+                                         VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE);
+
+    // Offsets to addresses
+    vk::DeviceAddress *addresses = reinterpret_cast<vk::DeviceAddress *>(&streams);
+    for (size_t i = 0; i < sizeof(WavefrontStreams) / sizeof(vk::DeviceAddress); i++)
+        addresses[i] += streamBuffer.bufferAddress;
+    streams.counters = counterBuffer.bufferAddress;
+
+    streamsHeader = utils::create_buffer(device,
+                                         allocator,
+                                         sizeof(WavefrontStreams),
+                                         vk::BufferUsageFlagBits::eStorageBuffer
+                                             | vk::BufferUsageFlagBits::eShaderDeviceAddress,
+                                         VMA_MEMORY_USAGE_AUTO,
+                                         VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT
+                                             | VMA_ALLOCATION_CREATE_MAPPED_BIT);
+    utils::copy_to_buffer(streamsHeader, allocator, &streams, sizeof(WavefrontStreams));
+}
+
+void WavefrontRenderer::record(const vk::CommandBuffer &cmd,
+                               const std::vector<vk::DescriptorSet> &descriptorSets,
+                               const RayPush &rayPush) const
+{
+    vk::BindDescriptorSetsInfo bindSetsInfo{};
+    bindSetsInfo.setDescriptorSets(descriptorSets);
+    bindSetsInfo.setStageFlags(vk::ShaderStageFlagBits::eCompute);
+    bindSetsInfo.setLayout(pipelineLayout);
+    bindSetsInfo.setFirstSet(0);
+    cmd.bindDescriptorSets2(bindSetsInfo);
+
+    WavefrontPush push{};
+    push.rayPush = rayPush;
+    push.streams = streamsHeader.bufferAddress;
+    push.width = extent.width;
+    push.height = extent.height;
+    push.depth = 1;
+
+    const auto bind = [&](const Stage stage) {
+        cmd.bindPipeline(vk::PipelineBindPoint::eCompute, pipelines[stage]);
+        vk::PushConstantsInfo pushInfo{};
+        pushInfo.setLayout(pipelineLayout);
+        pushInfo.setStageFlags(vk::ShaderStageFlagBits::eCompute);
+        pushInfo.setSize(sizeof(WavefrontPush));
+        pushInfo.setValues<WavefrontPush>(push);
+        pushInfo.setOffset(0);
+        cmd.pushConstants2(pushInfo);
+    };
+    const auto control = [&](const Phase phase) {
+        push.phase = phase;
+        bind(eControl);
+        cmd.dispatch(1, 1, 1);
+        stage_barrier(cmd);
+    };
+    const auto dispatch_indirect = [&](const Stage stage, const vk::DeviceSize offset) {
+        bind(stage);
+        cmd.dispatchIndirect(counterBuffer.buffer, offset);
+    };
+
+    bind(eGenerate);
+    cmd.dispatch(group_count(extent.width, 8), group_count(extent.height, 8), 1);
+    stage_barrier(cmd);
+
+    // Recorded up to the maximum depth. The queues drain on the GPU and the remaining dispatches
+    // get zero groups
+    for (uint32_t depth = 1; depth <= rayPush.pathDepth; depth++) {
+        push.depth = depth;
+
+        control(ePhaseExtend);
+        dispatch_indirect(eExtend, offsetof(WavefrontCounters, extendArgs));
+        stage_barrier(cmd);
+
+        control(ePhaseShade);
+        dispatch_indirect(eScatter, offsetof(WavefrontCounters, extendArgs));
+        stage_barrier(cmd);
+        // The classes only share the append counters
+        for (uint32_t c = 0; c < eMaterialClassCount; c++)
+            dispatch_indirect(static_cast<Stage>(eShade + c),
+                              offsetof(WavefrontCounters, shadeArgs)
+                                  + c * sizeof(vk::DispatchIndirectCommand));
+        stage_barrier(cmd);
+
+        control(ePhaseShadow);
+        dispatch_indirect(eShadow, offsetof(WavefrontCounters, shadowArgs));
+        stage_barrier(cmd);
+    }
+
+    bind(eAccumulate);
+    cmd.dispatch(group_count(extent.width, 8), group_count(extent.height, 8), 1);
+}
+
+void WavefrontRenderer::destroy_pipelines()
+{
+    for (vk::Pipeline &pipeline : pipelines) {
+        if (pipeline)
+            device.destroyPipeline(pipeline);
+        pipeline = nullptr;
+    }
+}
+
+void WavefrontRenderer::destroy_streams()
+{
+    if (!streamBuffer.buffer)
+        return;
+    utils::destroy_buffer(allocator, streamBuffer);
+    utils::destroy_buffer(allocator, counterBuffer);
+    utils::destroy_buffer(allocator, streamsHeader);
+    streamBuffer = {};
+}
+
+void WavefrontRenderer::destroy()
+{
+    destroy_pipelines();
+    destroy_streams();
+    for (uint32_t s = 0; s < eStageCount; s++)
+        if (s <= eShade || s >= eShadow)
+            device.destroyShaderModule(modules[s]);
+    device.destroyPipelineLayout(pipelineLayout);
+}
@@ -0,0 +1,110 @@
+#pragma once
+#ifndef USE_CXX20_MODULES
+#include <vulkan/vulkan.hpp>
+#else
+import vulkan;
+#endif
+
+#include "types.hpp"
+#include <array>
+#include <vector>
+
+// Mirrors Counters in wavefront.glsl. The dispatch arguments come first so that the control
+// stage can write them in place and the indirect dispatches read them at their offset
+struct WavefrontCounters
+{
+    vk::DispatchIndirectCommand extendArgs;
+    vk::DispatchIndirectCommand shadowArgs;
+    std::array<vk::DispatchIndirectCommand, eMaterialClassCount> shadeArgs;
+    uint32_t rayCount[2];
+    uint32_t shadowCount;
+    uint32_t classStart[eMaterialClassCount + 1];
+    uint32_t binCount[eMaterialClassCount * WAVEFRONT_DIRECTION_BINS];
+    uint32_t binCursor[eMaterialClassCount * WAVEFRONT_DIRECTION_BINS];
+};
+
+// Mirrors Streams in wavefront.glsl
+struct WavefrontStreams
+{
+    vk::DeviceAddress counters;
+    std::array<vk::DeviceAddress, 2> rayOrigin, rayDirection, rayPixel;
+    vk::DeviceAddress pathThroughput, pathRadiance, pathRng;
+    vk::DeviceAddress hitInfo, hitT, hitObjectToWorld, hitBin, shadeQueue;
+    vk::DeviceAddress shadowOrigin, shadowDirection, shadowContribution, shadowPixel;
+};
+
+struct WavefrontPush
+{
+    RayPush rayPush;
+    vk::DeviceAddress streams;
+    uint32_t width;
+    uint32_t height;
+    uint32_t depth; // Of the rays in flight, from 1
+    uint32_t phase; // WavefrontRenderer::Phase
+};
+static_assert(sizeof(WavefrontPush) == 64);
+
+// Path tracer split into compute stages over ray streams, with ray queries instead of an SBT.
+// Every bounce extends the queued rays, bins the hits by material class and direction octant,
+// shades each class with its own specialized pipeline and traces the shadow rays it appended.
+// Queue sizes live on the GPU and drive indirect dispatches, so the host never reads them back.
+// Always runs the iterative integrator, up to RayPush::pathDepth vertices
+class WavefrontRenderer
+{
+public:
+    enum Stage {
+        eGenerate,
+        eControl,
+        eExtend,
+        eScatter,
+        eShade,
+        eShadow = eShade + eMaterialClassCount,
+        eAccumulate,
+        eStageCount
+    };
+    enum Phase : uint32_t { ePhaseExtend, ePhaseShade, ePhaseShadow };
+    using Pipelines = std::array<vk::Pipeline, eStageCount>;
+
+    // descSetLayouts are the ones of the RT pipeline: {rt, UAB}
+    WavefrontRenderer(const vk::Device &device,
+                      const VmaAllocator &allocator,
+                      const vk::PipelineCache &pipelineCache,
+                      const std::vector<vk::DescriptorSetLayout> &descSetLayouts);
+    ~WavefrontRenderer() = default;
+
+    // Same constants as the RT pipeline. Not in use by any frame in flight
+    void build_pipelines(const SpecializationConstantsClosestHit &constantsCH = {},
+                         const SpecializationConstantsMiss &constantsMiss = {});
+
+    // Compiles a variant without touching the current one. Thread safe
+    Pipelines create_pipelines(const SpecializationConstantsClosestHit &constantsCH,
+                               const SpecializationConstantsMiss &constantsMiss) const;
+    // Makes a variant current and returns the previous one, which frames in flight may still use
+    Pipelines set_pipelines(const Pipelines &newPipelines);
+
+    // Streams for one ray per pixel. Not in use by any frame in flight
+    void resize(const vk::Extent2D &extent);
+
+    // One sample per pixel into the draw and accumulation images. The caller orders it after
+    // the previous frame, which reuses the same streams
+    void record(const vk::CommandBuffer &cmd,
+                const std::vector<vk::DescriptorSet> &descriptorSets,
+                const RayPush &rayPush) const;
+
+    void destroy();
+
+private:
+    const vk::Device &device;
+    const VmaAllocator &allocator;
+    const vk::PipelineCache pipelineCache;
+
+    vk::PipelineLayout pipelineLayout;
+    std::array<vk::ShaderModule, eStageCount> modules; // The shade stages share their module
+    Pipelines pipelines{};
+
+    vk::Extent2D extent;
+    Buffer streamBuffer, counterBuffer, streamsHeader;
+
+    void destroy_pipelines();
+    void destroy_streams();
+};